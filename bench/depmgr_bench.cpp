@@ -0,0 +1,138 @@
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <fmt/format.h>
+
+#include "cmake.hpp"
+#include "manifest_generator.hpp"
+#include "package.hpp"
+#include "toml.hpp"
+
+namespace fs = std::filesystem;
+
+static std::atomic<size_t> allocation_count{0};
+
+void *operator new(size_t size)
+{
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  if (void *ptr = std::malloc(size == 0 ? 1 : size)) { return ptr; }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+
+// tomlc99 allocates with malloc, its allocations are counted through its hook.
+static void *counting_malloc(size_t size)
+{
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  return std::malloc(size);
+}
+
+[[maybe_unused]] static const bool toml_allocations_counted = (toml_set_memutil(counting_malloc, std::free), true);
+
+namespace {
+
+toml_document parse_manifest(size_t package_count)
+{
+  return toml_document::parse(generate_manifest(package_count), "generated manifest");
+}
+
+/// Counts allocations made during the timed loop and reports them per package.
+class allocation_scope
+{
+  benchmark::State &state;
+  size_t start;
+
+public:
+  explicit allocation_scope(benchmark::State &state)
+      : state(state), start(allocation_count.load(std::memory_order_relaxed))
+  {}
+  ~allocation_scope()
+  {
+    size_t allocations = allocation_count.load(std::memory_order_relaxed) - start;
+    double processed = double(state.iterations()) * double(state.range(0));
+    state.counters["allocs_per_package"] = double(allocations) / processed;
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+  }
+};
+
+fs::path scratch_work_dir()
+{
+  static const fs::path work_dir = []() {
+    fs::path path = fs::temp_directory_path() / "depmgr_bench";
+    fs::create_directories(path / "src");
+    return path;
+  }();
+  return work_dir;
+}
+
+void bm_toml_parse(benchmark::State &state)
+{
+  std::string source = generate_manifest(state.range(0));
+
+  allocation_scope allocations(state);
+  for (auto _ : state) {
+    toml_document document = toml_document::parse(source, "generated manifest");
+    benchmark::DoNotOptimize(&document.root());
+  }
+  state.SetBytesProcessed(state.iterations() * int64_t(source.size()));
+}
+
+void bm_parse_package(benchmark::State &state)
+{
+  toml_document manifest = parse_manifest(state.range(0));
+
+  allocation_scope allocations(state);
+  for (auto _ : state) {
+    package_table packages = parse_packages(manifest.root(), fs::current_path(), false);
+    benchmark::DoNotOptimize(packages.names.data());
+  }
+}
+
+void bm_cmake_option_list(benchmark::State &state)
+{
+  toml_document manifest = parse_manifest(state.range(0));
+  std::vector<const toml_node *> tables;
+  for (const auto &config : manifest.root()) { tables.push_back(config.table("options")); }
+
+  allocation_scope allocations(state);
+  for (auto _ : state) {
+    for (const auto *table : tables) {
+      cmake_option_list options(*table);
+      benchmark::DoNotOptimize(options.options.data());
+    }
+  }
+}
+
+void bm_write_cmake_script(benchmark::State &state)
+{
+  toml_document manifest = parse_manifest(state.range(0));
+  auto packages = parse_packages(manifest.root(), fs::current_path(), false);
+  packages.work_dir = scratch_work_dir();
+
+  // Stamps are read once per generation, when the graph is merged.
+  packages.settle_sources();
+
+  allocation_scope allocations(state);
+  for (auto _ : state) {
+    fmt::memory_buffer out;
+    write_cmake_script(out, packages);
+    benchmark::DoNotOptimize(out.data());
+  }
+}
+
+} // namespace
+
+BENCHMARK(bm_toml_parse)->RangeMultiplier(10)->Range(10, 100000)->Unit(benchmark::kMicrosecond);
+BENCHMARK(bm_parse_package)->RangeMultiplier(10)->Range(10, 100000)->Unit(benchmark::kMicrosecond);
+BENCHMARK(bm_cmake_option_list)->RangeMultiplier(10)->Range(10, 100000)->Unit(benchmark::kMicrosecond);
+BENCHMARK(bm_write_cmake_script)->RangeMultiplier(10)->Range(10, 100000)->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,83 @@
+#include "manifest_generator.hpp"
+
+#include <iterator>
+#include <random>
+
+#include <fmt/format.h>
+
+std::string generate_manifest(size_t package_count, uint32_t seed)
+{
+  std::mt19937 random(seed);
+  fmt::memory_buffer out;
+  auto it = std::back_inserter(out);
+
+  for (size_t i = 0; i < package_count; i++) {
+    std::string name = fmt::format("pkg_{:06}", i);
+    fmt::format_to(it, "[{}]\n", name);
+
+    switch (i % 6) {
+    case 0:
+      fmt::format_to(it, "path = \"vendor/{}\"\n", name);
+      break;
+    case 1:
+      fmt::format_to(it, "svn = \"https://svn.example.com/repos/{}/trunk\"\nrev = \"{}\"\n", name, random() % 100000);
+      break;
+    case 2:
+      fmt::format_to(it,
+        "git = \"https://git.example.com/{0}.git\"\n"
+        "tag = \"v{1}.{2}.{3}\"\n"
+        "submodules = [\"third_party/a\", \"third_party/b\"]\n",
+        name,
+        random() % 10,
+        random() % 100,
+        random() % 100);
+      break;
+    case 3:
+      fmt::format_to(it, "hg = \"https://hg.example.com/{}\"\ntag = \"release-{}\"\n", name, random() % 1000);
+      break;
+    case 4:
+      fmt::format_to(it,
+        "cvs = \":pserver:anonymous@cvs.example.com:/cvsroot/{0}\"\nmodule = \"{0}\"\ntag = \"REL_{1}\"\n",
+        name,
+        random() % 1000);
+      break;
+    case 5:
+      fmt::format_to(it,
+        "url = \"https://downloads.example.com/{0}-{1}.tar.gz\"\n"
+        "hash = \"SHA256={2:016x}{3:016x}{4:016x}{5:016x}\"\n"
+        "headers = [\"X-Mirror: primary\", \"Accept: application/gzip\"]\n",
+        name,
+        random() % 1000,
+        uint64_t(random()) << 32 | random(),
+        uint64_t(random()) << 32 | random(),
+        uint64_t(random()) << 32 | random(),
+        uint64_t(random()) << 32 | random());
+      break;
+    }
+
+    if (i % 7 == 0) { fmt::format_to(it, "vendor = true\n"); }
+    fmt::format_to(it, "advanced-variables = [\"{0}_BUILD_TESTS\", \"{0}_BUILD_DOCS\"]\n", name);
+
+    fmt::format_to(it, "\n[{}.options]\n", name);
+    size_t option_count = 2 + random() % 6;
+    for (size_t j = 0; j < option_count; j++) {
+      switch (j % 4) {
+      case 0:
+        fmt::format_to(it, "{}_OPTION_{} = \"value-{}\"\n", name, j, random() % 100);
+        break;
+      case 1:
+        fmt::format_to(it, "{}_OPTION_{} = {}\n", name, j, random() % 2 == 0 ? "true" : "false");
+        break;
+      case 2:
+        fmt::format_to(it, "{}_OPTION_{} = {}\n", name, j, random() % 4096);
+        break;
+      case 3:
+        fmt::format_to(it, "{}_OPTION_{} = {}.5\n", name, j, random() % 100);
+        break;
+      }
+    }
+    fmt::format_to(it, "\n");
+  }
+
+  return fmt::to_string(out);
+}
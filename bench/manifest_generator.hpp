@@ -0,0 +1,14 @@
+#ifndef _DEPMGR_BENCH_MANIFEST_GENERATOR_HPP_
+#define _DEPMGR_BENCH_MANIFEST_GENERATOR_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/// Generates a dependencies.toml with `package_count` packages cycling through
+/// all remote kinds. Every package gets an options table mixing strings,
+/// booleans, integers and floats, plus the array keys its kind accepts. The
+/// output only depends on the arguments.
+std::string generate_manifest(size_t package_count, uint32_t seed = 0x5eed);
+
+#endif /* _DEPMGR_BENCH_MANIFEST_GENERATOR_HPP_ */
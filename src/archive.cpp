@@ -0,0 +1,342 @@
+#include "archive.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <zlib.h>
+
+#include "util.hpp"
+
+namespace fs = std::filesystem;
+
+static constexpr size_t BLOCK_SIZE = 512;
+static constexpr size_t INFLATE_CHUNK = 256 * 1024;
+
+struct archive_extractor::inflate_state
+{
+  z_stream stream{};
+  std::unique_ptr<uint8_t[]> output = std::make_unique<uint8_t[]>(INFLATE_CHUNK);
+
+  inflate_state()
+  {
+    // 15 window bits + 32 lets zlib detect gzip and zlib headers by itself.
+    if (inflateInit2(&stream, 15 + 32) != Z_OK) { critical_error("can't initialize zlib"); }
+  }
+  ~inflate_state() { inflateEnd(&stream); }
+};
+
+archive_extractor::archive_extractor(fs::path dest) : dest(std::move(dest)) { fs::create_directories(this->dest); }
+
+archive_extractor::~archive_extractor() = default;
+
+void archive_extractor::feed(const uint8_t *data, size_t len)
+{
+  if (!detected && len > 0) {
+    detected = true;
+    if (len >= 2 && data[0] == 0x1f && data[1] == 0x8b) { inflater = std::make_unique<inflate_state>(); }
+  }
+
+  if (!inflater) {
+    feed_tar(data, len);
+    return;
+  }
+
+  z_stream &stream = inflater->stream;
+  stream.next_in = const_cast<uint8_t *>(data);
+  stream.avail_in = static_cast<uInt>(len);
+  while (stream.avail_in > 0) {
+    stream.next_out = inflater->output.get();
+    stream.avail_out = INFLATE_CHUNK;
+    int result = inflate(&stream, Z_NO_FLUSH);
+    if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+      remote_failure("corrupt gzip stream: {}", stream.msg != nullptr ? stream.msg : "unknown error");
+    }
+    feed_tar(inflater->output.get(), INFLATE_CHUNK - stream.avail_out);
+
+    // Concatenated gzip members are valid, keep going after each one.
+    if (result == Z_STREAM_END && stream.avail_in > 0) { inflateReset(&stream); }
+    if (result == Z_BUF_ERROR) { break; }
+  }
+}
+
+/// Whether `path`, canonical, is `root` or inside of it.
+static bool is_within(const fs::path &root, const fs::path &path)
+{
+  fs::path relative = path.lexically_relative(root);
+  return !relative.empty() && *relative.begin() != "..";
+}
+
+/// Removes whatever an earlier entry left at `path`, so a link can take its
+/// place. Directories aren't replaced, their contents could be redirected.
+static std::optional<std::string> clear_link_path(const fs::path &path)
+{
+  if (fs::is_directory(fs::symlink_status(path))) return fmt::format("link {} replaces a directory", path.string());
+  fs::remove(path);
+  return std::nullopt;
+}
+
+std::optional<fs::path> path_within(const fs::path &dest, std::string_view name)
+{
+  fs::path relative = fs::path(name).lexically_normal();
+  if (relative.is_absolute() || relative.has_root_name() || (!relative.empty() && *relative.begin() == "..")) {
+    return std::nullopt;
+  }
+  return dest / relative;
+}
+
+std::optional<std::string> create_parents_within(const fs::path &dest, const fs::path &path)
+{
+  fs::path current = dest;
+  for (const auto &part : path.parent_path().lexically_relative(dest)) {
+    if (part == ".") continue;
+    current /= part;
+    fs::file_status status = fs::symlink_status(current);
+    if (fs::is_symlink(status)) return fmt::format("entry {} is written through a symlink", path.string());
+    if (!fs::exists(status)) { fs::create_directory(current); }
+  }
+  return std::nullopt;
+}
+
+std::optional<std::string> create_symlinks_within(const fs::path &dest,
+  const std::vector<std::pair<fs::path, std::string>> &symlinks)
+{
+  for (const auto &[path, target] : symlinks) {
+    if (fs::path(target).is_absolute() || fs::path(target).has_root_name()) {
+      return fmt::format("symlink {} has an absolute target: {}", path.string(), target);
+    }
+    if (auto error = create_parents_within(dest, path)) return error;
+    if (auto error = clear_link_path(path)) return error;
+    fs::create_symlink(target, path);
+  }
+  // Checked once they all exist, a later link could redirect an earlier one.
+  fs::path root = fs::canonical(dest);
+  for (const auto &[path, target] : symlinks) {
+    std::error_code error;
+    fs::path resolved = fs::weakly_canonical(path, error);
+    if (error || !is_within(root, resolved)) {
+      return fmt::format("symlink {} -> {} points outside the destination", path.string(), target);
+    }
+  }
+  return std::nullopt;
+}
+
+void archive_extractor::finish()
+{
+  if ((current != state::END && current != state::HEADER) || header_len != 0) { remote_failure("truncated archive"); }
+
+  if (auto error = create_symlinks_within(dest, symlinks)) { remote_failure("archive {}", *error); }
+  fs::path root = fs::canonical(dest);
+  for (const auto &[path, target] : hard_links) {
+    std::error_code error;
+    fs::path resolved = fs::weakly_canonical(target, error);
+    if (error || !is_within(root, resolved)) {
+      remote_failure("archive hard link {} points outside the destination", path.string());
+    }
+    create_parents(path);
+    if (auto error = clear_link_path(path)) { remote_failure("archive {}", *error); }
+    fs::create_hard_link(target, path);
+  }
+}
+
+static uint64_t parse_number(const uint8_t *field, size_t len)
+{
+  // GNU base-256 encoding for values that don't fit in octal.
+  if (field[0] & 0x80) {
+    uint64_t result = field[0] & 0x7f;
+    for (size_t i = 1; i < len; i++) { result = (result << 8) | field[i]; }
+    return result;
+  }
+
+  uint64_t result = 0;
+  size_t i = 0;
+  while (i < len && (field[i] == ' ' || field[i] == '\0')) { i++; }
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) { result = result * 8 + (field[i] - '0'); }
+  return result;
+}
+
+static std::string parse_string(const uint8_t *field, size_t len)
+{
+  auto begin = reinterpret_cast<const char *>(field);
+  return std::string(begin, strnlen(begin, len));
+}
+
+fs::path archive_extractor::entry_path(const std::string &name) const
+{
+  auto path = path_within(dest, name);
+  if (!path.has_value()) { remote_failure("archive entry escapes destination: {}", name); }
+  return std::move(*path);
+}
+
+void archive_extractor::create_parents(const fs::path &path) const
+{
+  if (auto error = create_parents_within(dest, path)) { remote_failure("archive {}", *error); }
+}
+
+void archive_extractor::begin_entry()
+{
+  if (std::all_of(header.begin(), header.end(), [](uint8_t it) { return it == 0; })) {
+    current = state::END;
+    return;
+  }
+
+  std::string name = parse_string(header.data(), 100);
+  std::string prefix = parse_string(header.data() + 345, 155);
+  if (std::memcmp(header.data() + 257, "ustar", 5) == 0 && !prefix.empty()) { name = prefix + "/" + name; }
+  if (!next_path.empty()) { name = std::move(next_path); }
+
+  uint64_t mode = parse_number(header.data() + 100, 8);
+  remaining = parse_number(header.data() + 124, 12);
+  padding = (BLOCK_SIZE - remaining % BLOCK_SIZE) % BLOCK_SIZE;
+  char type = static_cast<char>(header[156]);
+
+  std::string link = next_link.empty() ? parse_string(header.data() + 157, 100) : std::move(next_link);
+  next_path.clear();
+  next_link.clear();
+
+  switch (type) {
+  case 'x':// pax extended header for the next entry
+  case 'g':// pax global header
+  case 'L':// GNU long name
+  case 'K':// GNU long link name
+    metadata.clear();
+    metadata_type = type;
+    current = state::METADATA;
+    break;
+  case '5':
+    fs::create_directories(entry_path(name));
+    current = state::DATA;
+    break;
+  case '2':
+    if (fs::path(link).is_absolute() || fs::path(link).has_root_name()) {
+      remote_failure("archive symlink {} has an absolute target: {}", name, link);
+    }
+    symlinks.emplace_back(entry_path(name), link);
+    current = state::DATA;
+    break;
+  case '1':
+    hard_links.emplace_back(entry_path(name), entry_path(link));
+    current = state::DATA;
+    break;
+  case '0':
+  case '7':
+  case '\0': {
+    file_path = entry_path(name);
+    file_mode = static_cast<fs::perms>(mode & 0777) | fs::perms::owner_read | fs::perms::owner_write;
+    fs::create_directories(file_path.parent_path());
+    file.open(file_path, std::ios::binary | std::ios::trunc);
+    if (!file) { critical_error("can't write {}", file_path.string()); }
+    current = state::DATA;
+    break;
+  }
+  default:
+    // Devices, fifos and unknown vendor extensions are skipped.
+    current = state::DATA;
+    break;
+  }
+
+  if (remaining == 0 && current != state::METADATA) { end_entry(); }
+}
+
+void archive_extractor::end_entry()
+{
+  if (file.is_open()) {
+    file.close();
+    if (!file) { critical_error("can't write {}", file_path.string()); }
+    fs::permissions(file_path, file_mode);
+  }
+
+  if (current == state::METADATA) {
+    if (metadata_type == 'L') {
+      next_path = metadata.c_str();
+    } else if (metadata_type == 'K') {
+      next_link = metadata.c_str();
+    } else if (metadata_type == 'x') {
+      // Records are "<length> <key>=<value>\n".
+      std::string_view records = metadata;
+      while (!records.empty()) {
+        size_t space = records.find(' ');
+        size_t length = std::strtoull(std::string(records.substr(0, space)).c_str(), nullptr, 10);
+        if (space == std::string_view::npos || length <= space || length > records.size()) { break; }
+        std::string_view record = records.substr(space + 1, length - space - 2);
+        size_t equals = record.find('=');
+        if (equals != std::string_view::npos) {
+          if (record.substr(0, equals) == "path") { next_path = std::string(record.substr(equals + 1)); }
+          if (record.substr(0, equals) == "linkpath") { next_link = std::string(record.substr(equals + 1)); }
+        }
+        records.remove_prefix(length);
+      }
+    }
+  }
+
+  current = padding > 0 ? state::PADDING : state::HEADER;
+}
+
+void archive_extractor::feed_tar(const uint8_t *data, size_t len)
+{
+  while (len > 0) {
+    switch (current) {
+    case state::END:
+      return;
+    case state::HEADER: {
+      size_t take = std::min(len, BLOCK_SIZE - header_len);
+      std::memcpy(header.data() + header_len, data, take);
+      header_len += take;
+      data += take;
+      len -= take;
+      if (header_len == BLOCK_SIZE) {
+        header_len = 0;
+        begin_entry();
+      }
+      break;
+    }
+    case state::DATA:
+    case state::METADATA: {
+      size_t take = static_cast<size_t>(std::min<uint64_t>(len, remaining));
+      if (current == state::METADATA) {
+        metadata.append(reinterpret_cast<const char *>(data), take);
+      } else if (file.is_open()) {
+        file.write(reinterpret_cast<const char *>(data), take);
+      }
+      data += take;
+      len -= take;
+      remaining -= take;
+      if (remaining == 0) { end_entry(); }
+      break;
+    }
+    case state::PADDING: {
+      size_t take = static_cast<size_t>(std::min<uint64_t>(len, padding));
+      data += take;
+      len -= take;
+      padding -= take;
+      if (padding == 0) { current = state::HEADER; }
+      break;
+    }
+    }
+  }
+}
+
+static bool ends_with(std::string_view value, std::string_view suffix)
+{
+  return value.size() >= suffix.size() && value.substr(value.size() - suffix.size()) == suffix;
+}
+
+bool is_extractable_archive(std::string_view url)
+{
+  url = url.substr(0, url.find_first_of("?#"));
+  return ends_with(url, ".tar.gz") || ends_with(url, ".tgz") || ends_with(url, ".tar");
+}
+
+void strip_single_top_directory(const fs::path &dest)
+{
+  auto it = fs::directory_iterator(dest);
+  if (it == fs::directory_iterator() || !it->is_directory()) { return; }
+  fs::path top = it->path();
+  if (++it != fs::directory_iterator()) { return; }
+
+  fs::path temporary = dest;
+  temporary += ".strip";
+  fs::remove_all(temporary);
+  fs::rename(top, temporary);
+  fs::remove(dest);
+  fs::rename(temporary, dest);
+}
@@ -0,0 +1,85 @@
+#ifndef _DEPMGR_ARCHIVE_HPP_
+#define _DEPMGR_ARCHIVE_HPP_
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/// Streaming tar extractor with transparent gzip decompression. Entries are
+/// written to disk as their bytes arrive, so only the current 512 byte tar
+/// block is ever buffered. Symlinks and hard links are created by finish(),
+/// after every other entry, so nothing is ever written through a link. An
+/// archive that would write or link outside of `dest` is a remote_error.
+class archive_extractor
+{
+  enum class state { HEADER, DATA, METADATA, PADDING, END };
+
+  std::filesystem::path dest;
+
+  struct inflate_state;
+  std::unique_ptr<inflate_state> inflater;
+  bool detected = false;
+
+  state current = state::HEADER;
+  std::array<uint8_t, 512> header;
+  size_t header_len = 0;
+
+  uint64_t remaining = 0;
+  uint64_t padding = 0;
+
+  std::ofstream file;
+  std::filesystem::path file_path;
+  std::filesystem::perms file_mode;
+  std::string metadata;
+  char metadata_type = 0;
+  std::string next_path;
+  std::string next_link;
+  /// Links to create once the stream ends: where, and the target.
+  std::vector<std::pair<std::filesystem::path, std::string>> symlinks;
+  std::vector<std::pair<std::filesystem::path, std::filesystem::path>> hard_links;
+
+  void feed_tar(const uint8_t *data, size_t len);
+  void begin_entry();
+  void end_entry();
+  std::filesystem::path entry_path(const std::string &name) const;
+  void create_parents(const std::filesystem::path &path) const;
+
+public:
+  explicit archive_extractor(std::filesystem::path dest);
+  ~archive_extractor();
+
+  void feed(const uint8_t *data, size_t len);
+  void finish();
+};
+
+/// Path of the entry `name` in `dest`, none when it's absolute or leaves
+/// `dest`. Only the name is checked, not the links on the way.
+std::optional<std::filesystem::path> path_within(const std::filesystem::path &dest, std::string_view name);
+
+/// Creates the directories `path` is in, from `dest` down. The reason, when
+/// one of them is a symlink.
+std::optional<std::string> create_parents_within(const std::filesystem::path &dest,
+  const std::filesystem::path &path);
+
+/// Creates `symlinks`, where and the target, in `dest`. Meant to be called
+/// once everything else was written, so nothing is written through a link.
+/// The reason, when a target is absolute, a link would replace a directory or
+/// any of them resolves outside of `dest` once they all exist.
+std::optional<std::string> create_symlinks_within(const std::filesystem::path &dest,
+  const std::vector<std::pair<std::filesystem::path, std::string>> &symlinks);
+
+/// Whether `url` names an archive format archive_extractor understands.
+bool is_extractable_archive(std::string_view url);
+
+/// Moves the contents of a single top level directory in `dest` up into
+/// `dest`, matching how CMake treats extracted archives.
+void strip_single_top_directory(const std::filesystem::path &dest);
+
+#endif /* _DEPMGR_ARCHIVE_HPP_ */
@@ -0,0 +1,159 @@
+#include "batch.hpp"
+
+#include <algorithm>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
+#include <fmt/ranges.h>
+
+#include "generate.hpp"
+#include "git.hpp"
+#include "state.hpp"
+#include "thread_pool.hpp"
+#include "toml.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+
+namespace fs = std::filesystem;
+
+std::vector<batch_component> load_workspace(const fs::path &path)
+{
+  std::optional<toml_document> workspace = toml_document::load(path);
+  if (!workspace.has_value()) { critical_error("can't open workspace file: {}", path.string()); }
+
+  fs::path base = fs::absolute(path).parent_path();
+  std::vector<batch_component> components;
+  for (const auto &component : workspace->root()) {
+    if (!component.is_table()) { critical_error("'{}' isn't a component table", component.key); }
+    auto manifest = toml_table_get<std::string_view>(&component, "manifest");
+    auto output = toml_table_get<std::string_view>(&component, "output");
+    if (!manifest.has_value() || !output.has_value()) {
+      critical_error("component '{}' needs a manifest and an output", component.key);
+    }
+    components.push_back(batch_component{std::string(component.key),
+      (base / *manifest).lexically_normal(),
+      (base / *output).lexically_normal()});
+  }
+  return components;
+}
+
+namespace {
+/// Manifests read by any component of the batch, each parsed once even when
+/// several components ask for it at the same time.
+class shared_manifests
+{
+  using pending_document = std::shared_future<std::shared_ptr<const toml_document>>;
+
+  std::mutex lock;
+  std::unordered_map<std::string, pending_document> documents;
+
+public:
+  std::shared_ptr<const toml_document> load(const fs::path &path)
+  {
+    std::string key = fs::absolute(path).lexically_normal().string();
+    std::promise<std::shared_ptr<const toml_document>> loaded;
+    {
+      std::lock_guard guard(lock);
+      auto [it, inserted] = documents.try_emplace(key, pending_document());
+      if (!inserted) { return it->second.get(); }
+      it->second = loaded.get_future().share();
+    }
+    std::shared_ptr<const toml_document> document = load_manifest(key);
+    loaded.set_value(document);
+    return document;
+  }
+};
+}// namespace
+
+/// Writes the output of `component` unless it's up to date. Returns whether
+/// it was written.
+static bool generate_component(const batch_component &component,
+  shared_manifests &manifests,
+  thread_pool &walkers,
+  bool fetch,
+  const std::vector<std::string> &options)
+{
+  trace_span span("component", component.name);
+  std::shared_ptr<const toml_document> manifest = manifests.load(component.manifest);
+  if (manifest == nullptr) {
+    critical_error("{}: can't open dependency file: {}", component.name, component.manifest.string());
+  }
+
+  std::vector<std::string> arguments{component.manifest.string(), component.output.string()};
+  if (fetch) { arguments.insert(arguments.begin(), "fetch"); }
+  arguments.insert(arguments.end(), options.begin(), options.end());
+  generation result;
+  std::optional<std::string> failure;
+  try {
+    result = resolve_generation(component.manifest,
+      manifest,
+      work_dir_path(component.output),
+      fetch,
+      arguments,
+      [&manifests](const fs::path &path) { return manifests.load(path); },
+      &walkers);
+  } catch (const std::exception &error) {
+    failure = error.what();
+  }
+  if (failure.has_value()) { critical_error("{}: {}", component.name, *failure); }
+
+  if (execution_context::get().offline) {
+    auto missing = missing_offline_sources(result.packages);
+    if (!missing.empty()) {
+      critical_error("{}: offline, but {} dependencies have no sources:\n  {}",
+        component.name,
+        missing.size(),
+        fmt::join(missing, "\n  "));
+    }
+  }
+
+  if (is_up_to_date(result, component.output)) return false;
+
+  fmt::memory_buffer out;
+  fmt::format_to(std::back_inserter(out), "{}", result.fingerprint);
+  write_cmake_script(out, result.packages);
+  write_generation(result, out, component.output);
+  return true;
+}
+
+void run_batch(const std::vector<batch_component> &components, bool fetch, const std::vector<std::string> &options)
+{
+  trace_span span("batch");
+  std::map<fs::path, const batch_component *> outputs;
+  // Sources of components sharing a work directory are prepared in the same
+  // place, so those components can't run concurrently.
+  std::map<fs::path, std::vector<const batch_component *>> groups;
+  for (const auto &component : components) {
+    auto [it, inserted] = outputs.emplace(component.output, &component);
+    if (!inserted) {
+      critical_error(
+        "components '{}' and '{}' both write {}", it->second->name, component.name, component.output.string());
+    }
+    groups[work_dir_path(component.output)].push_back(&component);
+  }
+
+  shared_manifests manifests;
+  git_resolve_memo resolved;
+  // Components only wait for their walks, which share one pool, instead of
+  // each walk starting a pool of its own.
+  thread_pool walkers(execution_context::get().jobs);
+  thread_pool pool(std::min(execution_context::get().jobs, groups.size()));
+  std::vector<std::future<size_t>> pending;
+  for (const auto &[work_dir, group] : groups) {
+    pending.emplace_back(pool.submit([&manifests, &walkers, &group = group, fetch, &options]() {
+      size_t written = 0;
+      for (const auto *component : group) {
+        if (generate_component(*component, manifests, walkers, fetch, options)) { written++; }
+      }
+      return written;
+    }));
+  }
+
+  size_t written = 0;
+  for (auto &it : pending) { written += it.get(); }
+  status("Generated {} outputs, {} were up to date", written, components.size() - written);
+}
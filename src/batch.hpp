@@ -0,0 +1,28 @@
+#ifndef _DEPMGR_BATCH_HPP_
+#define _DEPMGR_BATCH_HPP_
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+/// A manifest and the script generated from it, one of many in a batch.
+struct batch_component
+{
+  std::string name;
+  std::filesystem::path manifest;
+  std::filesystem::path output;
+};
+
+/// Components of a workspace file: a table per component with its `manifest`
+/// and `output`, relative to the workspace.
+std::vector<batch_component> load_workspace(const std::filesystem::path &path);
+
+/// Generates the output of every component concurrently, in one process, so
+/// nested manifests are parsed once and packages shared by several components
+/// are resolved against their remotes and fetched into the cache once.
+/// Components whose outputs share a work directory are generated one after
+/// another. `options` are the command line options, part of every output's
+/// fingerprint.
+void run_batch(const std::vector<batch_component> &components, bool fetch, const std::vector<std::string> &options);
+
+#endif /* _DEPMGR_BATCH_HPP_ */
@@ -0,0 +1,93 @@
+#include "cache.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+
+#include <fmt/format.h>
+
+#include "hash.hpp"
+#include "util.hpp"
+
+namespace fs = std::filesystem;
+
+static constexpr const char *COMPLETE_MARKER = ".depmgr-complete";
+
+std::string cache_key::digest() const
+{
+  sha256 hash;
+  // Fields are NUL separated so ("ab", "c") and ("a", "bc") differ.
+  hash.update(kind).update("\0", 1).update(url).update("\0", 1).update(revision).update("\0", 1);
+  for (const auto &patch : patches) { hash.update(patch).update("\0", 1); }
+  hash.update("\0", 1).update(variant);
+  return hash.hex_digest();
+}
+
+fs::path dependency_cache::entry_path(const cache_key &key) const
+{
+  std::string digest = key.digest();
+  return root / "sources" / digest.substr(0, 2) / digest.substr(2);
+}
+
+fs::path dependency_cache::mirror_path(const std::string &url) const
+{
+  return root / "git" / fmt::format("{}.git", sha256_hex(url));
+}
+
+bool dependency_cache::contains(const cache_key &key) const { return fs::exists(entry_path(key) / COMPLETE_MARKER); }
+
+void dependency_cache::materialize(const fs::path &entry, const fs::path &dest)
+{
+  copy_tree(entry, dest, {COMPLETE_MARKER});
+}
+
+fs::path dependency_cache::ensure(const cache_key &key, const std::function<void(const fs::path &)> &fill)
+{
+  static std::atomic<unsigned> staging_counter = 0;
+
+  fs::path entry = entry_path(key);
+  if (fs::exists(entry / COMPLETE_MARKER)) { return entry; }
+
+  // Callers after the first wait here and then find the entry complete.
+  fs::create_directories(entry.parent_path());
+  file_lock lock(fs::path(entry).concat(".lock"));
+  if (fs::exists(entry / COMPLETE_MARKER)) { return entry; }
+
+  fs::path staging =
+    root / "tmp" / fmt::format("{}.{}.{}", entry.filename().string(), current_process_id(), staging_counter++);
+  fs::remove_all(staging);
+  fs::create_directories(staging);
+  try {
+    fill(staging);
+  } catch (const remote_error &) {
+    // The caller may retry from another mirror, under a new staging name.
+    fs::remove_all(staging);
+    throw;
+  }
+  std::ofstream(staging / COMPLETE_MARKER) << key.kind << "\n" << key.url << "\n" << key.revision << "\n";
+
+  std::error_code error;
+  fs::rename(staging, entry, error);
+  if (error) {
+    // Lost the race against another process filling the same entry.
+    fs::remove_all(staging);
+    if (!fs::exists(entry / COMPLETE_MARKER)) {
+      critical_error("can't populate cache entry {}: {}", entry.string(), error.message());
+    }
+  }
+  return entry;
+}
+
+fs::path default_cache_dir()
+{
+  if (const char *dir = std::getenv("DEPMGR_CACHE_DIR"); dir != nullptr && *dir != '\0') { return dir; }
+#if defined(_WIN32)
+  if (const char *dir = std::getenv("LOCALAPPDATA"); dir != nullptr) { return fs::path(dir) / "depmgr"; }
+#else
+  if (const char *dir = std::getenv("XDG_CACHE_HOME"); dir != nullptr && *dir != '\0') {
+    return fs::path(dir) / "depmgr";
+  }
+  if (const char *home = std::getenv("HOME"); home != nullptr) { return fs::path(home) / ".cache" / "depmgr"; }
+#endif
+  return fs::temp_directory_path() / "depmgr";
+}
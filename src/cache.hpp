@@ -0,0 +1,59 @@
+#ifndef _DEPMGR_CACHE_HPP_
+#define _DEPMGR_CACHE_HPP_
+
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+/// Identity of fetched sources. Two packages with equal keys share one cache
+/// entry regardless of the build tree or package name they were declared in.
+struct cache_key
+{
+  std::string kind;
+  std::string url;
+  /// Immutable revision (commit id, content hash, ...), never a symbolic ref.
+  std::string revision;
+  /// Hashes of patches applied on top of the fetched revision, in order.
+  std::vector<std::string> patches;
+  /// Anything else that changes fetched content, e.g. selected submodules.
+  std::string variant;
+
+  std::string digest() const;
+};
+
+class dependency_cache
+{
+  std::filesystem::path root;
+
+public:
+  explicit dependency_cache(std::filesystem::path root) : root(std::move(root)) {}
+
+  std::filesystem::path entry_path(const cache_key &key) const;
+  /// Bare git mirror of `url`, shared by every revision fetched from it.
+  std::filesystem::path mirror_path(const std::string &url) const;
+  /// Latencies recorded for the mirrors of every remote, to rank them by.
+  std::filesystem::path mirror_stats_path() const { return root / "mirrors.stats"; }
+  /// Installed builds of dependencies, keyed by the generated CMake script.
+  std::filesystem::path artifact_root() const { return root / "artifacts"; }
+  bool contains(const cache_key &key) const;
+
+  /// Copies the sources of `entry` to `dest`, without the marker that
+  /// completes the entry. Files are never hard linked: builds may write to
+  /// their sources, which would change the entry for every other build.
+  static void materialize(const std::filesystem::path &entry, const std::filesystem::path &dest);
+
+  /// Returns the entry for `key`, filling it first with `fill` if it's missing.
+  /// `fill` writes into a private staging directory which is then renamed
+  /// into place, so concurrent processes never observe partial entries.
+  /// Concurrent callers for one key, in this process or others, wait for the
+  /// first one instead of filling the entry again. A remote_error thrown by
+  /// `fill` leaves the entry missing.
+  std::filesystem::path ensure(const cache_key &key, const std::function<void(const std::filesystem::path &)> &fill);
+};
+
+/// Cache location from the environment: DEPMGR_CACHE_DIR, then the platform
+/// user cache directory.
+std::filesystem::path default_cache_dir();
+
+#endif /* _DEPMGR_CACHE_HPP_ */
@@ -2,72 +2,53 @@
 
 #include <algorithm>
 
+#include <fmt/chrono.h>
 #include <fmt/format.h>
 
+#include "trace.hpp"
 #include "util.hpp"
 
-cmake_option::cmake_option(const char *name, toml_raw_t *raw, bool force = false) : name(name), force(force)
+cmake_option::cmake_option(const toml_node &node, bool force) : name(node.key), node(&node), force(force)
 {
-  do {
-    char *s;
-    if (toml_rtos(*raw, &s) == 0) {
-      this->value = std::string(s);
-      delete s;
-      break;
-    }
-
-    int boolean;
-    if (toml_rtob(*raw, &boolean) == 0) {
-      if (boolean) {
-        this->value = "ON";
-      } else {
-        this->value = "OFF";
-      }
-      break;
-    }
-
-    int64_t integer;
-    if (toml_rtoi(*raw, &integer) == 0) {
-      this->value = std::to_string(integer);
-      break;
-    }
-
-    double number;
-    if (toml_rtod(*raw, &number) == 0) {
-      this->value = std::to_string(number);
-      break;
-    }
-
-    toml_timestamp_t ts;
-    if (toml_rtots(*raw, &ts) == 0) {
-      auto time_point = toml_timestamp_to_chrono<std::chrono::system_clock>(&ts);
-      bool has_time = *ts.hour != 0 || *ts.minute != 0 || *ts.second != 0 || *ts.millisec != 0;
-
-      if (has_time) {
-        this->value = fmt::format("{0:%F}T{0:%T}.{1:03}Z", time_point, (*ts.millisec % 1000));
-      } else {
-        this->value = fmt::format("{:%F}", time_point);
-      }
-      break;
-    }
+  if (!node.is_scalar()) { critical_error("unhandled option value type"); }
+}
 
+std::string cmake_option::value() const
+{
+  switch (node->type) {
+  case toml_type::STRING:
+    return std::string(node->text);
+  case toml_type::BOOLEAN:
+    return node->boolean ? "ON" : "OFF";
+  case toml_type::INTEGER:
+    return std::to_string(node->integer);
+  case toml_type::FLOAT:
+    return std::to_string(node->number);
+  case toml_type::TIMESTAMP: {
+    toml_timestamp_t ts = node->timestamp();
+    auto time_point = toml_timestamp_to_chrono<std::chrono::system_clock>(&ts);
+    int millisec = ts.millisec ? *ts.millisec : 0;
+    bool has_time = ts.hour != nullptr && (*ts.hour != 0 || *ts.minute != 0 || *ts.second != 0 || millisec != 0);
+
+    if (has_time) { return fmt::format("{0:%F}T{0:%T}.{1:03}Z", time_point, (millisec % 1000)); }
+    return fmt::format("{:%F}", time_point);
+  }
+  default:
     critical_error("unhandled option value type");
-  } while (false);
+  }
 }
 
 std::string cmake_option::to_command(size_t indent) const
 {
-  return fmt::format("{: >{}}set({} \"{}\" CACHE INTERNAL \"\"{})\n", "", indent, name, value, force ? " FORCE" : "");
+  return fmt::format("{: >{}}set({} \"{}\" CACHE INTERNAL \"\"{})\n", "", indent, name, value(), force ? " FORCE" : "");
 }
 
-cmake_option_list::cmake_option_list(toml_table_t *table, bool force = false)
+cmake_option_list::cmake_option_list(const toml_node &table, bool force)
 {
-  size_t len = toml_table_nkval(table);
-  options.reserve(len);
-  for (size_t i = 0; i < len; i++) {
-    const char *key = toml_key_in(table, i);
-    toml_raw_t raw = toml_raw_in(table, key);
-    options.emplace_back(cmake_option(key, &raw, force));
+  trace_span span("convert options");
+  options.reserve(table.count);
+  for (const auto &node : table) {
+    if (node.is_scalar()) { options.emplace_back(node, force); }
   }
 }
 
@@ -79,4 +60,4 @@ std::string cmake_option_list::to_commands(size_t indent) const
     return o.to_command(indent);
   });
   return fmt::format("{}", fmt::join(option_strings, "\n"));
-}
\ No newline at end of file
+}
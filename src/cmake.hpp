@@ -2,17 +2,21 @@
 #define _DEPMGR_CMAKE_HPP_
 
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "toml.hpp"
 
+/// A cache variable set from an `options` entry. Borrows its name and value
+/// from the manifest document.
 struct cmake_option
 {
-  std::string name;
-  std::string value;
+  std::string_view name;
+  const toml_node *node;
   bool force;
 
-  cmake_option(const char *name, toml_raw_t *raw, bool force = false);
+  cmake_option(const toml_node &node, bool force = false);
+  std::string value() const;
   std::string to_command(size_t indent = 0) const;
 };
 
@@ -20,7 +24,7 @@ struct cmake_option_list
 {
   std::vector<cmake_option> options;
 
-  cmake_option_list(toml_table_t *table, bool force = false);
+  cmake_option_list(const toml_node &table, bool force = false);
   std::string to_commands(size_t indent = 0) const;
 };
 
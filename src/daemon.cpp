@@ -0,0 +1,540 @@
+#include "daemon.hpp"
+
+#include "util.hpp"
+
+#if defined(__linux__)
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <fmt/ranges.h>
+
+#include "generate.hpp"
+#include "hash.hpp"
+#include "lockfile.hpp"
+#include "state.hpp"
+#include "vendor.hpp"
+#endif
+
+namespace fs = std::filesystem;
+
+#if defined(__linux__)
+
+namespace {
+
+/// Editors save through several renames and writes, changes are collected
+/// until the watched directories have been quiet this long.
+constexpr int debounce_ms = 20;
+
+constexpr uint32_t watch_events = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE;
+
+fs::path normalized(const fs::path &path) { return fs::absolute(path).lexically_normal(); }
+
+void hash_node(sha256 &hash, const toml_node &node)
+{
+  uint8_t type = uint8_t(node.type);
+  hash.update(node.key).update("\0", 1).update(&type, 1).update(node.text).update("\0", 1);
+  hash.update(&node.boolean, sizeof(node.boolean)).update(&node.integer, sizeof(node.integer));
+  hash.update(&node.number, sizeof(node.number)).update(&node.count, sizeof(node.count));
+  for (const auto &child : node) { hash_node(hash, child); }
+}
+
+/// Covers everything render_package reads for package `id`.
+std::string package_digest(const package_table &packages, package_id id)
+{
+  sha256 hash;
+  const package_origin &origin = packages.manifests[packages.origins[id]];
+  hash.update(packages.names[id]).update("\0", 1);
+  hash.update(origin.manifest_dir.generic_string()).update(origin.nested ? "\1" : "\0", 1);
+  hash_node(hash, *packages.configs[id]);
+
+  if (packages.kinds[id] == remote_kind::GIT) {
+    const git_package &row = packages.git[packages.rows[id]];
+    if (row.locked.has_value()) { hash.update(row.locked->commit); }
+  }
+  hash.update(packages.is_prepared(id) ? "\1" : "\0", 1);
+  for (package_id dependency : packages.depends[id]) { hash.update(packages.names[dependency]).update("\0", 1); }
+  hash.update(packages.patch_set_hash(id));
+
+  // Prebuilt packages embed an artifact key covering their dependencies, and
+  // the prefixes of every prebuilt package they depend on, directly or not.
+  if (auto artifact = packages.artifact_identity(id)) { hash.update("\1", 1).update(*artifact); }
+  std::vector<package_id> pending(packages.depends[id].begin(), packages.depends[id].end());
+  std::vector<bool> seen(packages.size());
+  while (!pending.empty()) {
+    package_id dependency = pending.back();
+    pending.pop_back();
+    if (seen[dependency]) continue;
+    seen[dependency] = true;
+    if (packages.prebuilt[dependency].has_value()) { hash.update(packages.names[dependency]).update("\0", 1); }
+    pending.insert(pending.end(), packages.depends[dependency].begin(), packages.depends[dependency].end());
+  }
+  return hash.hex_digest();
+}
+
+/// Path of a `configure` or `cmake-lists` file of package `id`.
+fs::path package_file(const package_table &packages, package_id id, std::string_view path)
+{
+  fs::path value(path);
+  if (value.is_absolute()) return normalized(value);
+  return normalized(packages.manifests[packages.origins[id]].manifest_dir / value);
+}
+
+int open_socket(const fs::path &path)
+{
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  std::string name = path.string();
+  if (name.size() >= sizeof(address.sun_path)) { critical_error("socket path too long: {}", name); }
+  std::memcpy(address.sun_path, name.c_str(), name.size() + 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) { critical_error("can't create socket: {}", std::strerror(errno)); }
+  if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0) {
+    critical_error("a daemon is already listening on {}", name);
+  }
+  // Nothing answered, so whatever is left at the path is stale.
+  unlink(name.c_str());
+
+  close(fd);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(fd, 16) != 0) {
+    critical_error("can't listen on {}: {}", name, std::strerror(errno));
+  }
+  return fd;
+}
+
+class watch_daemon
+{
+  fs::path manifest_path;
+  fs::path output;
+  fs::path socket_path;
+  std::vector<std::string> arguments;
+
+  /// Parsed manifests by path, null for ones that don't exist. Entries are
+  /// dropped when their file changes, everything else is reused as is.
+  std::mutex documents_lock;
+  std::unordered_map<std::string, std::shared_ptr<const toml_document>> documents;
+  std::optional<std::string> load_error;
+
+  std::optional<generation> current;
+  /// Rendered packages by package_digest().
+  std::unordered_map<std::string, package_script> scripts;
+  std::unordered_map<std::string_view, std::string> digests;
+  std::unordered_map<std::string, uint64_t> changed_at;
+  uint64_t revision = 0;
+  std::string last_error;
+
+  int inotify_fd = -1;
+  int listen_fd = -1;
+  std::unordered_map<int, std::string> watched_dirs;
+  std::unordered_map<std::string, int> watches;
+  std::unordered_set<std::string> inputs;
+  std::unordered_map<std::string, std::vector<std::string>> configure_inputs;
+  std::string stamp_dir;
+
+  std::unordered_set<std::string> touched;
+  bool dirty = false;
+  bool running = true;
+
+  std::shared_ptr<const toml_document> load(const fs::path &path);
+  void regenerate();
+  void update_watches(const generation &next);
+  void read_events();
+  void serve(int client);
+  std::string report() const;
+
+public:
+  watch_daemon(fs::path manifest_path, fs::path output, fs::path socket_path, std::vector<std::string> arguments);
+  ~watch_daemon();
+
+  void run();
+};
+
+watch_daemon::watch_daemon(fs::path manifest_path,
+  fs::path output,
+  fs::path socket_path,
+  std::vector<std::string> arguments)
+    : manifest_path(normalized(manifest_path)), output(std::move(output)), socket_path(std::move(socket_path)),
+      arguments(std::move(arguments))
+{
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd < 0) { critical_error("can't initialize inotify: {}", std::strerror(errno)); }
+  listen_fd = open_socket(this->socket_path);
+}
+
+watch_daemon::~watch_daemon()
+{
+  close(inotify_fd);
+  close(listen_fd);
+  unlink(socket_path.c_str());
+}
+
+std::shared_ptr<const toml_document> watch_daemon::load(const fs::path &path)
+{
+  std::string key = normalized(path).string();
+  {
+    std::lock_guard guard(documents_lock);
+    if (auto it = documents.find(key); it != documents.end()) { return it->second; }
+  }
+
+  std::shared_ptr<const toml_document> document;
+  std::string error;
+  if (fs::exists(key)) {
+    // Errors parse_packages would terminate on are reported like syntax
+    // errors, keeping the daemon alive while the manifest is being edited.
+    if (auto parsed = toml_document::try_load(key, error)) {
+      if (auto package_error = find_package_error(parsed->root())) {
+        error = *package_error;
+      } else {
+        document = std::make_shared<const toml_document>(std::move(*parsed));
+      }
+    }
+  }
+
+  std::lock_guard guard(documents_lock);
+  if (!error.empty()) {
+    // Not cached, the file is read again once it's fixed.
+    if (!load_error.has_value()) { load_error = fmt::format("can't parse {}: {}", key, error); }
+    return nullptr;
+  }
+  documents.emplace(key, document);
+  return document;
+}
+
+void watch_daemon::regenerate()
+{
+  auto started = std::chrono::steady_clock::now();
+  load_error.reset();
+
+  auto manifest = load(manifest_path);
+  if (manifest == nullptr) {
+    last_error = load_error.value_or(fmt::format("can't open dependency file: {}", manifest_path.string()));
+    status("{}, keeping {}", last_error, output.string());
+    return;
+  }
+
+  generation next;
+  try {
+    next = resolve_generation(manifest_path,
+      manifest,
+      work_dir_path(output),
+      false,
+      arguments,
+      [this](const fs::path &path) { return load(path); });
+  } catch (const std::exception &error) {
+    last_error = error.what();
+    status("{}, keeping {}", last_error, output.string());
+    return;
+  }
+  if (load_error.has_value()) {
+    last_error = *load_error;
+    status("{}, keeping {}", last_error, output.string());
+    return;
+  }
+  if (execution_context::get().offline) {
+    auto missing = missing_offline_sources(next.packages);
+    if (!missing.empty()) {
+      last_error =
+        fmt::format("offline, but {} dependencies have no sources: {}", missing.size(), fmt::join(missing, ", "));
+      status("{}, keeping {}", last_error, output.string());
+      return;
+    }
+  }
+  last_error.clear();
+
+  uint64_t next_revision = revision + 1;
+  bool changed = false;
+  auto mark = [&](std::string_view name) {
+    changed_at[std::string(name)] = next_revision;
+    changed = true;
+  };
+
+  // Only packages whose inputs changed are rendered again, unchanged ones are
+  // moved over from the previous generation.
+  const package_table &packages = next.packages;
+  std::unordered_map<std::string, package_script> next_scripts;
+  std::unordered_map<std::string_view, std::string> next_digests;
+  std::vector<const package_script *> rendered(packages.size());
+  size_t rerendered = 0;
+  for (package_id id = 0; id < packages.size(); id++) {
+    std::string digest = package_digest(packages, id);
+    auto previous = digests.find(packages.names[id]);
+    if (previous == digests.end() || previous->second != digest) { mark(packages.names[id]); }
+
+    if (auto cached = scripts.extract(digest)) {
+      rendered[id] = &next_scripts.insert(std::move(cached)).position->second;
+    } else {
+      rendered[id] = &next_scripts.emplace(digest, render_package(packages, id)).first->second;
+      rerendered++;
+    }
+    next_digests.emplace(packages.names[id], std::move(digest));
+  }
+  for (const auto &[name, digest] : digests) {
+    if (next_digests.count(name) == 0) { mark(name); }
+  }
+  for (const auto &name : touched) { mark(name); }
+  touched.clear();
+
+  if (!current.has_value() || current->fingerprint != next.fingerprint || !is_up_to_date(next, output)) {
+    fmt::memory_buffer out;
+    fmt::format_to(std::back_inserter(out), "{}", next.fingerprint);
+    write_cmake_script(out, packages, rendered);
+    write_generation(next, out, output);
+    changed = true;
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started);
+    status("Regenerated {} in {:.3f} ms, rendered {} of {} packages",
+      output.string(),
+      double(elapsed.count()) / 1000.0,
+      rerendered,
+      packages.size());
+  }
+  if (changed) { revision = next_revision; }
+
+  update_watches(next);
+  // The digests borrow names from the packages, both are replaced together.
+  scripts = std::move(next_scripts);
+  digests = std::move(next_digests);
+  current = std::move(next);
+}
+
+void watch_daemon::update_watches(const generation &next)
+{
+  std::unordered_set<std::string> dirs;
+  inputs.clear();
+  configure_inputs.clear();
+
+  auto add_input = [&](const fs::path &path) {
+    fs::path file = normalized(path);
+    dirs.insert(file.parent_path().string());
+    inputs.insert(file.string());
+  };
+  add_input(manifest_path);
+  add_input(lockfile_path(manifest_path));
+  add_input(vendor_pack_path(manifest_path));
+  for (const auto &nested : next.graph.nested_manifest_paths) {
+    add_input(nested);
+    add_input(lockfile_path(nested));
+  }
+
+  const package_table &packages = next.packages;
+  for (package_id id = 0; id < packages.size(); id++) {
+    for (const auto &file : {packages.configure[id], packages.cmake_lists[id]}) {
+      if (!file.has_value()) { continue; }
+      fs::path path = package_file(packages, id, *file);
+      dirs.insert(path.parent_path().string());
+      configure_inputs[path.string()].emplace_back(packages.names[id]);
+    }
+    for (const auto &patch : packages.patch_files(id)) {
+      fs::path path = normalized(patch);
+      dirs.insert(path.parent_path().string());
+      configure_inputs[path.string()].emplace_back(packages.names[id]);
+    }
+  }
+
+  // Stamps change when `depmgr fetch` prepares sources.
+  fs::path stamps = next.packages.work_dir / "src";
+  fs::create_directories(stamps);
+  stamp_dir = normalized(stamps).string();
+  dirs.insert(stamp_dir);
+
+  for (auto it = watches.begin(); it != watches.end();) {
+    if (dirs.count(it->first) != 0) {
+      ++it;
+      continue;
+    }
+    inotify_rm_watch(inotify_fd, it->second);
+    watched_dirs.erase(it->second);
+    it = watches.erase(it);
+  }
+  for (const auto &dir : dirs) {
+    if (watches.count(dir) != 0) { continue; }
+    // Directories that don't exist yet are picked up once a regeneration
+    // finds them.
+    int wd = inotify_add_watch(inotify_fd, dir.c_str(), watch_events);
+    if (wd < 0) { continue; }
+    watches.emplace(dir, wd);
+    watched_dirs.emplace(wd, dir);
+  }
+}
+
+void watch_daemon::read_events()
+{
+  alignas(inotify_event) char buffer[16 * 1024];
+  ssize_t length;
+  while ((length = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+    for (char *it = buffer; it < buffer + length;) {
+      const auto *event = reinterpret_cast<const inotify_event *>(it);
+      it += sizeof(inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        // Events were lost, nothing cached can be trusted.
+        std::lock_guard guard(documents_lock);
+        documents.clear();
+        dirty = true;
+        continue;
+      }
+      auto dir = watched_dirs.find(event->wd);
+      if (dir == watched_dirs.end()) { continue; }
+      if (event->mask & IN_IGNORED) {
+        watches.erase(dir->second);
+        watched_dirs.erase(dir);
+        dirty = true;
+        continue;
+      }
+      if (event->len == 0) { continue; }
+
+      std::string path = (fs::path(dir->second) / event->name).string();
+      if (dir->second == stamp_dir) { dirty = true; }
+      if (inputs.count(path) != 0) {
+        std::lock_guard guard(documents_lock);
+        documents.erase(path);
+        dirty = true;
+      }
+      if (auto packages = configure_inputs.find(path); packages != configure_inputs.end()) {
+        touched.insert(packages->second.begin(), packages->second.end());
+        dirty = true;
+      }
+    }
+  }
+}
+
+std::string watch_daemon::report() const
+{
+  std::string result = fmt::format("revision {}\n", revision);
+  if (current.has_value()) {
+    std::string_view fingerprint = current->fingerprint;
+    fingerprint.remove_prefix(fingerprint.rfind(' ') + 1);
+    fingerprint.remove_suffix(1);
+    result += fmt::format("packages {}\nfingerprint {}\n", current->packages.size(), fingerprint);
+  }
+  result += fmt::format("output {}\n", output.string());
+  if (!last_error.empty()) { result += fmt::format("error {}\n", last_error); }
+  return result;
+}
+
+/// Answers a single request line:
+///   status            revision, package count and fingerprint of the output
+///   changed <rev>     packages whose rules or configure files changed after <rev>
+///   regenerate        drops every cache and regenerates from scratch
+///   stop              shuts the daemon down
+void watch_daemon::serve(int client)
+{
+  timeval timeout{1, 0};
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  std::string request;
+  char buffer[256];
+  ssize_t length;
+  while (request.find('\n') == std::string::npos && request.size() < 4096
+         && (length = recv(client, buffer, sizeof(buffer), 0)) > 0) {
+    request.append(buffer, size_t(length));
+  }
+  request = request.substr(0, request.find('\n'));
+  if (!request.empty() && request.back() == '\r') { request.pop_back(); }
+
+  // Answers reflect every change seen so far, even inside the debounce window.
+  if (dirty) {
+    dirty = false;
+    regenerate();
+  }
+
+  std::string reply;
+  if (request == "status") {
+    reply = report();
+  } else if (request.rfind("changed ", 0) == 0) {
+    uint64_t since = std::strtoull(request.c_str() + 8, nullptr, 10);
+    std::vector<std::string_view> names;
+    for (const auto &[name, changed] : changed_at) {
+      if (changed > since) { names.push_back(name); }
+    }
+    std::sort(names.begin(), names.end());
+    reply = fmt::format("revision {}\n", revision);
+    for (auto name : names) { reply += fmt::format("{}\n", name); }
+  } else if (request == "regenerate") {
+    {
+      std::lock_guard guard(documents_lock);
+      documents.clear();
+    }
+    scripts.clear();
+    digests.clear();
+    current.reset();
+    regenerate();
+    reply = report();
+  } else if (request == "stop") {
+    running = false;
+    reply = "ok\n";
+  } else {
+    reply = fmt::format("error unknown request: {}\n", request);
+  }
+
+  for (size_t sent = 0; sent < reply.size();) {
+    ssize_t written = send(client, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+    if (written <= 0) { break; }
+    sent += size_t(written);
+  }
+  close(client);
+}
+
+void watch_daemon::run()
+{
+  regenerate();
+  status("Watching {} directories, queries on {}", watches.size(), socket_path.string());
+
+  while (running) {
+    pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {listen_fd, POLLIN, 0}};
+    int ready = poll(fds, 2, dirty ? debounce_ms : -1);
+    if (ready < 0) {
+      if (errno == EINTR) { continue; }
+      critical_error("poll failed: {}", std::strerror(errno));
+    }
+    if (ready == 0) {
+      dirty = false;
+      regenerate();
+      continue;
+    }
+
+    if (fds[0].revents & POLLIN) { read_events(); }
+    if (fds[1].revents & POLLIN) {
+      int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (client >= 0) { serve(client); }
+    }
+  }
+  status("Daemon stopped");
+}
+
+} // namespace
+
+void run_daemon(const fs::path &manifest,
+  const fs::path &output,
+  const fs::path &socket_path,
+  const std::vector<std::string> &arguments)
+{
+  watch_daemon(manifest, output, socket_path, arguments).run();
+}
+
+#else
+
+void run_daemon(const fs::path &, const fs::path &, const fs::path &, const std::vector<std::string> &)
+{
+  critical_error("depmgr daemon requires inotify and is only available on Linux");
+}
+
+#endif
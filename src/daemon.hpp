@@ -0,0 +1,20 @@
+#ifndef _DEPMGR_DAEMON_HPP_
+#define _DEPMGR_DAEMON_HPP_
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+/// Keeps the dependency graph of `manifest` in memory and rewrites `output`
+/// whenever the manifests, lockfiles, fetched sources or configure files it
+/// was generated from change, re-rendering only the packages whose inputs
+/// did. Answers queries on the Unix socket at `socket_path` until asked to
+/// stop. `arguments` are the options `output` is fingerprinted with.
+///
+/// Only implemented on Linux, where inotify is available.
+void run_daemon(const std::filesystem::path &manifest,
+  const std::filesystem::path &output,
+  const std::filesystem::path &socket_path,
+  const std::vector<std::string> &arguments);
+
+#endif /* _DEPMGR_DAEMON_HPP_ */
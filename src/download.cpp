@@ -0,0 +1,337 @@
+#include "download.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#define DEPMGR_HAS_SOCKETS 1
+#endif
+
+#include "archive.hpp"
+#include "hash.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+
+namespace fs = std::filesystem;
+
+static constexpr size_t READ_CHUNK = 256 * 1024;
+static constexpr int MAX_REDIRECTS = 5;
+static constexpr int CONNECT_TIMEOUT_MS = 10 * 1000;
+static constexpr int READ_TIMEOUT_MS = 30 * 1000;
+/// How often waits on a socket check whether they were cancelled.
+static constexpr int POLL_INTERVAL_MS = 50;
+
+static bool starts_with(std::string_view value, std::string_view prefix)
+{
+  return value.size() >= prefix.size() && value.substr(0, prefix.size()) == prefix;
+}
+
+bool is_streamable_url(std::string_view url)
+{
+#if defined(DEPMGR_HAS_SOCKETS)
+  if (starts_with(url, "http://")) { return true; }
+#endif
+  return starts_with(url, "file://");
+}
+
+class file_source : public byte_source
+{
+  fs::path path;
+  std::ifstream file;
+
+public:
+  explicit file_source(fs::path path) : path(std::move(path)), file(this->path, std::ios::binary)
+  {
+    if (!file) { remote_failure("can't open {}", this->path.string()); }
+  }
+
+  size_t read(uint8_t *buffer, size_t len) override
+  {
+    file.read(reinterpret_cast<char *>(buffer), len);
+    if (file.bad()) { remote_failure("can't read {}", path.string()); }
+    return static_cast<size_t>(file.gcount());
+  }
+};
+
+#if defined(DEPMGR_HAS_SOCKETS)
+static std::string base64(std::string_view input)
+{
+  static constexpr char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string result;
+  for (size_t i = 0; i < input.size(); i += 3) {
+    uint32_t group = uint8_t(input[i]) << 16;
+    if (i + 1 < input.size()) { group |= uint8_t(input[i + 1]) << 8; }
+    if (i + 2 < input.size()) { group |= uint8_t(input[i + 2]); }
+    result += alphabet[(group >> 18) & 63];
+    result += alphabet[(group >> 12) & 63];
+    result += i + 1 < input.size() ? alphabet[(group >> 6) & 63] : '=';
+    result += i + 2 < input.size() ? alphabet[group & 63] : '=';
+  }
+  return result;
+}
+
+/// Socket closed on destruction, also when the source owning it fails to
+/// construct.
+struct socket_handle
+{
+  int fd = -1;
+
+  socket_handle() = default;
+  socket_handle(const socket_handle &) = delete;
+  socket_handle &operator=(const socket_handle &) = delete;
+  ~socket_handle() { reset(); }
+
+  void reset()
+  {
+    if (fd >= 0) { close(fd); }
+    fd = -1;
+  }
+};
+
+/// Minimal HTTP/1.1 client: one GET per connection, Content-Length, chunked
+/// and close-delimited bodies. Meant for internal mirrors and local stand-ins,
+/// TLS is left to CMake.
+class http_source : public byte_source
+{
+  std::string authority;
+  const std::atomic<bool> &cancelled;
+  socket_handle connection;
+
+  std::string pending;
+  size_t pending_pos = 0;
+
+  bool chunked = false;
+  std::optional<uint64_t> body_left;
+  uint64_t chunk_left = 0;
+  bool finished = false;
+
+  size_t raw_read(uint8_t *buffer, size_t len)
+  {
+    if (pending_pos < pending.size()) {
+      size_t take = std::min(len, pending.size() - pending_pos);
+      std::memcpy(buffer, pending.data() + pending_pos, take);
+      pending_pos += take;
+      return take;
+    }
+    if (!wait_for(POLLIN, READ_TIMEOUT_MS)) { remote_failure("{} stopped responding", authority); }
+    ssize_t received = recv(connection.fd, buffer, len, 0);
+    if (received < 0) { remote_failure("connection to {} failed: {}", authority, std::strerror(errno)); }
+    return static_cast<size_t>(received);
+  }
+
+  /// Waits up to `timeout_ms` for `events` on the socket, polling in short
+  /// intervals so a cancelled attempt gives up right away.
+  bool wait_for(short events, int timeout_ms)
+  {
+    pollfd target{connection.fd, events, 0};
+    for (int waited = 0; waited < timeout_ms; waited += POLL_INTERVAL_MS) {
+      if (cancelled.load()) { remote_failure("cancelled"); }
+      int ready = poll(&target, 1, POLL_INTERVAL_MS);
+      if (ready > 0) { return true; }
+      if (ready < 0 && errno != EINTR) { remote_failure("can't wait for {}: {}", authority, std::strerror(errno)); }
+    }
+    return false;
+  }
+
+  std::string read_line()
+  {
+    std::string line;
+    uint8_t c;
+    while (raw_read(&c, 1) == 1) {
+      if (c == '\n') { break; }
+      if (c != '\r') { line += char(c); }
+    }
+    return line;
+  }
+
+public:
+  std::optional<std::string> redirect;
+
+  http_source(const std::string &url, const download_request &request, const std::atomic<bool> &cancelled)
+    : cancelled(cancelled)
+  {
+    std::string_view rest = std::string_view(url).substr(std::strlen("http://"));
+    size_t path_start = rest.find('/');
+    authority = rest.substr(0, path_start);
+    std::string path = path_start == std::string_view::npos ? "/" : std::string(rest.substr(path_start));
+
+    std::string host = authority, port = "80";
+    if (size_t colon = authority.rfind(':'); colon != std::string::npos) {
+      host = authority.substr(0, colon);
+      port = authority.substr(colon + 1);
+    }
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addresses_raw;
+    if (int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses_raw); error != 0) {
+      remote_failure("can't resolve {}: {}", host, gai_strerror(error));
+    }
+    std::unique_ptr<addrinfo, decltype(&freeaddrinfo)> addresses(addresses_raw, freeaddrinfo);
+    for (addrinfo *it = addresses.get(); it != nullptr && connection.fd < 0; it = it->ai_next) {
+      connection.fd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+      if (connection.fd < 0) { continue; }
+      // Connected without blocking, so a dead address is given up on.
+      int flags = fcntl(connection.fd, F_GETFL);
+      fcntl(connection.fd, F_SETFL, flags | O_NONBLOCK);
+      int error = 0;
+      socklen_t error_len = sizeof(error);
+      bool connected = connect(connection.fd, it->ai_addr, it->ai_addrlen) == 0
+                       || (errno == EINPROGRESS && wait_for(POLLOUT, CONNECT_TIMEOUT_MS)
+                           && getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0 && error == 0);
+      if (connected) {
+        fcntl(connection.fd, F_SETFL, flags);
+      } else {
+        connection.reset();
+      }
+    }
+    if (connection.fd < 0) { remote_failure("can't connect to {}", authority); }
+
+    std::string message = fmt::format(
+      "GET {} HTTP/1.1\r\nHost: {}\r\nUser-Agent: depmgr/" DEPMGR_VERSION "\r\nConnection: close\r\n", path, authority);
+    if (request.username.has_value()) {
+      message +=
+        fmt::format("Authorization: Basic {}\r\n", base64(*request.username + ":" + request.password.value_or("")));
+    }
+    for (const auto &header : request.headers) { message += header + "\r\n"; }
+    message += "\r\n";
+    for (size_t sent = 0; sent < message.size();) {
+      ssize_t written = send(connection.fd, message.data() + sent, message.size() - sent, 0);
+      if (written <= 0) { remote_failure("can't send request to {}", authority); }
+      sent += written;
+    }
+
+    std::string status_line = read_line();
+    int status = 0;
+    if (sscanf(status_line.c_str(), "HTTP/%*d.%*d %d", &status) != 1) {
+      remote_failure("invalid HTTP response from {}", authority);
+    }
+
+    std::string location;
+    for (std::string line = read_line(); !line.empty(); line = read_line()) {
+      size_t colon = line.find(':');
+      if (colon == std::string::npos) { continue; }
+      std::string name = line.substr(0, colon);
+      std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+      // Values may be empty or padded with whitespace on either side.
+      size_t begin = line.find_first_not_of(" \t\r", colon + 1);
+      std::string value;
+      if (begin != std::string::npos) { value = line.substr(begin, line.find_last_not_of(" \t\r") + 1 - begin); }
+
+      if (name == "content-length") {
+        uint64_t length = 0;
+        auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), length);
+        if (error != std::errc() || end != value.data() + value.size()) {
+          remote_failure("{} sent an invalid Content-Length: {}", authority, value);
+        }
+        body_left = length;
+      }
+      if (name == "transfer-encoding" && value.find("chunked") != std::string::npos) { chunked = true; }
+      if (name == "location") { location = value; }
+    }
+
+    if (status >= 300 && status < 400 && !location.empty()) {
+      redirect = starts_with(location, "/") ? fmt::format("http://{}{}", authority, location) : location;
+      return;
+    }
+    if (status != 200) { remote_failure("{} responded with HTTP {}", url, status); }
+  }
+
+  size_t read(uint8_t *buffer, size_t len) override
+  {
+    if (finished) { return 0; }
+
+    if (chunked) {
+      if (chunk_left == 0) {
+        chunk_left = std::strtoull(read_line().c_str(), nullptr, 16);
+        if (chunk_left == 0) {
+          finished = true;
+          return 0;
+        }
+      }
+      size_t received = raw_read(buffer, static_cast<size_t>(std::min<uint64_t>(len, chunk_left)));
+      if (received == 0) { remote_failure("{} closed the connection inside a chunk", authority); }
+      chunk_left -= received;
+      if (chunk_left == 0) { read_line(); }
+      return received;
+    }
+
+    if (body_left.has_value()) { len = static_cast<size_t>(std::min<uint64_t>(len, *body_left)); }
+    if (len == 0) {
+      finished = true;
+      return 0;
+    }
+    size_t received = raw_read(buffer, len);
+    if (body_left.has_value()) {
+      if (received == 0) { remote_failure("{} closed the connection before the end of the body", authority); }
+      *body_left -= received;
+    }
+    return received;
+  }
+};
+#endif
+
+std::unique_ptr<byte_source> open_url(const download_request &request, const std::atomic<bool> &cancelled)
+{
+  if (starts_with(request.url, "file://")) {
+    std::string_view path = std::string_view(request.url).substr(std::strlen("file://"));
+#if defined(_WIN32)
+    // file:///C:/path
+    if (starts_with(path, "/") && path.size() > 2 && path[2] == ':') { path.remove_prefix(1); }
+#endif
+    return std::make_unique<file_source>(fs::path(std::string(path)));
+  }
+
+#if defined(DEPMGR_HAS_SOCKETS)
+  std::string url = request.url;
+  for (int redirects = 0; starts_with(url, "http://"); redirects++) {
+    auto source = std::make_unique<http_source>(url, request, cancelled);
+    if (!source->redirect.has_value()) { return source; }
+    if (redirects == MAX_REDIRECTS) { remote_failure("too many redirects for {}", request.url); }
+    url = *source->redirect;
+  }
+  // Another mirror may still serve it, e.g. when this one redirects to https.
+  if (url != request.url) { remote_failure("{} redirected to unsupported URL {}", request.url, url); }
+#endif
+
+  critical_error("unsupported URL: {}", request.url);
+}
+
+void download_and_extract(byte_source &source,
+  const std::string &url,
+  const std::optional<std::string> &expected_sha256,
+  const fs::path &dest)
+{
+  trace_span span("download and extract");
+  sha256 hash;
+  try {
+    archive_extractor extractor(dest);
+    auto buffer = std::make_unique<uint8_t[]>(READ_CHUNK);
+    while (size_t len = source.read(buffer.get(), READ_CHUNK)) {
+      hash.update(buffer.get(), len);
+      extractor.feed(buffer.get(), len);
+    }
+    extractor.finish();
+  } catch (const remote_error &) {
+    fs::remove_all(dest);
+    throw;
+  }
+
+  std::string actual = hash.hex_digest();
+  if (expected_sha256.has_value() && actual != *expected_sha256) {
+    fs::remove_all(dest);
+    remote_failure("SHA256 mismatch for {}: expected {}, got {}", url, *expected_sha256, actual);
+  }
+
+  strip_single_top_directory(dest);
+}
@@ -0,0 +1,50 @@
+#ifndef _DEPMGR_DOWNLOAD_HPP_
+#define _DEPMGR_DOWNLOAD_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class byte_source
+{
+public:
+  virtual ~byte_source() = default;
+
+  /// Reads up to `len` bytes, returns 0 at the end of the stream.
+  virtual size_t read(uint8_t *buffer, size_t len) = 0;
+};
+
+struct download_request
+{
+  std::string url;
+  std::vector<std::string> headers;
+  std::optional<std::string> username;
+  std::optional<std::string> password;
+};
+
+/// Whether depmgr can download `url` itself: file:// everywhere and plain
+/// http:// where BSD sockets are available. Anything else is left to CMake.
+bool is_streamable_url(std::string_view url);
+
+/// Connects and waits for the response headers, which is what mirrors race
+/// on. Setting `cancelled` makes a pending connection give up. Network
+/// failures, here or while reading, are remote_errors.
+std::unique_ptr<byte_source> open_url(const download_request &request, const std::atomic<bool> &cancelled);
+
+/// Extracts the archive read from `source`, downloaded from `url`, into `dest`
+/// in a single pass: bytes are hashed as they're read and decompressed
+/// straight into the tree, no archive is ever stored. When the download fails
+/// or the SHA-256 doesn't match, `dest` is removed and a remote_error thrown,
+/// another mirror might serve the right archive.
+void download_and_extract(byte_source &source,
+  const std::string &url,
+  const std::optional<std::string> &expected_sha256,
+  const std::filesystem::path &dest);
+
+#endif /* _DEPMGR_DOWNLOAD_HPP_ */
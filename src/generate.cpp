@@ -0,0 +1,125 @@
+#include "generate.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string_view>
+
+#include <fmt/ranges.h>
+
+#include "git.hpp"
+#include "hash.hpp"
+#include "lockfile.hpp"
+#include "manifest.hpp"
+#include "state.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+
+namespace fs = std::filesystem;
+
+generation resolve_generation(const fs::path &manifest_path,
+  std::shared_ptr<const toml_document> manifest,
+  const fs::path &work_dir,
+  bool fetch,
+  const std::vector<std::string> &arguments,
+  const manifest_loader &load,
+  thread_pool *pool)
+{
+  trace_span span("resolve dependencies");
+  generation result;
+  result.manifest = std::move(manifest);
+
+  fs::path manifest_dir = fs::absolute(manifest_path).parent_path();
+  package_table roots = parse_packages(result.manifest->root(), manifest_dir, false);
+  roots.work_dir = work_dir;
+
+  std::optional<std::string> lock_contents = read_file(lockfile_path(manifest_path));
+  std::optional<lockfile> lock = lockfile::load(lockfile_path(manifest_path));
+  if (lock.has_value()) { roots.apply_lock(*lock); }
+  std::optional<vendor_pack> pack = vendor_pack::open(vendor_pack_path(manifest_path));
+
+  {
+    git_library git;
+    dependency_walker(result.graph, lock, pack, fetch, load, pool).walk(std::move(roots));
+  }
+  result.packages = result.graph.into_topological_order();
+
+  // Configure scripts are evaluated in the including project, which the
+  // ExternalProject sub-builds of a superbuild don't see.
+  if (execution_context::get().superbuild) {
+    std::vector<std::string_view> scripted;
+    for (package_id id = 0; id < result.packages.size(); id++) {
+      if (result.packages.configure[id].has_value()) { scripted.push_back(result.packages.names[id]); }
+    }
+    if (!scripted.empty()) {
+      throw std::runtime_error(
+        fmt::format("configure scripts can't run with --superbuild, used by: {}", fmt::join(scripted, ", ")));
+    }
+  }
+
+  // Anything that changes the generated script has to be part of the
+  // fingerprint, otherwise an unchanged one would hide the change from CMake.
+  sha256 fingerprint_hash;
+  fingerprint_hash.update(DEPMGR_VERSION).update("\0", 1).update(result.manifest->source()).update("\0", 1);
+  fingerprint_hash.update(lock_contents.value_or("")).update("\0", 1);
+  std::vector<std::string_view> nested_sources;
+  for (const auto &nested : result.graph.nested_manifests) { nested_sources.push_back(nested->source()); }
+  std::sort(nested_sources.begin(), nested_sources.end());
+  for (auto nested : nested_sources) { fingerprint_hash.update(nested).update("\0", 1); }
+  std::vector<std::string_view> nested_locks(result.graph.nested_locks.begin(), result.graph.nested_locks.end());
+  std::sort(nested_locks.begin(), nested_locks.end());
+  for (auto nested : nested_locks) { fingerprint_hash.update(nested).update("\0", 1); }
+  for (const auto &argument : arguments) { fingerprint_hash.update(argument).update("\0", 1); }
+  // Prebuilt packages embed the artifact directory, which DEPMGR_CACHE_DIR
+  // can move without any argument changing.
+  fingerprint_hash.update(execution_context::get().dependency_cache_dir.generic_string()).update("\0", 1);
+  const package_table &packages = result.packages;
+  for (package_id id = 0; id < packages.size(); id++) {
+    if (packages.is_prepared(id)) { fingerprint_hash.update(packages.names[id]).update("\0", 1); }
+    // Patches are referenced by path, their contents only by hash.
+    if (packages.patches[id] != nullptr) { fingerprint_hash.update(packages.patch_set_hash(id)).update("\0", 1); }
+  }
+  result.fingerprint = fmt::format("# depmgr fingerprint: {}\n", fingerprint_hash.hex_digest());
+  return result;
+}
+
+std::vector<std::string> missing_offline_sources(const package_table &packages)
+{
+  std::vector<std::string> missing;
+  for (package_id id = 0; id < packages.size(); id++) {
+    if (auto problem = packages.offline_problem(id)) {
+      missing.emplace_back(fmt::format("{}: {}", packages.names[id], *problem));
+    }
+  }
+  return missing;
+}
+
+fs::path work_dir_path(const fs::path &output) { return output.parent_path() / "_depmgr"; }
+
+fs::path json_manifest_path(const fs::path &output) { return fs::path(output).replace_extension(".manifest.json"); }
+
+fs::path binary_manifest_path(const fs::path &output) { return fs::path(output).replace_extension(".manifest.bin"); }
+
+bool is_up_to_date(const generation &current, const fs::path &output)
+{
+  auto &context = execution_context::get();
+  bool manifests_present = (!context.emit_json || fs::exists(json_manifest_path(output)))
+                           && (!context.emit_binary || fs::exists(binary_manifest_path(output)));
+  return manifests_present && read_file_prefix(output, current.fingerprint.size()) == current.fingerprint;
+}
+
+void write_generation(const generation &current, const fmt::memory_buffer &script, const fs::path &output)
+{
+  trace_span span("write output");
+  write_file_atomic(output, std::string_view(script.data(), script.size()));
+
+  auto &context = execution_context::get();
+  if (!context.emit_json && !context.emit_binary) { return; }
+
+  const package_table &packages = current.packages;
+  std::vector<resolved_package> resolved;
+  resolved.reserve(packages.size());
+  for (package_id id = 0; id < packages.size(); id++) { resolved.emplace_back(packages.resolve_manifest(id)); }
+
+  if (context.emit_json) { write_manifest_json(resolved, json_manifest_path(output)); }
+  if (context.emit_binary) { write_manifest_binary(resolved, binary_manifest_path(output)); }
+}
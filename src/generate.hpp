@@ -0,0 +1,58 @@
+#ifndef _DEPMGR_GENERATE_HPP_
+#define _DEPMGR_GENERATE_HPP_
+
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "graph.hpp"
+#include "package.hpp"
+#include "toml.hpp"
+
+/// Everything the generated script is computed from. The packages borrow from
+/// the manifest and the graph's nested manifests.
+struct generation
+{
+  std::shared_ptr<const toml_document> manifest;
+  dependency_graph graph;
+  package_table packages;
+  /// First line of the script, changes whenever any input of it does.
+  std::string fingerprint;
+};
+
+/// Parses the manifest at `manifest_path` with its lockfile, walks its nested
+/// manifests and orders the packages, preparing sources in `work_dir`.
+/// `arguments` are the command line options, which are part of the
+/// fingerprint. Nested manifests are walked on `pool` when one is given.
+/// Conflicting revisions and cycles fail with a graph_error, configure
+/// scripts with --superbuild with a runtime_error and a broken vendor pack
+/// with a vendor_error.
+generation resolve_generation(const std::filesystem::path &manifest_path,
+  std::shared_ptr<const toml_document> manifest,
+  const std::filesystem::path &work_dir,
+  bool fetch,
+  const std::vector<std::string> &arguments,
+  const manifest_loader &load = load_manifest,
+  thread_pool *pool = nullptr);
+
+/// Packages whose sources aren't on disk, with the reason, for --offline.
+std::vector<std::string> missing_offline_sources(const package_table &packages);
+
+/// Directory the sources of `output` are prepared in.
+std::filesystem::path work_dir_path(const std::filesystem::path &output);
+
+std::filesystem::path json_manifest_path(const std::filesystem::path &output);
+std::filesystem::path binary_manifest_path(const std::filesystem::path &output);
+
+/// Whether `output` and the requested resolved manifests were written from
+/// the same inputs.
+bool is_up_to_date(const generation &current, const std::filesystem::path &output);
+
+/// Writes `script` to `output` and the resolved manifests requested with --emit.
+void write_generation(const generation &current, const fmt::memory_buffer &script, const std::filesystem::path &output);
+
+#endif /* _DEPMGR_GENERATE_HPP_ */
@@ -0,0 +1,322 @@
+#include "git.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string_view>
+#include <utility>
+
+#include "trace.hpp"
+
+namespace fs = std::filesystem;
+
+static bool is_commit_id(const std::string &rev)
+{
+  return rev.size() == GIT_OID_SHA1_HEXSIZE && std::all_of(rev.begin(), rev.end(), ::isxdigit);
+}
+
+static std::string oid_to_string(const git_oid *oid)
+{
+  char buffer[GIT_OID_SHA1_HEXSIZE + 1];
+  git_oid_tostr(buffer, sizeof(buffer), oid);
+  return std::string(buffer);
+}
+
+/// Like git_check, for failures of the remote rather than of depmgr.
+template<typename... T> static void git_check_remote(int error, fmt::format_string<T...> fmt, T &&...args)
+{
+  if (error >= 0) { return; }
+  const git_error *last = git_error_last();
+  remote_failure(
+    "{}: {}", fmt::format(fmt, std::forward<T>(args)...), last != nullptr ? last->message : "unknown libgit2 error");
+}
+
+static git_revision resolve_remote(const std::string &url,
+  const std::optional<std::string> &rev,
+  const std::atomic<bool> &cancelled)
+{
+  git_remote *remote_raw;
+  git_check(git_remote_create_detached(&remote_raw, url.c_str()), "can't create remote for {}", url);
+  git_remote_ptr remote(remote_raw);
+
+  git_remote_callbacks callbacks = GIT_REMOTE_CALLBACKS_INIT;
+  git_check_remote(git_remote_connect(remote.get(), GIT_DIRECTION_FETCH, &callbacks, nullptr, nullptr),
+    "can't connect to {}",
+    url);
+  if (cancelled.load()) { remote_failure("cancelled"); }
+
+  const git_remote_head **heads;
+  size_t head_count;
+  git_check_remote(git_remote_ls(&heads, &head_count, remote.get()), "can't list references of {}", url);
+
+  // Peeled tag entries come first so annotated tags resolve to their commit.
+  std::vector<std::string> candidates;
+  if (rev.has_value()) {
+    candidates = {
+      fmt::format("refs/tags/{}^{{}}", *rev),
+      fmt::format("refs/tags/{}", *rev),
+      fmt::format("refs/heads/{}", *rev),
+      *rev,
+    };
+  } else {
+    candidates = {"HEAD"};
+  }
+
+  git_revision result;
+  for (const auto &candidate : candidates) {
+    for (size_t i = 0; i < head_count; i++) {
+      const git_remote_head *head = heads[i];
+      if (candidate != head->name) { continue; }
+
+      result.commit = oid_to_string(&head->oid);
+      result.ref = candidate.substr(0, candidate.rfind("^{}"));
+      if (result.ref == "HEAD" && head->symref_target != nullptr) { result.ref = head->symref_target; }
+      break;
+    }
+    if (!result.commit.empty()) { break; }
+  }
+  git_remote_disconnect(remote.get());
+
+  if (result.commit.empty()) {
+    if (!rev.has_value() || !is_commit_id(*rev)) {
+      remote_failure("can't resolve '{}' in {}", rev.value_or("HEAD"), url);
+    }
+    result.commit = *rev;
+  }
+  return result;
+}
+
+namespace {
+/// Revision of one (url, rev) pair, resolved by whoever asked first while
+/// the others wait for it.
+struct resolved_revision
+{
+  std::mutex lock;
+  std::optional<git_revision> revision;
+};
+
+struct resolve_memo
+{
+  std::mutex lock;
+  size_t users = 0;
+  std::map<std::pair<std::string, std::string>, std::shared_ptr<resolved_revision>> revisions;
+};
+}// namespace
+
+static resolve_memo &memo()
+{
+  static resolve_memo instance;
+  return instance;
+}
+
+git_resolve_memo::git_resolve_memo()
+{
+  std::lock_guard guard(memo().lock);
+  memo().users++;
+}
+
+git_resolve_memo::~git_resolve_memo()
+{
+  std::lock_guard guard(memo().lock);
+  if (--memo().users == 0) { memo().revisions.clear(); }
+}
+
+git_revision git_resolve(const std::string &url,
+  const std::optional<std::string> &rev,
+  const std::atomic<bool> &cancelled)
+{
+  std::shared_ptr<resolved_revision> entry;
+  {
+    std::lock_guard guard(memo().lock);
+    if (memo().users == 0) { return resolve_remote(url, rev, cancelled); }
+    auto &slot = memo().revisions[{url, rev.value_or("")}];
+    if (slot == nullptr) { slot = std::make_shared<resolved_revision>(); }
+    entry = slot;
+  }
+
+  // Failures aren't remembered, the next caller tries again.
+  std::lock_guard guard(entry->lock);
+  if (!entry->revision.has_value()) { entry->revision = resolve_remote(url, rev, cancelled); }
+  return *entry->revision;
+}
+
+/// Stores `revision` under its own name in a mirror. Commits requested by id
+/// get a ref of their own so they stay reachable.
+static std::string mirror_refspec(const git_revision &revision)
+{
+  if (revision.ref.empty()) { return fmt::format("+{0}:refs/depmgr/commits/{0}", revision.commit); }
+  if (revision.ref.rfind("refs/", 0) == 0) { return fmt::format("+{0}:{0}", revision.ref); }
+  return fmt::format("+{}:refs/depmgr/fetched", revision.ref);
+}
+
+static bool has_commit(git_repository *repo, const git_oid &oid)
+{
+  git_object *commit_raw;
+  if (git_object_lookup(&commit_raw, repo, &oid, GIT_OBJECT_COMMIT) != 0) { return false; }
+  git_object_free(commit_raw);
+  return true;
+}
+
+struct submodule_filter
+{
+  const std::optional<std::vector<std::string>> &names;
+  const std::vector<std::string> &sparse_paths;
+};
+
+static bool in_sparse_paths(const std::vector<std::string> &sparse_paths, std::string_view path)
+{
+  if (sparse_paths.empty()) { return true; }
+  return std::any_of(sparse_paths.begin(), sparse_paths.end(), [path](std::string_view prefix) {
+    while (!prefix.empty() && prefix.back() == '/') { prefix.remove_suffix(1); }
+    return path.rfind(prefix, 0) == 0 && (path.size() == prefix.size() || path[prefix.size()] == '/');
+  });
+}
+
+static int update_submodule(git_submodule *submodule, const char *name, void *payload)
+{
+  auto *filter = static_cast<const submodule_filter *>(payload);
+  const auto &wanted = filter->names;
+  if (wanted.has_value() && std::find(wanted->begin(), wanted->end(), name) == wanted->end()) { return 0; }
+  if (!in_sparse_paths(filter->sparse_paths, git_submodule_path(submodule))) { return 0; }
+
+  git_submodule_update_options options = GIT_SUBMODULE_UPDATE_OPTIONS_INIT;
+  options.checkout_opts.checkout_strategy = GIT_CHECKOUT_FORCE;
+  git_check(git_submodule_update(submodule, 1, &options), "can't update submodule {}", name);
+  return 0;
+}
+
+/// Fetches `refspec` from `remote` without tags, returns the libgit2 error.
+static int fetch_refspec(git_remote *remote, std::string refspec)
+{
+  char *refspec_strings[] = {refspec.data()};
+  git_strarray refspecs = {refspec_strings, 1};
+  git_fetch_options fetch_options = GIT_FETCH_OPTIONS_INIT;
+  fetch_options.download_tags = GIT_REMOTE_DOWNLOAD_TAGS_NONE;
+  return git_remote_fetch(remote, &refspecs, &fetch_options, nullptr);
+}
+
+void git_mirror_fetch(const fs::path &mirror, const std::string &url, const git_revision &revision, bool locked)
+{
+  // Concurrent fetches into one repository would race on its refs and packs.
+  file_lock lock(fs::path(mirror).concat(".lock"));
+
+  git_repository *repo_raw;
+  if (git_repository_open_bare(&repo_raw, mirror.string().c_str()) != 0) {
+    git_check(git_repository_init(&repo_raw, mirror.string().c_str(), true), "can't create mirror {}", mirror.string());
+  }
+  git_repository_ptr repo(repo_raw);
+
+  git_oid oid;
+  git_check(git_oid_fromstr(&oid, revision.commit.c_str()), "invalid commit id {}", revision.commit);
+  if (has_commit(repo.get(), oid)) { return; }
+
+  git_remote *remote_raw;
+  git_check(git_remote_create_anonymous(&remote_raw, repo.get(), url.c_str()), "can't create remote for {}", url);
+  git_remote_ptr remote(remote_raw);
+
+  trace_span span("git fetch");
+  // The ref may have moved past a locked commit since it was locked, so the
+  // commit is asked for by id first. Servers refusing commits they don't
+  // advertise get the ref instead.
+  if (locked && !revision.ref.empty()) {
+    std::string by_commit = mirror_refspec(git_revision{"", revision.commit});
+    if (fetch_refspec(remote.get(), by_commit) >= 0 && has_commit(repo.get(), oid)) { return; }
+  }
+  std::string refspec = mirror_refspec(revision);
+  git_check_remote(fetch_refspec(remote.get(), refspec), "can't fetch {} from {}", refspec, url);
+
+  if (!has_commit(repo.get(), oid)) { remote_failure("{} didn't provide commit {}", url, revision.commit); }
+}
+
+void git_checkout(const fs::path &mirror,
+  const std::string &url,
+  const std::string &remote_name,
+  const git_revision &revision,
+  const fs::path &dest,
+  const std::optional<std::vector<std::string>> &submodules,
+  const std::vector<std::string> &sparse_paths)
+{
+  fs::remove_all(dest);
+  fs::create_directories(dest);
+
+  git_repository *repo_raw;
+  git_check(
+    git_repository_init(&repo_raw, dest.string().c_str(), false), "can't create repository in {}", dest.string());
+  git_repository_free(repo_raw);
+
+  // The object database is loaded on open, so alternates are written between
+  // creating the repository and using it.
+  fs::path alternates = dest / ".git" / "objects" / "info" / "alternates";
+  fs::create_directories(alternates.parent_path());
+  std::ofstream(alternates) << (mirror / "objects").generic_string() << "\n";
+
+  git_check(git_repository_open(&repo_raw, dest.string().c_str()), "can't open repository in {}", dest.string());
+  git_repository_ptr repo(repo_raw);
+
+  // Only recorded for submodules with relative URLs and for users of the
+  // checkout, nothing is fetched through it.
+  git_remote *remote_raw;
+  git_check(git_remote_create(&remote_raw, repo.get(), remote_name.c_str(), url.c_str()),
+    "can't create remote for {}",
+    url);
+  git_remote_ptr remote(remote_raw);
+
+  git_oid oid;
+  git_check(git_oid_fromstr(&oid, revision.commit.c_str()), "invalid commit id {}", revision.commit);
+
+  git_object *commit_raw;
+  git_check(git_object_lookup(&commit_raw, repo.get(), &oid, GIT_OBJECT_COMMIT),
+    "mirror of {} doesn't have commit {}",
+    url,
+    revision.commit);
+  git_object_ptr commit(commit_raw);
+
+  trace_span span("git checkout");
+  git_checkout_options checkout_options = GIT_CHECKOUT_OPTIONS_INIT;
+  checkout_options.checkout_strategy = GIT_CHECKOUT_FORCE;
+  std::vector<char *> path_strings;
+  for (const auto &path : sparse_paths) { path_strings.push_back(const_cast<char *>(path.c_str())); }
+  checkout_options.paths = {path_strings.data(), path_strings.size()};
+  git_check(git_checkout_tree(repo.get(), commit.get(), &checkout_options), "can't check out {}", revision.commit);
+  git_check(git_repository_set_head_detached(repo.get(), &oid), "can't detach HEAD at {}", revision.commit);
+
+  submodule_filter filter{submodules, sparse_paths};
+  git_check(git_submodule_foreach(repo.get(), update_submodule, &filter), "can't update submodules of {}", url);
+}
+
+void git_apply_patches(const fs::path &tree, const std::vector<fs::path> &patches)
+{
+  fs::path git_dir = fs::path(tree).concat(".patch.git");
+  fs::remove_all(git_dir);
+  std::string workdir = tree.string();
+
+  git_repository_init_options init_options = GIT_REPOSITORY_INIT_OPTIONS_INIT;
+  init_options.flags = GIT_REPOSITORY_INIT_MKPATH | GIT_REPOSITORY_INIT_NO_DOTGIT_DIR;
+  init_options.workdir_path = workdir.c_str();
+  git_repository *repo_raw;
+  git_check(git_repository_init_ext(&repo_raw, git_dir.string().c_str(), &init_options),
+    "can't create scratch repository for {}",
+    workdir);
+  git_repository_ptr repo(repo_raw);
+
+  for (const auto &patch : patches) {
+    trace_span span("git apply", patch.filename().string());
+    std::optional<std::string> contents = read_file(patch);
+    if (!contents.has_value()) { critical_error("can't read patch {}", patch.string()); }
+
+    git_diff *diff_raw;
+    git_check(git_diff_from_buffer(&diff_raw, contents->data(), contents->size()), "can't parse {}", patch.string());
+    git_diff_ptr diff(diff_raw);
+    // Only the work tree is touched, its files are the preimage.
+    git_check(git_apply(repo.get(), diff.get(), GIT_APPLY_LOCATION_WORKDIR, nullptr),
+      "can't apply {} to {}",
+      patch.string(),
+      workdir);
+  }
+
+  repo.reset();
+  fs::remove_all(git_dir);
+}
@@ -0,0 +1,104 @@
+#ifndef _DEPMGR_GIT_HPP_
+#define _DEPMGR_GIT_HPP_
+
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <git2.h>
+
+#include "util.hpp"
+
+template<typename T, void (*Free)(T *)> struct git_deleter
+{
+  void operator()(T *value) const { Free(value); }
+};
+template<typename T, void (*Free)(T *)> using git_ptr = std::unique_ptr<T, git_deleter<T, Free>>;
+
+using git_repository_ptr = git_ptr<git_repository, git_repository_free>;
+using git_remote_ptr = git_ptr<git_remote, git_remote_free>;
+using git_object_ptr = git_ptr<git_object, git_object_free>;
+using git_diff_ptr = git_ptr<git_diff, git_diff_free>;
+
+template<typename... T> inline void git_check(int error, fmt::format_string<T...> fmt, T &&...args)
+{
+  if (error >= 0) { return; }
+  const git_error *last = git_error_last();
+  critical_error(
+    "{}: {}", fmt::format(fmt, std::forward<T>(args)...), last != nullptr ? last->message : "unknown libgit2 error");
+}
+
+/// Keeps libgit2 initialized while alive.
+struct git_library
+{
+  git_library()
+  {
+    git_libgit2_init();
+    // A dead remote fails over to the next mirror instead of stalling.
+    git_libgit2_opts(GIT_OPT_SET_SERVER_CONNECT_TIMEOUT, 10 * 1000);
+    git_libgit2_opts(GIT_OPT_SET_SERVER_TIMEOUT, 30 * 1000);
+  }
+  ~git_library() { git_libgit2_shutdown(); }
+};
+
+struct git_revision
+{
+  /// Remote reference the commit was found under, empty when the revision was
+  /// given as a commit id.
+  std::string ref;
+  std::string commit;
+};
+
+/// Resolves a tag, branch or commit id against the remote without fetching
+/// any objects. An empty revision resolves the remote HEAD. A remote that
+/// can't be reached or doesn't have the revision is a remote_error, as is
+/// setting `cancelled` before the references were listed.
+git_revision git_resolve(const std::string &url,
+  const std::optional<std::string> &rev,
+  const std::atomic<bool> &cancelled);
+
+/// While one is alive, git_resolve contacts the remote once per url and
+/// revision, and later calls get the same commit. For runs that resolve the
+/// same packages many times, like a batch.
+struct git_resolve_memo
+{
+  git_resolve_memo();
+  ~git_resolve_memo();
+
+  git_resolve_memo(const git_resolve_memo &) = delete;
+  git_resolve_memo &operator=(const git_resolve_memo &) = delete;
+};
+
+/// Makes sure the bare repository at `mirror`, created if missing, has the
+/// commit of `revision` from `url`. The mirror keeps full history, so the
+/// remote only sends objects it doesn't have yet, and nothing is transferred
+/// when the commit is already there. A `locked` revision is fetched by commit
+/// id, and through its ref only when the remote refuses. Failing to fetch is
+/// a remote_error.
+void git_mirror_fetch(const std::filesystem::path &mirror,
+  const std::string &url,
+  const git_revision &revision,
+  bool locked);
+
+/// Checks out the commit of `revision` detached into a fresh repository at
+/// `dest` that borrows every object from `mirror` through alternates, so the
+/// checkout only adds its work tree and index. Its remote `remote_name` points
+/// at `url`. A non-empty `sparse_paths` limits the checkout, and the
+/// submodules updated, to those paths.
+void git_checkout(const std::filesystem::path &mirror,
+  const std::string &url,
+  const std::string &remote_name,
+  const git_revision &revision,
+  const std::filesystem::path &dest,
+  const std::optional<std::vector<std::string>> &submodules = std::nullopt,
+  const std::vector<std::string> &sparse_paths = {});
+
+/// Applies `patches` in order to the files under `tree`, in-process. The work
+/// tree of a scratch repository next to `tree` is pointed at it, so `tree`
+/// doesn't have to be a repository and ends up without one.
+void git_apply_patches(const std::filesystem::path &tree, const std::vector<std::filesystem::path> &patches);
+
+#endif /* _DEPMGR_GIT_HPP_ */
@@ -0,0 +1,200 @@
+#include "graph.hpp"
+
+#include <algorithm>
+
+#include <fmt/ranges.h>
+
+#include "state.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+
+namespace fs = std::filesystem;
+
+std::shared_ptr<const toml_document> load_manifest(const fs::path &path)
+{
+  auto document = toml_document::load(path);
+  if (!document.has_value()) { return nullptr; }
+  return std::make_shared<const toml_document>(std::move(*document));
+}
+
+package_table dependency_graph::into_topological_order()
+{
+  trace_span span("order packages");
+  std::vector<size_t> remaining(packages.size());
+  std::vector<std::vector<size_t>> dependents(packages.size());
+  for (size_t i = 0; i < packages.size(); i++) {
+    remaining[i] = dependencies[i].size();
+    for (size_t dependency : dependencies[i]) { dependents[dependency].push_back(i); }
+  }
+
+  std::vector<size_t> ready;
+  for (size_t i = packages.size(); i-- > 0;) {
+    if (remaining[i] == 0) { ready.push_back(i); }
+  }
+
+  package_table result;
+  result.reserve(packages.size());
+  if (!segments.empty()) { result.work_dir = segments.front()->work_dir; }
+  std::unordered_map<const package_table *, uint32_t> origin_base;
+  for (const auto &segment : segments) {
+    origin_base.emplace(segment.get(), uint32_t(result.manifests.size()));
+    for (const auto &origin : segment->manifests) { result.add_origin(origin); }
+  }
+
+  std::vector<package_id> merged_ids(packages.size());
+  while (!ready.empty()) {
+    size_t current = ready.back();
+    ready.pop_back();
+    const package_ref &ref = packages[current];
+    merged_ids[current] = result.append(*ref.table, ref.id, origin_base[ref.table] + ref.table->origins[ref.id]);
+    for (size_t dependency : dependencies[current]) {
+      result.depends[merged_ids[current]].push_back(merged_ids[dependency]);
+    }
+    for (size_t dependent : dependents[current]) {
+      if (--remaining[dependent] == 0) { ready.push_back(dependent); }
+    }
+  }
+
+  if (result.size() != packages.size()) {
+    std::vector<std::string_view> cycle;
+    for (size_t i = 0; i < packages.size(); i++) {
+      if (remaining[i] != 0) { cycle.push_back(packages[i].name()); }
+    }
+    throw graph_error(fmt::format("dependency cycle between: {}", fmt::join(cycle, ", ")));
+  }
+  // The walk is done, nothing prepares sources anymore.
+  result.settle_sources();
+  return result;
+}
+
+dependency_walker::dependency_walker(dependency_graph &graph,
+  const std::optional<lockfile> &root_lock,
+  const std::optional<vendor_pack> &pack,
+  bool fetch,
+  manifest_loader load,
+  thread_pool *shared_pool)
+    : graph(graph), root_lock(root_lock), pack(pack), fetch(fetch), load(std::move(load)),
+      owned_pool(shared_pool == nullptr ? std::make_unique<thread_pool>(execution_context::get().jobs) : nullptr),
+      pool(shared_pool == nullptr ? *owned_pool : *shared_pool)
+{}
+
+/// Registers every package of `segment` under `parent`; must be called with
+/// `lock` held.
+void dependency_walker::add(std::unique_ptr<package_table> segment, std::optional<size_t> parent)
+{
+  const package_table *table = graph.segments.emplace_back(std::move(segment)).get();
+  for (package_id id = 0; id < table->size(); id++) { add(package_ref{table, id}, parent); }
+}
+
+void dependency_walker::add(package_ref child, std::optional<size_t> parent)
+{
+  std::string_view name = child.name();
+  std::string identity = child.table->identity(child.id);
+  std::string origin = parent.has_value() ? std::string(graph.packages[*parent].name()) : "root manifest";
+
+  std::optional<size_t> existing;
+  if (auto it = graph.by_name.find(name); it != graph.by_name.end()) {
+    if (graph.identities[it->second] != identity) {
+      if (!error.has_value()) {
+        // Identities are kind, remote and revision on lines of their own.
+        auto one_line = [](std::string text) {
+          std::replace(text.begin(), text.end(), '\n', ' ');
+          return text;
+        };
+        error = fmt::format("conflicting revisions of '{}': {} (required by {}) and {} (required by {})",
+          name,
+          one_line(graph.identities[it->second]),
+          graph.required_by[it->second],
+          one_line(identity),
+          origin);
+      }
+      return;
+    }
+    existing = it->second;
+  } else if (auto it = graph.by_identity.find(identity); it != graph.by_identity.end()) {
+    status("{} (required by {}) is the same dependency as {}", name, origin, graph.packages[it->second].name());
+    existing = it->second;
+  }
+
+  if (existing.has_value()) {
+    if (parent.has_value()) { graph.dependencies[*parent].push_back(*existing); }
+    return;
+  }
+
+  size_t index = graph.packages.size();
+  graph.packages.push_back(child);
+  graph.dependencies.emplace_back();
+  graph.required_by.emplace_back(origin);
+  graph.identities.emplace_back(identity);
+  graph.by_name.emplace(name, index);
+  graph.by_identity.emplace(identity, index);
+  if (parent.has_value()) { graph.dependencies[*parent].push_back(index); }
+
+  outstanding++;
+  // The pool keeps what a task throws in a future nobody waits for, so it's
+  // handed to walk() here instead.
+  pool.submit([this, child, index]() {
+    try {
+      visit(child, index);
+    } catch (...) {
+      std::lock_guard guard(lock);
+      if (failure == nullptr) { failure = std::current_exception(); }
+      if (--outstanding == 0) { idle.notify_all(); }
+    }
+  });
+}
+
+void dependency_walker::visit(package_ref current, size_t index)
+{
+  trace_span span("visit", current.name());
+  bool did_fetch = false;
+  bool missing = current.table->fetch_stamp(current.id).has_value() && !current.table->is_prepared(current.id);
+  // Vendored sources are taken from the pack, even when fetching.
+  if (missing && pack.has_value()) { missing = !current.table->prepare_from_pack(current.id, *pack); }
+  if (missing) {
+    if (fetch) {
+      current.table->prepare(current.id);
+      did_fetch = true;
+    } else if (execution_context::get().offline) {
+      current.table->prepare_from_cache(current.id);
+    }
+  }
+
+  std::unique_ptr<package_table> children;
+  std::shared_ptr<const toml_document> document;
+  std::optional<fs::path> nested_manifest;
+  std::optional<std::string> nested_lock_contents;
+  if (auto root = current.table->nested_manifest_root(current.id)) {
+    nested_manifest = *root / "dependencies.toml";
+    document = load(*nested_manifest);
+    if (document != nullptr) {
+      children = std::make_unique<package_table>(parse_packages(document->root(), *root, true));
+      children->work_dir = current.table->work_dir;
+
+      // The root lock is applied last, so it wins over the nested one.
+      nested_lock_contents = read_file(lockfile_path(*nested_manifest));
+      auto nested_lock = lockfile::load(lockfile_path(*nested_manifest));
+      if (nested_lock.has_value()) { children->apply_lock(*nested_lock); }
+      if (root_lock.has_value()) { children->apply_lock(*root_lock); }
+    }
+  }
+
+  std::lock_guard guard(lock);
+  if (did_fetch) { fetched++; }
+  if (nested_manifest.has_value()) { graph.nested_manifest_paths.emplace_back(std::move(*nested_manifest)); }
+  if (document != nullptr) { graph.nested_manifests.emplace_back(std::move(document)); }
+  if (nested_lock_contents.has_value()) { graph.nested_locks.emplace_back(std::move(*nested_lock_contents)); }
+  if (children) { add(std::move(children), index); }
+  if (--outstanding == 0) { idle.notify_all(); }
+}
+
+void dependency_walker::walk(package_table roots)
+{
+  std::unique_lock guard(lock);
+  add(std::make_unique<package_table>(std::move(roots)), std::nullopt);
+  idle.wait(guard, [this]() { return outstanding == 0; });
+  if (failure != nullptr) { std::rethrow_exception(failure); }
+  if (error.has_value()) { throw graph_error(*error); }
+
+  if (fetch) { status("Fetched {} dependencies", fetched); }
+}
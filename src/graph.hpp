@@ -0,0 +1,118 @@
+#ifndef _DEPMGR_GRAPH_HPP_
+#define _DEPMGR_GRAPH_HPP_
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "lockfile.hpp"
+#include "package.hpp"
+#include "thread_pool.hpp"
+#include "toml.hpp"
+#include "vendor.hpp"
+
+/// Loads the manifest at a path, null when there is none.
+using manifest_loader = std::function<std::shared_ptr<const toml_document>(const std::filesystem::path &)>;
+
+/// Reads the manifest from disk every time.
+std::shared_ptr<const toml_document> load_manifest(const std::filesystem::path &path);
+
+/// A package in one of the graph's segments.
+struct package_ref
+{
+  const package_table *table;
+  package_id id;
+
+  std::string_view name() const { return table->names[id]; }
+};
+
+/// Packages reachable from the root manifest through nested dependencies.toml
+/// files, deduplicated by name and by source identity. Every manifest is kept
+/// as its own segment that isn't modified once it's added, so segments can be
+/// read by the walker while new ones are discovered.
+struct dependency_graph
+{
+  /// Every nested manifest read. Packages borrow from them, and their
+  /// contents are inputs of the output.
+  std::vector<std::shared_ptr<const toml_document>> nested_manifests;
+  /// Paths of the nested manifests looked for, whether they exist or not.
+  std::vector<std::filesystem::path> nested_manifest_paths;
+  /// Contents of the lockfiles next to nested manifests, also inputs.
+  std::vector<std::string> nested_locks;
+  std::vector<std::unique_ptr<package_table>> segments;
+
+  std::vector<package_ref> packages;
+  std::vector<std::vector<size_t>> dependencies;
+  std::vector<std::string> required_by;
+  std::vector<std::string> identities;
+
+  std::unordered_map<std::string_view, size_t> by_name;
+  std::unordered_map<std::string, size_t> by_identity;
+
+  /// Merges the segments into one table, dependencies before their
+  /// dependents, otherwise in discovery order, with settled sources. Fails
+  /// with a graph_error on a cycle.
+  package_table into_topological_order();
+};
+
+/// The packages can't be built together: two revisions of one are required,
+/// or they depend on each other in a cycle. Thrown on the calling thread, so
+/// a long running process can report it and keep going.
+class graph_error : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
+
+/// Walks the dependency DAG concurrently: every package is fetched (when
+/// requested) and scanned for a nested manifest on the pool as soon as it's
+/// discovered, so independent subtrees proceed in parallel.
+class dependency_walker
+{
+  dependency_graph &graph;
+  const std::optional<lockfile> &root_lock;
+  const std::optional<vendor_pack> &pack;
+  bool fetch;
+  manifest_loader load;
+
+  /// Visits run on `pool`, shared with other walks or owned by this one.
+  std::unique_ptr<thread_pool> owned_pool;
+  thread_pool &pool;
+  std::mutex lock;
+  std::condition_variable idle;
+  size_t outstanding = 0;
+  size_t fetched = 0;
+  /// First conflict found, the walk goes on without the conflicting package.
+  std::optional<std::string> error;
+  /// First exception a visit failed with, rethrown by walk().
+  std::exception_ptr failure;
+
+  void add(std::unique_ptr<package_table> segment, std::optional<size_t> parent);
+  void add(package_ref child, std::optional<size_t> parent);
+  void visit(package_ref current, size_t index);
+
+public:
+  dependency_walker(dependency_graph &graph,
+    const std::optional<lockfile> &root_lock,
+    const std::optional<vendor_pack> &pack,
+    bool fetch,
+    manifest_loader load = load_manifest,
+    thread_pool *shared_pool = nullptr);
+
+  /// Fails with a graph_error once every package was visited, if two of them
+  /// required conflicting revisions of another. An exception a visit failed
+  /// with is rethrown once the other visits are done.
+  void walk(package_table roots);
+};
+
+#endif /* _DEPMGR_GRAPH_HPP_ */
@@ -0,0 +1,36 @@
+#ifndef _DEPMGR_HASH_HPP_
+#define _DEPMGR_HASH_HPP_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/// Incremental SHA-256, used for cache keys and archive verification.
+class sha256
+{
+  std::array<uint32_t, 8> state;
+  std::array<uint8_t, 64> block;
+  size_t block_len = 0;
+  uint64_t total_len = 0;
+
+  void compress(const uint8_t *chunk);
+
+public:
+  using digest_t = std::array<uint8_t, 32>;
+
+  sha256();
+
+  sha256 &update(const void *data, size_t len);
+  sha256 &update(std::string_view data) { return update(data.data(), data.size()); }
+
+  digest_t digest();
+  std::string hex_digest();
+};
+
+std::string to_hex(const uint8_t *data, size_t len);
+
+inline std::string sha256_hex(std::string_view data) { return sha256().update(data).hex_digest(); }
+
+#endif /* _DEPMGR_HASH_HPP_ */
@@ -0,0 +1,80 @@
+#include "lockfile.hpp"
+
+#include <fmt/format.h>
+
+#include "toml.hpp"
+#include "util.hpp"
+
+namespace fs = std::filesystem;
+
+static std::string quote(const std::string &value)
+{
+  std::string result = "\"";
+  for (char c : value) {
+    if (c == '"' || c == '\\') { result += '\\'; }
+    result += c;
+  }
+  return result + "\"";
+}
+
+std::optional<lockfile> lockfile::load(const fs::path &path)
+{
+  std::optional<toml_document> document = toml_document::load(path);
+  if (!document.has_value()) { return std::nullopt; }
+
+  lockfile result;
+  for (const auto &table : document->root()) {
+    if (!table.is_table()) { continue; }
+
+    lock_entry entry;
+    entry.kind = toml_table_get<std::string>(&table, "kind").value_or("");
+    entry.remote = toml_table_get<std::string>(&table, "remote").value_or("");
+    entry.requested = toml_table_get<std::string>(&table, "requested").value_or("");
+    entry.ref = toml_table_get<std::string>(&table, "ref").value_or("");
+    entry.commit = toml_table_get<std::string>(&table, "commit").value_or("");
+    result.entries.emplace(table.key, std::move(entry));
+  }
+
+  return result;
+}
+
+void lockfile::save(const fs::path &path) const
+{
+  fmt::memory_buffer out;
+  fmt::format_to(std::back_inserter(out), "# Generated by `depmgr lock`, do not edit.\n");
+  for (const auto &[name, entry] : entries) {
+    fmt::format_to(std::back_inserter(out),
+      "\n"
+      "[{}]\n"
+      "kind = {}\n"
+      "remote = {}\n"
+      "requested = {}\n"
+      "ref = {}\n"
+      "commit = {}\n",
+      quote(name),
+      quote(entry.kind),
+      quote(entry.remote),
+      quote(entry.requested),
+      quote(entry.ref),
+      quote(entry.commit));
+  }
+  write_file_atomic(path, std::string_view(out.data(), out.size()));
+}
+
+const lock_entry *lockfile::find(const std::string &name,
+  const std::string &kind,
+  const std::string &remote,
+  const std::string &requested) const
+{
+  auto it = entries.find(name);
+  if (it == entries.end()) { return nullptr; }
+
+  const lock_entry &entry = it->second;
+  if (entry.kind != kind || entry.remote != remote || entry.requested != requested) {
+    status("Ignoring stale lock entry for {}", name);
+    return nullptr;
+  }
+  return &entry;
+}
+
+fs::path lockfile_path(const fs::path &manifest) { return fs::path(manifest).replace_extension(".lock"); }
@@ -0,0 +1,39 @@
+#ifndef _DEPMGR_LOCKFILE_HPP_
+#define _DEPMGR_LOCKFILE_HPP_
+
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <string>
+
+/// Pinned revision of a single package, as written by `depmgr lock`.
+struct lock_entry
+{
+  std::string kind;
+  std::string remote;
+  /// Revision as written in the manifest, "HEAD" when none was given.
+  std::string requested;
+  /// Full remote reference `requested` resolved to, empty for commit ids.
+  std::string ref;
+  std::string commit;
+};
+
+struct lockfile
+{
+  std::map<std::string, lock_entry> entries;
+
+  static std::optional<lockfile> load(const std::filesystem::path &path);
+  void save(const std::filesystem::path &path) const;
+
+  /// Entry for `name`, only if it was locked for the same remote and
+  /// requested revision. Stale entries are ignored.
+  const lock_entry *find(const std::string &name,
+    const std::string &kind,
+    const std::string &remote,
+    const std::string &requested) const;
+};
+
+/// dependencies.lock next to the given manifest.
+std::filesystem::path lockfile_path(const std::filesystem::path &manifest);
+
+#endif /* _DEPMGR_LOCKFILE_HPP_ */
@@ -1,478 +1,337 @@
 #include <algorithm>
-#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <filesystem>
+#include <future>
 #include <memory>
+#include <new>
 #include <optional>
 #include <string>
-#include <type_traits>
-#include <variant>
 #include <vector>
 
-#include <fmt/chrono.h>
 #include <fmt/core.h>
 #include <fmt/ranges.h>
 
-#include "cmake.hpp"
-#include "glob/glob.h"
+#include "batch.hpp"
+#include "cache.hpp"
+#include "daemon.hpp"
+#include "generate.hpp"
+#include "git.hpp"
+#include "lockfile.hpp"
+#include "package.hpp"
+#include "state.hpp"
+#include "thread_pool.hpp"
 #include "toml.hpp"
+#include "trace.hpp"
 #include "util.hpp"
+#include "vendor.hpp"
 
 namespace fs = std::filesystem;
 
-/*
-fs::path git_path_cache = "";
-
-const fs::path &git_path()
+// Counted for --trace. Replacing these in the executable keeps the library
+// usable from binaries that count allocations themselves.
+void *operator new(size_t size)
 {
-  if (!git_path_cache.empty()) { return git_path_cache; }
-
-  fs::path result;
-  auto path = std::string(getenv("PATH"));
-  if (path.empty()) { critical_error("PATH environment variable missing."); }
-
-  size_t pos;
-  while ((pos = path.find(':')) != std::string::npos) {
-    fs::path it = path.substr(0, pos);
-    fs::path candidate = it / GIT_BINARY;
-    if (fs::exists(candidate)) {
-      git_path_cache = candidate;
-      break;
-    }
-    path.erase(0, pos + 1);
-  }
-
-  if (git_path_cache.empty()) { critical_error("Could not find git in PATH"); }
-  return git_path_cache;
+  process_allocations.fetch_add(1, std::memory_order_relaxed);
+  thread_allocations++;
+  if (void *ptr = std::malloc(size == 0 ? 1 : size)) { return ptr; }
+  throw std::bad_alloc();
 }
 
-void git_clone(const std::string &url, const std::string &tag, const fs::path &dest)
-{
-  const fs::path &git = git_path();
-
-  std::string cmd = fmt::format("{} clone {} --recurse-submodules {}", git, url, dest);
-  fmt::println("Cloning: {}", cmd);
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
 
-  if (system(cmd.c_str()) != 0) { critical_error("Can't clone {}", url); }
+void parse_option(const char *option)
+{
+  auto &context = execution_context::get();
+  if (strncmp(option, "--jobs=", 7) == 0) {
+    context.jobs = std::strtoul(option + 7, nullptr, 10);
+    if (context.jobs == 0) { critical_error("invalid job count: {}", option + 7); }
+  } else if (strncmp(option, "--mirror-race=", 14) == 0) {
+    context.mirror_race = std::strtoul(option + 14, nullptr, 10);
+    if (context.mirror_race == 0) { critical_error("invalid mirror count: {}", option + 14); }
+  } else if (strncmp(option, "--cache-dir=", 12) == 0) {
+    context.dependency_cache_dir = fs::absolute(option + 12);
+  } else if (strcmp(option, "--offline") == 0) {
+    context.offline = true;
+  } else if (strcmp(option, "--superbuild") == 0) {
+    context.superbuild = true;
+  } else if (strcmp(option, "--timing") == 0) {
+    context.emit_timing = true;
+  } else if (strncmp(option, "--trace=", 8) == 0) {
+    context.trace_path = fs::absolute(option + 8);
+  } else if (strncmp(option, "--socket=", 9) == 0) {
+    context.socket_path = fs::absolute(option + 9);
+  } else if (strncmp(option, "--emit=", 7) == 0) {
+    std::string_view formats = option + 7;
+    while (!formats.empty()) {
+      std::string_view format = formats.substr(0, formats.find(','));
+      formats.remove_prefix(std::min(formats.size(), format.size() + 1));
+      if (format == "json") {
+        context.emit_json = true;
+      } else if (format == "bin") {
+        context.emit_binary = true;
+      } else {
+        critical_error("unknown manifest format: {}", format);
+      }
+    }
+  } else {
+    critical_error("unknown option: {}", option);
+  }
 }
-*/
 
-enum class remote_kind { LOCAL, SVN, GIT, HG, CVS, URL };
-
-std::optional<remote_kind> infer_kind(const toml_table_t *config)
-{
-  if (toml_has_key(config, "path")) return remote_kind::LOCAL;
-  if (toml_has_key(config, "svn")) return remote_kind::SVN;
-  if (toml_has_key(config, "git")) return remote_kind::GIT;
-  if (toml_has_key(config, "hg")) return remote_kind::HG;
-  if (toml_has_key(config, "cvs")) return remote_kind::CVS;
-  if (toml_has_key(config, "url")) return remote_kind::URL;
-  return std::nullopt;
-};
-
-class package
+void lock_packages(const package_table &packages, const fs::path &path)
 {
-protected:
-  std::string name;
-  const toml_table_t *config;
+  trace_span span("lock");
+  git_library git;
+  thread_pool pool(execution_context::get().jobs);
 
-  remote_kind kind;
-
-  std::optional<fs::path> configure;
-  std::optional<fs::path> cmake_lists;
-
-  std::optional<cmake_option_list> options;
-  std::optional<std::vector<std::string>> advanced_variables;
-
-  bool vendor;
-
-  package(const char *name, const toml_table_t *config) : name(name), config(config)
-  {
-    this->configure = toml_table_get<fs::path>(config, "configure");
-    this->cmake_lists = toml_table_get<fs::path>(config, "cmake-lists");
-
-    if (toml_table_t *options = toml_table_in(config, "options")) { this->options = cmake_option_list(options); }
-    this->advanced_variables = toml_table_get<std::vector<std::string>>(config, "advanced-variables");
-
-    this->vendor = toml_table_get<bool>(config, "vendor").value_or(false);
+  std::vector<std::future<std::optional<lock_entry>>> pending;
+  for (package_id id = 0; id < packages.size(); id++) {
+    pending.emplace_back(pool.submit([&packages, id]() { return packages.resolve(id); }));
   }
 
-public:
-  virtual void write_fetch_rules(FILE *stream) = 0;
-
-  virtual std::string is_downloaded_var() { return fmt::format("{}_POPULATED", name); }
-
-  virtual std::string fetch_advanced_variables()
-  {
-    std::string upper_name = name;
-    std::transform(name.begin(), name.end(), upper_name.begin(), ::toupper);
-    return fmt::format(
-      "mark_as_advanced(FETCHCONTENT_SOURCE_DIR_{0} FETCHCONTENT_UPDATES_DISCONNECTED_{0})\n", upper_name);
+  lockfile lock;
+  for (package_id id = 0; id < packages.size(); id++) {
+    if (auto entry = pending[id].get()) { lock.entries.emplace(packages.names[id], std::move(*entry)); }
   }
+  lock.save(path);
 
-  void write_configure_rules(FILE *stream)
-  {
-
-    std::string special_configure;
-    if (configure.has_value()) {
-      // TODO: relative path?
-      special_configure = fmt::format(
-        "  file(READ \"${{CMAKE_CURRENT_SOURCE_DIR}}/{0}\" DEPMGR_{1}_USER_CONFIGURATION)\n"
-        "  cmake_language(EVAL CODE \"${{DEPMGR_{1}_USER_CONFIGURATION}}\")\n"
-        "  unset(DEPMGR_{1}_USER_CONFIGURATION)\n",
-        configure.value().string(),
-        name);
-    }
-
-    std::string copy_makelists;
-    if (cmake_lists.has_value()) {
-      // TODO: relative path?
-      // TODO: Not source_dir -> move to work dir
-      copy_makelists = fmt::format(
-        "  configure_file(\"${{CMAKE_CURRENT_SOURCE_DIR}}/{}\" \"${{{package}_SOURCE_DIR}}/CMakeLists.txt\" @ONLY)\n",
-        cmake_lists.value().string(),
-        name);
-    }
-
-    std::string actual_source_dir = "\"${{{package}_SOURCE_DIR}}\"";// TODO: work dir.
-    if (vendor) {
-      // TODO: vendor handling
-    }
-
-    std::string set_options;
-    if (options.has_value()) { set_options = options.value().to_commands(2); }
+  status("Locked {} dependencies in {}", lock.entries.size(), path.string());
+}
 
-    std::string mark_advanced;
-    if (advanced_variables.has_value()) {
-      mark_advanced = fmt::format("  mark_as_advanced({})\n", fmt::join(advanced_variables.value(), " "));
+/// Packs the prepared sources of every vendored package into `path`.
+void vendor_packages(const package_table &packages, const fs::path &path)
+{
+  std::vector<vendored_sources> sources;
+  for (package_id id = 0; id < packages.size(); id++) {
+    if (!packages.vendor[id]) { continue; }
+    auto stamp = packages.fetch_stamp(id);
+    if (!stamp.has_value()) {
+      critical_error(
+        "can't vendor {}, depmgr can't fetch {} sources", packages.names[id], kind_name(packages.kinds[id]));
     }
-
-    std::string fetch_advanced_vars = this->fetch_advanced_variables();
-
-    fmt::print(stream,
-      "\n"
-      "set({package}_CONFIGURED TRUE)\n"
-      "set({package}_WORK_DIR TRUE)\n"
-
-      // TODO: populate_work_dir
-      "fetchcontent_getproperties({package})\n"
-      "if(NOT {is_downloaded})\n"
-      "  fetchcontent_populate({package})\n"
-      "  set({package}_CONFIGURED FALSE)\n"
-      "endif()\n"
-      "message(STATUS \"Dependency ready: {package}\")\n"
-
-      "if(NOT {package}_CONFIGURED)\n"
-      "  message(STATUS \"Configuring dependency: {package}\")\n"
-      "  patch({package})\n"
-      "{copy_makelists}"
-      "{special_configure}"
-      "  message(STATUS \"Configuring dependency: {package} - Done\")\n"
-      "endif()\n"
-
-      "block(SCOPE_FOR VARIABLES)\n"
-      "{set_options}"
-      "  add_subdirectory({actual_sources} \"${{{package}_BINARY_DIR}}\")\n"
-      "{mark_advanced}"
-      "endblock()\n"
-      "{fetch_advanced_vars}"
-
-      "unset({package}_CONFIGURED)\n"
-      "unset({package}_WORK_DIR)\n"
-      "\n",
-      fmt::arg("package", name),
-      fmt::arg("is_downloaded", this->is_downloaded_var()),
-      fmt::arg("special_configure", special_configure),
-      fmt::arg("copy_makelists", copy_makelists),
-      fmt::arg("actual_sources", actual_source_dir),
-      fmt::arg("set_options", set_options),
-      fmt::arg("mark_advanced", mark_advanced),
-      fmt::arg("fetch_advanced_vars", fetch_advanced_vars));
+    if (!packages.is_prepared(id)) { critical_error("can't vendor {}, its sources aren't cached", packages.names[id]); }
+    sources.push_back(vendored_sources{std::string(packages.names[id]), *stamp, packages.source_dir(id)});
   }
-};
+  // Nested packages are discovered concurrently, the pack shouldn't depend on
+  // the order they were found in.
+  std::sort(sources.begin(), sources.end(), [](const auto &a, const auto &b) { return a.name < b.name; });
+  write_vendor_pack(sources, path);
 
-struct package_local : public package
-{
-  fs::path path;
-
-  package_local(const char *name, const toml_table_t *config) : package(name, config)
-  {
-    auto path = toml_table_get<fs::path>(config, "path");
-    if (!path.has_value()) critical_error("path not specified for {}", name);
-    this->path = *path;
-  }
+  status("Vendored {} dependencies in {}", sources.size(), path.string());
+}
 
-  void write_fetch_rules(FILE *stream) {}
-};
-struct package_svn : public package
+/// `depmgr patch <source_dir> <patch_hash> <patch>...`, run by generated
+/// scripts when CMake downloads a package with patches. The hash is the one
+/// the script was generated with, so a patch edited since isn't applied
+/// under the old identity.
+int apply_patches(int argc, char *argv[])
 {
-  std::string repo;
-
-  std::optional<std::string> revision;
-
-  package_svn(const char *name, const toml_table_t *config) : package(name, config)
-  {
-    auto repo = toml_table_get<std::string>(config, "svn");
-    if (!repo.has_value()) critical_error("git repository not specified for {}", name);
-    this->repo = *repo;
-
-    this->revision = toml_table_get<std::string>(config, "rev");
+  if (argc < 5) {
+    fmt::println("Usage: {} patch <source_dir> <patch_hash> <patch>...", argv[0]);
+    return EXIT_FAILURE;
   }
+  std::vector<fs::path> patches(argv + 4, argv + argc);
+  if (patch_set_hash(patches) != argv[3]) { critical_error("patches changed since the script was generated"); }
 
-  void write_fetch_rules(FILE *stream)
-  {
-    std::string options;
-
-    if (revision.has_value()) { options += fmt::format("  SVN_REVISION -r{}\n", *revision); }
-
-    fmt::print(stream,
-      "fetchcontent_declare(\n"
-      "  {package}\n"
-      "  SVN_REPOSITORY {repo}\n"
-      "{options}"
-      "  SVN_TRUST_CERT TRUE\n"
-      ")\n",
-      fmt::arg("package", name),
-      fmt::arg("repo", repo),
-      fmt::arg("options", options));
-  }
-};
-struct package_git : public package
-{
-  std::string repo;
-
-  std::optional<std::string> tag;
-  std::optional<std::string> remote;
-
-  std::optional<std::vector<std::string>> submodules;
-
-  package_git(const char *name, const toml_table_t *config) : package(name, config)
-  {
-    auto repo = toml_table_get<std::string>(config, "git");
-    if (!repo.has_value()) critical_error("git repository not specified for {}", name);
-    this->repo = *repo;
-
-    this->tag = toml_table_get<std::string>(config, "tag");
-    this->remote = toml_table_get<std::string>(config, "remote");
-    this->submodules = toml_table_get<std::vector<std::string>>(config, "submodules");
-  }
+  git_library git;
+  git_apply_patches(argv[2], patches);
+  return EXIT_SUCCESS;
+}
 
-  void write_fetch_rules(FILE *stream)
-  {
-    std::string options;
-
-    if (tag.has_value()) { options += fmt::format("  GIT_TAG {}\n", *tag); }
-    if (remote.has_value()) { options += fmt::format("  GIT_REPOSITORY {}\n", *remote); }
-    if (submodules.has_value()) { options += fmt::format("  GIT_SUBMODULES {}\n", fmt::join(*submodules, " ")); }
-
-    fmt::print(stream,
-      "fetchcontent_declare(\n"
-      "  {package}\n"
-      "  GIT_REPOSITORY {repo}\n"
-      "{options}"
-      "  GIT_SHALLOW TRUE\n"
-      ")\n",
-      fmt::arg("package", name),
-      fmt::arg("repo", repo),
-      fmt::arg("options", options));
-  }
-};
-struct package_hg : public package
+/// resolve_generation for commands that stop when it fails, on a graph_error
+/// or an error rethrown from the walk. Only the daemon outlives those.
+template<typename... Args> static generation resolve_or_fail(Args &&...args)
 {
-  std::string repo;
-
-  std::optional<std::string> tag;
+  std::string message;
+  try {
+    return resolve_generation(std::forward<Args>(args)...);
+  } catch (const std::exception &error) {
+    message = error.what();
+  }
+  // Outside of the handler, terminating in it reports the exception again.
+  critical_error("{}", message);
+}
 
-  package_hg(const char *name, const toml_table_t *config) : package(name, config)
-  {
-    auto repo = toml_table_get<std::string>(config, "hg");
-    if (!repo.has_value()) critical_error("hg repository not specified for {}", name);
-    this->repo = *repo;
+enum class command { GENERATE, FETCH, LOCK, VENDOR, BATCH, DAEMON };
 
-    this->tag = toml_table_get<std::string>(config, "tag");
+int main(int argc, char *argv[])
+{
+  if (argc > 1 && strcmp(argv[1], "patch") == 0) { return apply_patches(argc, argv); }
+
+  command cmd = command::GENERATE;
+  if (argc > 1 && strcmp(argv[1], "fetch") == 0) {
+    cmd = command::FETCH;
+  } else if (argc > 1 && strcmp(argv[1], "lock") == 0) {
+    cmd = command::LOCK;
+  } else if (argc > 1 && strcmp(argv[1], "vendor") == 0) {
+    cmd = command::VENDOR;
+  } else if (argc > 1 && strcmp(argv[1], "batch") == 0) {
+    cmd = command::BATCH;
+  } else if (argc > 1 && strcmp(argv[1], "daemon") == 0) {
+    cmd = command::DAEMON;
   }
-
-  void write_fetch_rules(FILE *stream)
-  {
-    std::string options;
-
-    if (tag.has_value()) { options += fmt::format("  HG_TAG {}\n", *tag); }
-
-    fmt::print(stream,
-      "fetchcontent_declare(\n"
-      "  {package}\n"
-      "  HG_REPOSITORY {repo}\n"
-      "{options}"
-      "  HG_SHALLOW TRUE\n"
-      ")\n",
-      fmt::arg("package", name),
-      fmt::arg("repo", repo),
-      fmt::arg("options", options));
+  int first_arg = cmd == command::GENERATE ? 1 : 2;
+  // `batch fetch` fetches every component's sources like `fetch` does.
+  bool batch_fetch = cmd == command::BATCH && argc > 2 && strcmp(argv[2], "fetch") == 0;
+  if (batch_fetch) { first_arg++; }
+  int required_args = cmd == command::LOCK || cmd == command::VENDOR ? 1 : 2;
+  bool missing_args = argc - first_arg < required_args;
+  if (cmd == command::BATCH) {
+    // A workspace file or manifest and output pairs, up to the first option.
+    required_args = 0;
+    while (first_arg + required_args < argc && strncmp(argv[first_arg + required_args], "--", 2) != 0) {
+      required_args++;
+    }
+    missing_args = required_args == 0 || (required_args > 1 && required_args % 2 != 0);
   }
-};
-struct package_cvs : public package
-{
-  std::string repo;
-
-  std::optional<std::string> mod;
-  std::optional<std::string> tag;
 
-  package_cvs(const char *name, const toml_table_t *config) : package(name, config)
-  {
-    auto repo = toml_table_get<std::string>(config, "cvs");
-    if (!repo.has_value()) critical_error("cvs repository not specified for {}", name);
-    this->repo = *repo;
-
-    this->mod = toml_table_get<std::string>(config, "module");
-    this->tag = toml_table_get<std::string>(config, "tag");
+  if (missing_args || strcmp(argv[1], "--help") == 0) {
+    fmt::println("Usage: {} [fetch] <dependencies.toml> <command_output> [options]", argv[0]);
+    fmt::println("       {} lock <dependencies.toml> [options]", argv[0]);
+    fmt::println("       {} vendor <dependencies.toml> [options]", argv[0]);
+    fmt::println("       {} daemon <dependencies.toml> <command_output> [options]", argv[0]);
+    fmt::println("       {} batch [fetch] <workspace.toml> [options]", argv[0]);
+    fmt::println("       {} batch [fetch] <dependencies.toml> <command_output>... [options]", argv[0]);
+    fmt::println("");
+    fmt::println("Commands:");
+    fmt::println("  fetch               fetch git and URL dependencies in parallel before generating rules");
+    fmt::println("  lock                pin git tags and branches to commits in dependencies.lock, fetching");
+    fmt::println("                      sources to pin nested dependencies too");
+    fmt::println("  vendor              pack the sources of packages with `vendor = true` into dependencies.vendor,");
+    fmt::println("                      which generating extracts them from instead of fetching");
+    fmt::println("  daemon              keep the output up to date as its inputs change, answering queries on");
+    fmt::println("                      a Unix socket: status, changed <revision>, regenerate, stop");
+    fmt::println("  batch               generate the output of every manifest in a workspace file, or of every");
+    fmt::println("                      manifest and output pair, concurrently in one process. The workspace");
+    fmt::println("                      has a table per component with a `manifest` and an `output` path");
+    fmt::println("");
+    fmt::println("Options:");
+    fmt::println("  --jobs=<n>          number of concurrent fetches (default: {})", execution_context::get().jobs);
+    fmt::println("  --mirror-race=<n>   mirrors of a remote contacted at once, the fastest to respond is used");
+    fmt::println(
+      "                      and the others are fallbacks (default: {})", execution_context::get().mirror_race);
+    fmt::println("  --cache-dir=<path>  shared source cache (default: {})", default_cache_dir().string());
+    fmt::println("  --emit=<formats>    also write the resolved manifest next to the output, comma separated");
+    fmt::println("                      json: <output>.manifest.json, bin: <output>.manifest.bin");
+    fmt::println("  --offline           only use sources already fetched or in the cache, never contact remotes");
+    fmt::println("  --superbuild        build every dependency as its own ExternalProject, concurrently, and");
+    fmt::println("                      install it into DEPMGR_SUPERBUILD_PREFIX instead of adding it to the build");
+    fmt::println("  --timing            time each dependency's populate, configure and add_subdirectory");
+    fmt::println("                      during CMake configure, reported in <output> with");
+    fmt::println("                      its extension replaced by .timing.json");
+    fmt::println("  --socket=<path>     daemon query socket (default: <output>.sock)");
+    fmt::println("  --trace=<path>      write a Chrome trace of every phase and package, for Perfetto");
+    return missing_args ? EXIT_FAILURE : EXIT_SUCCESS;
   }
 
-  void write_fetch_rules(FILE *stream)
-  {
-    std::string options;
-
-    if (mod.has_value()) { options += fmt::format("  CVS_MODULE {}\n", *mod); }
-    if (tag.has_value()) { options += fmt::format("  CVS_TAG {}\n", *tag); }
-
-    fmt::print(stream,
-      "fetchcontent_declare(\n"
-      "  {package}\n"
-      "  CVS_REPOSITORY {repo}\n"
-      "{options}"
-      ")\n",
-      fmt::arg("package", name),
-      fmt::arg("repo", repo),
-      fmt::arg("options", options));
+  const char *dependency_file = argv[first_arg];
+  fs::path output;
+  if (cmd == command::LOCK) {
+    output = fs::absolute(lockfile_path(dependency_file));
+  } else if (cmd == command::VENDOR) {
+    output = fs::absolute(vendor_pack_path(dependency_file));
+  } else if (cmd != command::BATCH) {
+    output = fs::absolute(argv[first_arg + 1]);
   }
-};
-struct package_url : public package
-{
-  std::string remote;
-
-  std::optional<std::string> hash;
-  std::optional<std::string> download_name;
-
-  std::optional<std::string> username;
-  std::optional<std::string> password;
-  std::optional<std::vector<std::string>> headers;
-
-  std::optional<fs::path> ca_file;
 
-  package_url(const char *name, const toml_table_t *config) : package(name, config)
-  {
-    auto remote = toml_table_get<std::string>(config, "url");
-    if (!remote.has_value()) critical_error("url not specified for {}", name);
-    this->remote = *remote;
-
-    this->hash = toml_table_get<std::string>(config, "hash");
-    this->download_name = toml_table_get<std::string>(config, "download_name");
-
-    this->username = toml_table_get<std::string>(config, "username");
-    this->password = toml_table_get<std::string>(config, "password");
-    this->headers = toml_table_get<std::vector<std::string>>(config, "headers");
-
-    this->ca_file = toml_table_get<fs::path>(config, "ca_file");
+  auto &context = execution_context::get();
+  context.self_path = executable_path(argv[0]);
+  context.dependency_cache_dir = default_cache_dir();
+
+  for (int i = first_arg + required_args; i < argc; i++) { parse_option(argv[i]); }
+  if (context.offline && (cmd == command::FETCH || batch_fetch)) { critical_error("can't fetch with --offline"); }
+  // Locking resolves every tag and branch against its remote.
+  if (context.offline && cmd == command::LOCK) { critical_error("can't lock with --offline"); }
+  if (context.emit_timing && context.superbuild) { critical_error("--superbuild doesn't configure anything to time"); }
+
+  std::optional<trace_session> trace;
+  if (!context.trace_path.empty()) { trace.emplace(context.trace_path); }
+
+  if (cmd == command::BATCH) {
+    std::vector<batch_component> components;
+    if (required_args == 1) {
+      components = load_workspace(dependency_file);
+    } else {
+      for (int i = first_arg; i < first_arg + required_args; i += 2) {
+        components.push_back(batch_component{argv[i], fs::absolute(argv[i]), fs::absolute(argv[i + 1])});
+      }
+    }
+    std::vector<std::string> options;
+    for (int i = first_arg + required_args; i < argc; i++) {
+      if (strncmp(argv[i], "--trace=", 8) != 0) { options.emplace_back(argv[i]); }
+    }
+    run_batch(components, batch_fetch, options);
+    return EXIT_SUCCESS;
   }
 
-  void write_fetch_rules(FILE *stream)
-  {
-    std::string options;
-
-    if (hash.has_value()) { options += fmt::format("  URL_HASH {}\n", *hash); }
-    if (download_name.has_value()) { options += fmt::format("  DOWNLOAD_NAME {}\n", *download_name); }
-
-    if (username.has_value()) { options += fmt::format("  URL_USERNAME {}\n", *username); }
-    if (password.has_value()) { options += fmt::format("  URL_PASSWORD {}\n", *password); }
-    if (headers.has_value()) { options += fmt::format("  URL_HEADER {}\n", fmt::join(*headers, " ")); }
-
-    if (ca_file.has_value()) { options += fmt::format("  URL_CAINFO {}\n", ca_file.value().string()); }
-
-    fmt::print(stream,
-      "fetchcontent_declare(\n"
-      "  {package}\n"
-      "  URL {remote}\n"
-      "{options}"
-      ")\n",
-      fmt::arg("package", name),
-      fmt::arg("remote", remote),
-      fmt::arg("options", options));
+  if (cmd == command::DAEMON) {
+    // Fingerprinted like a plain generate with the same options, so either
+    // one sees the other's output as up to date.
+    std::vector<std::string> arguments{dependency_file, argv[first_arg + 1]};
+    for (int i = first_arg + required_args; i < argc; i++) {
+      if (strncmp(argv[i], "--socket=", 9) != 0 && strncmp(argv[i], "--trace=", 8) != 0) {
+        arguments.emplace_back(argv[i]);
+      }
+    }
+    fs::path socket_path = context.socket_path;
+    if (socket_path.empty()) { socket_path = fs::path(output).replace_extension(".sock"); }
+    run_daemon(dependency_file, output, socket_path, arguments);
+    return EXIT_SUCCESS;
   }
-};
 
-std::unique_ptr<package> parse_package(const char *name, const toml_table_t *config)
-{
-  auto kind = infer_kind(config);
-  if (!kind.has_value()) { critical_error("unknown remote type for '{}'", name); }
-
-  switch (kind.value()) {
-  case remote_kind::LOCAL:
-    return std::make_unique<package_local>(name, config);
-  case remote_kind::SVN:
-    return std::make_unique<package_svn>(name, config);
-  case remote_kind::GIT:
-    return std::make_unique<package_git>(name, config);
-  case remote_kind::HG:
-    return std::make_unique<package_hg>(name, config);
-  case remote_kind::CVS:
-    return std::make_unique<package_cvs>(name, config);
-  case remote_kind::URL:
-    return std::make_unique<package_url>(name, config);
+  std::optional<toml_document> manifest = toml_document::load(dependency_file);
+  if (!manifest.has_value()) { critical_error("can't open dependency file: {}", dependency_file); }
+
+  if (cmd == command::LOCK || cmd == command::VENDOR) {
+    // Sources are only prepared to find nested manifests or to be packed, not
+    // next to the manifest.
+    fs::path work_dir = fs::temp_directory_path()
+                        / fmt::format("depmgr-{}-{}", cmd == command::LOCK ? "lock" : "vendor", current_process_id());
+    generation result = resolve_or_fail(dependency_file,
+      std::make_shared<const toml_document>(std::move(*manifest)),
+      work_dir,
+      !context.offline,
+      std::vector<std::string>());
+    if (cmd == command::LOCK) {
+      // Nested dependencies are pinned too, the root lock wins over theirs.
+      lock_packages(result.packages, output);
+    } else {
+      vendor_packages(result.packages, output);
+    }
+    fs::remove_all(work_dir);
+    return EXIT_SUCCESS;
   }
 
-  critical_error("unhandled remote type for '{}'", name);
-}
-
-int main(int argc, char *argv[])
-{
-  if (argc < 3 || strcmp(argv[1], "--help") == 0) {
-    fmt::println("Usage: {} <dependencies.toml> <command_output> [options]", argv[0]);
-    return argc < 3 ? EXIT_FAILURE : EXIT_SUCCESS;
+  std::vector<std::string> arguments;
+  for (int i = 1; i < argc; i++) {
+    // Tracing doesn't change the output.
+    if (strncmp(argv[i], "--trace=", 8) != 0) { arguments.emplace_back(argv[i]); }
   }
-
-  FILE *fp = fopen(argv[1], "r");
-  if (fp == NULL) { critical_error("can't open dependency file: {}", argv[1]); }
-
-  toml_table_t *config;
-  {
-    char err[256];
-    config = toml_parse_file(fp, err, sizeof(err));
-    fclose(fp);
-    if (config == nullptr) { critical_error("can't parse TOML file: {}", err); }
+  generation result = resolve_or_fail(dependency_file,
+    std::make_shared<const toml_document>(std::move(*manifest)),
+    work_dir_path(output),
+    cmd == command::FETCH,
+    arguments);
+
+  if (context.offline) {
+    auto missing = missing_offline_sources(result.packages);
+    if (!missing.empty()) {
+      critical_error("offline, but {} dependencies have no sources:\n  {}", missing.size(), fmt::join(missing, "\n  "));
+    }
   }
 
-  std::vector<std::unique_ptr<package>> packages;
-
-  size_t dep_count = toml_table_nkval(config);
-  packages.reserve(dep_count);
-
-  size_t i = 0;
-  const char *dep_name = toml_key_in(config, 0);
-  do {
-    toml_table_t *data = toml_table_in(config, dep_name);
-    packages.emplace_back(parse_package(dep_name, data));
-    dep_name = toml_key_in(config, ++i);
-  } while (dep_name != nullptr);
-
-  toml_free(config);
-
-  auto output = fs::path(argv[2]);
-  {
-    auto output_parent = output.parent_path();
-    if (!fs::exists(output_parent)) { fs::create_directories(output_parent); }
+  if (is_up_to_date(result, output)) {
+    status("Dependencies unchanged, keeping {}", output.string());
+    return EXIT_SUCCESS;
   }
 
-  FILE *output_stream = fopen(output.c_str(), "w+");
-
-  fmt::print(output_stream,
-    "include(FetchContent)\n"
-    "block(SCOPE_FOR VARIABLES POLICIES)\n");
-
-  for (auto &package : packages) { package->write_fetch_rules(output_stream); }
-  for (auto &package : packages) { package->write_configure_rules(output_stream); }
-
-  fmt::print(output_stream, "endblock()\n");
+  fmt::memory_buffer out;
+  fmt::format_to(std::back_inserter(out), "{}", result.fingerprint);
+  write_cmake_script(out, result.packages);
+  write_generation(result, out, output);
 
   return EXIT_SUCCESS;
 }
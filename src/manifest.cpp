@@ -0,0 +1,129 @@
+#include "manifest.hpp"
+
+#include <cstring>
+#include <string_view>
+
+#include <fmt/format.h>
+
+#include "util.hpp"
+
+namespace fs = std::filesystem;
+
+std::string json_string(std::string_view value)
+{
+  std::string result = "\"";
+  for (char c : value) {
+    switch (c) {
+    case '"':
+      result += "\\\"";
+      break;
+    case '\\':
+      result += "\\\\";
+      break;
+    case '\n':
+      result += "\\n";
+      break;
+    case '\t':
+      result += "\\t";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        result += fmt::format("\\u{:04x}", c);
+      } else {
+        result += c;
+      }
+    }
+  }
+  return result + "\"";
+}
+
+void write_manifest_json(const std::vector<resolved_package> &packages, const fs::path &path)
+{
+  fmt::memory_buffer out;
+  auto it = std::back_inserter(out);
+
+  fmt::format_to(it, "{{\n  \"version\": {},\n  \"packages\": [", MANIFEST_VERSION);
+  for (size_t i = 0; i < packages.size(); i++) {
+    const resolved_package &package = packages[i];
+    fmt::format_to(it,
+      "{}\n    {{\n"
+      "      \"name\": {},\n"
+      "      \"kind\": {},\n"
+      "      \"remote\": {},\n"
+      "      \"revision\": {},\n"
+      "      \"source_dir\": {},\n"
+      "      \"cache_key\": {},\n"
+      "      \"options\": {{",
+      i == 0 ? "" : ",",
+      json_string(package.name),
+      json_string(package.kind),
+      json_string(package.remote),
+      json_string(package.revision),
+      json_string(package.source_dir),
+      json_string(package.cache_key));
+    for (size_t j = 0; j < package.options.size(); j++) {
+      fmt::format_to(it,
+        "{}\n        {}: {}",
+        j == 0 ? "" : ",",
+        json_string(package.options[j].first),
+        json_string(package.options[j].second));
+    }
+    fmt::format_to(it, "{}}}\n    }}", package.options.empty() ? "" : "\n      ");
+  }
+  fmt::format_to(it, "{}]\n}}\n", packages.empty() ? "" : "\n  ");
+
+  write_file_atomic(path, std::string_view(out.data(), out.size()));
+}
+
+manifest_string string_table::add(const std::string &value)
+{
+  auto [it, inserted] = offsets.try_emplace(value, static_cast<uint32_t>(data.size()));
+  if (inserted) {
+    data += value;
+    data += '\0';
+  }
+  return manifest_string{it->second, static_cast<uint32_t>(value.size())};
+}
+
+void write_manifest_binary(const std::vector<resolved_package> &packages, const fs::path &path)
+{
+  string_table strings;
+  std::vector<manifest_package> records;
+  std::vector<manifest_option> options;
+  records.reserve(packages.size());
+
+  for (const auto &package : packages) {
+    manifest_package record;
+    record.name = strings.add(package.name);
+    record.kind = strings.add(package.kind);
+    record.remote = strings.add(package.remote);
+    record.revision = strings.add(package.revision);
+    record.source_dir = strings.add(package.source_dir);
+    record.cache_key = strings.add(package.cache_key);
+    record.first_option = static_cast<uint32_t>(options.size());
+    record.option_count = static_cast<uint32_t>(package.options.size());
+    for (const auto &[name, value] : package.options) {
+      options.push_back(manifest_option{strings.add(name), strings.add(value)});
+    }
+    records.push_back(record);
+  }
+
+  manifest_header header;
+  std::memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+  header.version = MANIFEST_VERSION;
+  header.package_count = static_cast<uint32_t>(records.size());
+  header.option_count = static_cast<uint32_t>(options.size());
+  header.string_bytes = static_cast<uint32_t>(strings.data.size());
+  header.packages_offset = sizeof(manifest_header);
+  header.options_offset = header.packages_offset + records.size() * sizeof(manifest_package);
+  header.strings_offset = header.options_offset + options.size() * sizeof(manifest_option);
+
+  std::string out;
+  out.reserve(header.strings_offset + strings.data.size());
+  append_pod(out, header);
+  for (const auto &record : records) { append_pod(out, record); }
+  for (const auto &option : options) { append_pod(out, option); }
+  out += strings.data;
+
+  write_file_atomic(path, out);
+}
@@ -0,0 +1,102 @@
+#ifndef _DEPMGR_MANIFEST_HPP_
+#define _DEPMGR_MANIFEST_HPP_
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// A package after locking and fetching, as seen by external tools.
+struct resolved_package
+{
+  std::string name;
+  std::string kind;
+  std::string remote;
+  /// Locked commit or verified hash when known, otherwise the requested ref.
+  std::string revision;
+  /// Prepared source tree, empty when the sources are left to FetchContent.
+  std::string source_dir;
+  /// Dependency cache key digest, empty when it isn't known without network.
+  std::string cache_key;
+  std::vector<std::pair<std::string, std::string>> options;
+};
+
+/// `value` as a quoted JSON string.
+std::string json_string(std::string_view value);
+
+void write_manifest_json(const std::vector<resolved_package> &packages, const std::filesystem::path &path);
+
+/*
+ * Binary manifest layout. Fields are in native byte order (little endian on
+ * every supported host) and naturally aligned, so the file can be mapped and
+ * read in place:
+ *
+ *   manifest_header
+ *   manifest_package[package_count]
+ *   manifest_option[option_count]
+ *   char strings[string_bytes]     NUL terminated, deduplicated
+ */
+
+static constexpr char MANIFEST_MAGIC[8] = {'D', 'E', 'P', 'M', 'G', 'R', 'M', '\0'};
+static constexpr uint32_t MANIFEST_VERSION = 1;
+
+struct manifest_string
+{
+  uint32_t offset;
+  uint32_t length;
+};
+
+/// Deduplicated string section of a binary file.
+struct string_table
+{
+  std::string data;
+  std::unordered_map<std::string, uint32_t> offsets;
+
+  manifest_string add(const std::string &value);
+};
+
+template<typename T> inline void append_pod(std::string &out, const T &value)
+{
+  out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+struct manifest_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t package_count;
+  uint32_t option_count;
+  uint32_t string_bytes;
+  uint64_t packages_offset;
+  uint64_t options_offset;
+  uint64_t strings_offset;
+};
+
+struct manifest_package
+{
+  manifest_string name;
+  manifest_string kind;
+  manifest_string remote;
+  manifest_string revision;
+  manifest_string source_dir;
+  manifest_string cache_key;
+  uint32_t first_option;
+  uint32_t option_count;
+};
+
+struct manifest_option
+{
+  manifest_string name;
+  manifest_string value;
+};
+
+static_assert(sizeof(manifest_header) == 48);
+static_assert(sizeof(manifest_package) == 56);
+static_assert(sizeof(manifest_option) == 16);
+
+void write_manifest_binary(const std::vector<resolved_package> &packages, const std::filesystem::path &path);
+
+#endif /* _DEPMGR_MANIFEST_HPP_ */
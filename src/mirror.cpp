@@ -0,0 +1,205 @@
+#include "mirror.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <map>
+#include <sstream>
+
+#include <fmt/ranges.h>
+
+#include "cache.hpp"
+#include "state.hpp"
+#include "trace.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+struct mirror_record
+{
+  /// Moving average of the time to a successful attempt, 0 until one was.
+  uint32_t latency_ms = 0;
+  /// Failures since the last success.
+  uint32_t failures = 0;
+};
+}// namespace
+
+using mirror_records = std::map<std::string, mirror_record, std::less<>>;
+
+static fs::path stats_path()
+{
+  return dependency_cache(execution_context::get().dependency_cache_dir).mirror_stats_path();
+}
+
+/// One `<latency_ms> <failures> <url>` line per mirror.
+static mirror_records load_records(const fs::path &path)
+{
+  mirror_records records;
+  std::optional<std::string> contents = read_file(path);
+  if (!contents.has_value()) return records;
+
+  std::istringstream lines(*contents);
+  for (std::string line; std::getline(lines, line);) {
+    char *end;
+    mirror_record record;
+    record.latency_ms = uint32_t(std::strtoul(line.c_str(), &end, 10));
+    record.failures = uint32_t(std::strtoul(end, &end, 10));
+    if (*end != ' ' || end[1] == '\0') continue;
+    records[std::string(end + 1)] = record;
+  }
+  return records;
+}
+
+mirror_race::mirror_race(std::string what, std::vector<std::string> urls, attempt run)
+  : what(std::move(what)), run(std::move(run))
+{
+  mirror_records records = load_records(stats_path());
+  for (size_t mirror = 0; mirror < urls.size(); mirror++) { slots.push_back(slot{mirror, std::move(urls[mirror])}); }
+  // Failing mirrors go last, unmeasured ones are tried early so they get a
+  // latency of their own.
+  auto rank = [&records](const slot &it) {
+    auto record = records.find(it.url);
+    if (record == records.end()) return std::pair<uint32_t, uint32_t>(0, 0);
+    return std::pair(record->second.failures, record->second.latency_ms);
+  };
+  std::stable_sort(slots.begin(), slots.end(), [&](const slot &a, const slot &b) { return rank(a) < rank(b); });
+
+  std::lock_guard guard(lock);
+  launch();
+}
+
+mirror_race::~mirror_race()
+{
+  {
+    std::lock_guard guard(lock);
+    serving = true;
+    for (auto &it : slots) { it.cancelled->store(true); }
+  }
+  for (auto &it : slots) {
+    if (it.thread.joinable()) { it.thread.join(); }
+  }
+  for (auto &it : retired) { it.join(); }
+
+  fs::path path = stats_path();
+  fs::create_directories(path.parent_path());
+  // Other processes race mirrors of their own, their records are merged.
+  file_lock stats_lock(fs::path(path).concat(".lock"));
+  mirror_records records = load_records(path);
+  bool updated = false;
+  for (const auto &it : slots) {
+    if (it.state == attempt_state::FAILED) {
+      records[it.url].failures++;
+    } else if (it.latency_ms.has_value()) {
+      mirror_record &record = records[it.url];
+      record.latency_ms = record.latency_ms == 0 ? *it.latency_ms : (3 * record.latency_ms + *it.latency_ms) / 4;
+      record.failures = 0;
+    } else {
+      continue;
+    }
+    updated = true;
+  }
+  if (!updated) return;
+
+  std::string out;
+  for (const auto &[url, record] : records) {
+    out += fmt::format("{} {} {}\n", record.latency_ms, record.failures, url);
+  }
+  write_file_atomic(path, out);
+}
+
+void mirror_race::launch()
+{
+  size_t running = 0;
+  for (const auto &it : slots) {
+    // The spare is used before anything new is started.
+    if (it.state == attempt_state::SUCCEEDED) return;
+    if (it.state == attempt_state::RUNNING) { running++; }
+  }
+
+  size_t width = std::max<size_t>(1, execution_context::get().mirror_race);
+  for (auto &it : slots) {
+    if (serving || running >= width) break;
+    if (it.state != attempt_state::PENDING) continue;
+    // A cancelled attempt of this mirror gave up, but its thread may still
+    // be the one running this.
+    if (it.thread.joinable()) { retired.push_back(std::move(it.thread)); }
+    it.state = attempt_state::RUNNING;
+    it.cancelled->store(false);
+    it.thread = std::thread(&mirror_race::attempt_main, this, std::ref(it));
+    running++;
+  }
+}
+
+void mirror_race::attempt_main(slot &current)
+{
+  trace_span span("mirror", current.url);
+  auto started = std::chrono::steady_clock::now();
+  std::optional<std::string> error;
+  try {
+    run(current.mirror, *current.cancelled);
+  } catch (const std::exception &failure) {
+    // Whatever an attempt fails with, the next mirror is tried in its place.
+    error = failure.what();
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+
+  std::lock_guard guard(lock);
+  if (!error.has_value()) {
+    current.state = attempt_state::SUCCEEDED;
+    current.latency_ms = std::max<uint32_t>(1, uint32_t(elapsed.count()));
+    for (auto &it : slots) {
+      if (it.state == attempt_state::RUNNING) { it.cancelled->store(true); }
+    }
+  } else if (current.cancelled->load()) {
+    // Not the mirror's fault, it races again if the winner failed since.
+    current.state = attempt_state::PENDING;
+    launch();
+  } else {
+    current.state = attempt_state::FAILED;
+    current.error = std::move(error);
+    launch();
+  }
+  changed.notify_all();
+}
+
+size_t mirror_race::winner()
+{
+  std::unique_lock guard(lock);
+  for (;;) {
+    slot *fastest = nullptr;
+    bool active = false;
+    for (auto &it : slots) {
+      if (it.state == attempt_state::SUCCEEDED && (fastest == nullptr || it.latency_ms < fastest->latency_ms)) {
+        fastest = &it;
+      }
+      active |= it.state == attempt_state::RUNNING || it.state == attempt_state::PENDING;
+    }
+    if (fastest != nullptr) {
+      fastest->state = attempt_state::TAKEN;
+      serving = true;
+      return fastest->mirror;
+    }
+
+    if (!active) {
+      if (slots.size() == 1) { remote_failure("{}", slots[0].error.value_or("failed")); }
+      std::vector<std::string> errors;
+      for (const auto &it : slots) { errors.push_back(fmt::format("{}: {}", it.url, it.error.value_or("failed"))); }
+      remote_failure("every mirror of {} failed:\n  {}", what, fmt::join(errors, "\n  "));
+    }
+    changed.wait(guard);
+  }
+}
+
+void mirror_race::failed(size_t mirror, std::string error)
+{
+  std::lock_guard guard(lock);
+  for (auto &it : slots) {
+    if (it.mirror != mirror) continue;
+    it.state = attempt_state::FAILED;
+    it.error = std::move(error);
+    it.latency_ms.reset();
+    if (slots.size() > 1) { status("{}, trying another mirror", *it.error); }
+  }
+  serving = false;
+  launch();
+}
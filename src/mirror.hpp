@@ -0,0 +1,99 @@
+#ifndef _DEPMGR_MIRROR_HPP_
+#define _DEPMGR_MIRROR_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "util.hpp"
+
+/// Attempts to reach the mirrors of one remote, each on a thread of its own
+/// and at most `execution_context::mirror_race` at a time. Mirrors are tried
+/// in the order of the latencies recorded for them by earlier runs, ones that
+/// were never measured first. Once an attempt succeeds the others still
+/// running are cancelled: the flag they were passed is set and they're
+/// expected to give up with a remote_error. A failed attempt starts the next
+/// mirror in its place.
+class mirror_race
+{
+public:
+  using attempt = std::function<void(size_t mirror, const std::atomic<bool> &cancelled)>;
+
+  mirror_race(std::string what, std::vector<std::string> urls, attempt run);
+  /// Cancels the attempts still running, waits for them and records the
+  /// latencies measured.
+  ~mirror_race();
+
+  mirror_race(const mirror_race &) = delete;
+  mirror_race &operator=(const mirror_race &) = delete;
+
+  /// Waits for an attempt to succeed and returns its mirror, the index into
+  /// `urls`. Each mirror is returned once. Fails with a remote_error when
+  /// every mirror did.
+  size_t winner();
+  /// Reports that the mirror returned by winner() failed after all, the
+  /// remaining mirrors race again.
+  void failed(size_t mirror, std::string error);
+
+private:
+  enum class attempt_state : uint8_t { PENDING, RUNNING, SUCCEEDED, TAKEN, FAILED };
+
+  struct slot
+  {
+    size_t mirror;
+    std::string url;
+    attempt_state state = attempt_state::PENDING;
+    std::unique_ptr<std::atomic<bool>> cancelled = std::make_unique<std::atomic<bool>>(false);
+    std::thread thread;
+    std::optional<uint32_t> latency_ms;
+    std::optional<std::string> error;
+  };
+
+  std::string what;
+  attempt run;
+  /// In the order the mirrors are tried.
+  std::vector<slot> slots;
+  /// Threads of attempts that were cancelled and started again.
+  std::vector<std::thread> retired;
+
+  std::mutex lock;
+  std::condition_variable changed;
+  /// A winner is in use, nothing new is started until it fails.
+  bool serving = false;
+
+  void launch();
+  void attempt_main(slot &current);
+};
+
+/// Races `open` on the mirrors in `urls` and calls `use` with the URL and the
+/// result of the fastest one. When `use` fails with a remote_error the next
+/// fastest mirror is used instead, and when none is left the remote_error
+/// naming every failure is thrown. `what` names the remote in errors.
+template<typename Open, typename Use>
+void race_mirrors(std::string what, const std::vector<std::string> &urls, Open &&open, Use &&use)
+{
+  using result_t = std::invoke_result_t<Open &, const std::string &, const std::atomic<bool> &>;
+  std::vector<std::optional<result_t>> results(urls.size());
+  mirror_race race(std::move(what), urls, [&](size_t mirror, const std::atomic<bool> &cancelled) {
+    results[mirror].emplace(open(urls[mirror], cancelled));
+  });
+  for (;;) {
+    size_t mirror = race.winner();
+    try {
+      use(urls[mirror], std::move(*results[mirror]));
+      return;
+    } catch (const remote_error &error) {
+      race.failed(mirror, error.what());
+    }
+  }
+}
+
+#endif /* _DEPMGR_MIRROR_HPP_ */
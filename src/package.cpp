@@ -0,0 +1,1561 @@
+#include "package.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <type_traits>
+
+#include <fmt/ranges.h>
+
+#include "archive.hpp"
+#include "cmake.hpp"
+#include "download.hpp"
+#include "hash.hpp"
+#include "mirror.hpp"
+#include "platform_info.h"
+#include "state.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+
+namespace fs = std::filesystem;
+
+const char *kind_name(remote_kind kind)
+{
+  switch (kind) {
+  case remote_kind::LOCAL:
+    return "local";
+  case remote_kind::SVN:
+    return "svn";
+  case remote_kind::GIT:
+    return "git";
+  case remote_kind::HG:
+    return "hg";
+  case remote_kind::CVS:
+    return "cvs";
+  case remote_kind::URL:
+    return "url";
+  }
+  return "unknown";
+}
+
+// Every key a dependency table can have. The source keys come first, in
+// remote_kind order, and name the kind of the package.
+static constexpr toml_schema package_schema({"path",
+  "svn",
+  "git",
+  "hg",
+  "cvs",
+  "url",
+  "rev",
+  "tag",
+  "remote",
+  "mirrors",
+  "submodules",
+  "sparse-paths",
+  "module",
+  "hash",
+  "download_name",
+  "username",
+  "password",
+  "headers",
+  "ca_file",
+  "configure",
+  "cmake-lists",
+  "options",
+  "advanced-variables",
+  "vendor",
+  "prebuilt",
+  "patches"});
+
+using package_fields = toml_fields<package_schema.size()>;
+
+namespace package_key {
+constexpr size_t REV = package_schema.index("rev");
+constexpr size_t TAG = package_schema.index("tag");
+constexpr size_t REMOTE = package_schema.index("remote");
+constexpr size_t MIRRORS = package_schema.index("mirrors");
+constexpr size_t SUBMODULES = package_schema.index("submodules");
+constexpr size_t SPARSE_PATHS = package_schema.index("sparse-paths");
+constexpr size_t MODULE = package_schema.index("module");
+constexpr size_t HASH = package_schema.index("hash");
+constexpr size_t DOWNLOAD_NAME = package_schema.index("download_name");
+constexpr size_t USERNAME = package_schema.index("username");
+constexpr size_t PASSWORD = package_schema.index("password");
+constexpr size_t HEADERS = package_schema.index("headers");
+constexpr size_t CA_FILE = package_schema.index("ca_file");
+constexpr size_t CONFIGURE = package_schema.index("configure");
+constexpr size_t CMAKE_LISTS = package_schema.index("cmake-lists");
+constexpr size_t OPTIONS = package_schema.index("options");
+constexpr size_t ADVANCED_VARIABLES = package_schema.index("advanced-variables");
+constexpr size_t VENDOR = package_schema.index("vendor");
+constexpr size_t PREBUILT = package_schema.index("prebuilt");
+constexpr size_t PATCHES = package_schema.index("patches");
+}// namespace package_key
+
+/// Keys of package_schema every kind of package can have.
+static constexpr uint64_t common_keys = package_schema.mask(
+  {"configure", "cmake-lists", "options", "advanced-variables", "vendor", "prebuilt", "patches"});
+
+/// Keys of package_schema specific to each kind, indexed by remote_kind.
+static constexpr uint64_t kind_keys[] = {
+  package_schema.mask({"path"}),
+  package_schema.mask({"svn", "rev"}),
+  package_schema.mask({"git", "tag", "remote", "mirrors", "submodules", "sparse-paths"}),
+  package_schema.mask({"hg", "tag"}),
+  package_schema.mask({"cvs", "module", "tag"}),
+  package_schema.mask({"url", "mirrors", "hash", "download_name", "username", "password", "headers", "ca_file"}),
+};
+
+static_assert(package_schema.find("url") == size_t(remote_kind::URL), "source keys are out of remote_kind order");
+
+/// The first source key the package has names its kind.
+static std::optional<remote_kind> infer_kind(const package_fields &fields)
+{
+  for (size_t kind = 0; kind <= size_t(remote_kind::URL); kind++) {
+    if (fields.nodes[kind] != nullptr) return remote_kind(kind);
+  }
+  return std::nullopt;
+}
+
+std::optional<remote_kind> infer_kind(const toml_node *config)
+{
+  if (config == nullptr) return std::nullopt;
+  return infer_kind(package_schema.decode(*config));
+}
+
+/// Why package `name` can't be parsed from `fields`, if it can't.
+static std::optional<std::string> package_error(std::string_view name, const package_fields &fields)
+{
+  if (!fields.unknown.empty()) {
+    std::vector<std::string> keys;
+    for (const auto *entry : fields.unknown) {
+      auto suggestion = package_schema.closest(entry->key);
+      keys.push_back(suggestion.has_value() ? fmt::format("'{}' (did you mean '{}'?)", entry->key, *suggestion)
+                                            : fmt::format("'{}'", entry->key));
+    }
+    return fmt::format("unknown keys in '{}': {}", name, fmt::join(keys, ", "));
+  }
+
+  auto kind = infer_kind(fields);
+  if (!kind.has_value()) return fmt::format("unknown remote type for '{}'", name);
+  if (!fields.get<std::string_view>(size_t(*kind)).has_value()) {
+    return fmt::format("{} of {} isn't a string", package_schema.key(size_t(*kind)), name);
+  }
+  uint64_t allowed = common_keys | kind_keys[size_t(*kind)];
+  for (size_t key = 0; key < package_schema.size(); key++) {
+    if (fields.nodes[key] != nullptr && (allowed & (uint64_t(1) << key)) == 0) {
+      return fmt::format(
+        "'{}' is a {} package, '{}' doesn't apply to it", name, kind_name(*kind), package_schema.key(key));
+    }
+  }
+  if (const toml_node *mirrors = fields.nodes[package_key::MIRRORS]) {
+    auto urls = toml_node_as<std::vector<std::string_view>>(*mirrors);
+    if (!urls.has_value() || urls->size() != mirrors->count) {
+      return fmt::format("mirrors of {} isn't a list of URLs", name);
+    }
+  }
+  // Local sources belong to the user, depmgr doesn't modify them.
+  if (*kind == remote_kind::LOCAL && fields.nodes[package_key::PATCHES] != nullptr) {
+    return fmt::format("{} is a local package, its sources can't be patched", name);
+  }
+  // A configure script is evaluated in the including project, which neither
+  // an imported artifact nor the separate CMake run building it sees.
+  bool prebuilt = fields.get<std::string_view>(package_key::PREBUILT).has_value()
+                  || fields.get<bool>(package_key::PREBUILT).value_or(false);
+  if (prebuilt && fields.nodes[package_key::CONFIGURE] != nullptr) {
+    return fmt::format("{} is prebuilt, its configure script wouldn't reach the artifact build", name);
+  }
+  return std::nullopt;
+}
+
+static std::optional<std::string> owned(std::optional<std::string_view> value)
+{
+  if (!value.has_value()) return std::nullopt;
+  return std::string(*value);
+}
+
+/// String elements of a TOML array joined with `separator`.
+static std::string join_strings(const toml_node *array, std::string_view separator)
+{
+  std::string result;
+  if (array == nullptr) return result;
+  for (const auto &element : *array) {
+    if (element.type != toml_type::STRING) continue;
+    if (!result.empty()) { result += separator; }
+    result += element.text;
+  }
+  return result;
+}
+
+static std::optional<std::vector<std::string>> string_list(const toml_node *array)
+{
+  if (array == nullptr) return std::nullopt;
+  return toml_node_as<std::vector<std::string>>(*array);
+}
+
+/// `primary` followed by the other URLs in `mirrors`, in manifest order.
+static std::vector<std::string> mirror_urls(std::string_view primary, const toml_node *mirrors)
+{
+  std::vector<std::string> urls{std::string(primary)};
+  for (auto &url : string_list(mirrors).value_or(std::vector<std::string>())) {
+    if (std::find(urls.begin(), urls.end(), url) == urls.end()) { urls.push_back(std::move(url)); }
+  }
+  return urls;
+}
+
+/// Whether `remote` of a git package names a remote. Manifests written before
+/// `mirrors` existed set it to another URL of the repository instead, those
+/// are never valid remote names.
+static bool is_remote_name(std::string_view remote)
+{
+  return !remote.empty() && remote.find(':') == std::string_view::npos && remote.front() != '/'
+         && remote.front() != '.';
+}
+
+/// URLs `row` is fetched from: `repo`, then its mirrors, including `remote`
+/// when it's a URL.
+static std::vector<std::string> git_urls(const git_package &row)
+{
+  std::vector<std::string> urls = mirror_urls(row.repo, row.mirrors);
+  if (row.remote.has_value() && !is_remote_name(*row.remote)
+      && std::find(urls.begin(), urls.end(), *row.remote) == urls.end()) {
+    urls.emplace_back(*row.remote);
+  }
+  return urls;
+}
+
+/// Name of the remote of `row` in checkouts, `origin` unless it's named.
+static std::string git_remote_name(const git_package &row)
+{
+  return row.remote.has_value() && is_remote_name(*row.remote) ? std::string(*row.remote) : "origin";
+}
+
+/// Subtree of the sources that's added to the build, `/<path>` or empty for
+/// the root.
+static std::string source_subdir(const package_table &packages, package_id id)
+{
+  if (packages.kinds[id] != remote_kind::GIT) return "";
+  const toml_node *sparse_paths = packages.git[packages.rows[id]].sparse_paths;
+  if (sparse_paths == nullptr || sparse_paths->count == 0) return "";
+  auto first = toml_node_as<std::string_view>(*sparse_paths->begin());
+  if (!first.has_value()) return "";
+  std::string_view path = *first;
+  while (!path.empty() && path.back() == '/') { path.remove_suffix(1); }
+  return path.empty() ? "" : fmt::format("/{}", path);
+}
+
+// Per-kind behaviour. Every function takes the table and the package's row in
+// its kind column.
+
+static fs::path resolved_path(const package_table &table, const local_package &row)
+{
+  fs::path path(row.path);
+  if (path.is_absolute()) return path;
+  return table.manifests[table.origins[row.id]].manifest_dir / path;
+}
+
+static void describe(const package_table &table, const local_package &row, resolved_package &result)
+{
+  result.remote = resolved_path(table, row).generic_string();
+  result.source_dir = result.remote;
+}
+
+static void describe(const package_table &, const svn_package &row, resolved_package &result)
+{
+  result.remote = row.repo;
+  result.revision = row.revision.value_or("");
+}
+
+static void describe(const package_table &, const git_package &row, resolved_package &result)
+{
+  result.remote = row.repo;
+  result.revision = row.locked.has_value() ? row.locked->commit : std::string(row.tag.value_or("HEAD"));
+}
+
+static void describe(const package_table &, const hg_package &row, resolved_package &result)
+{
+  result.remote = row.repo;
+  result.revision = row.tag.value_or("");
+}
+
+static void describe(const package_table &, const cvs_package &row, resolved_package &result)
+{
+  result.remote = row.mod.has_value() ? fmt::format("{}#{}", row.repo, *row.mod) : std::string(row.repo);
+  result.revision = row.tag.value_or("");
+}
+
+static void describe(const package_table &, const url_package &row, resolved_package &result)
+{
+  result.remote = row.remote;
+  result.revision = row.hash.value_or("");
+}
+
+static cache_key git_cache_identity(const git_package &row, const git_revision &revision)
+{
+  cache_key key{"git", std::string(row.repo), revision.commit};
+  if (row.submodules != nullptr) { key.variant = fmt::format("submodules={}", join_strings(row.submodules, ",")); }
+  if (row.sparse_paths != nullptr) {
+    if (!key.variant.empty()) { key.variant += ";"; }
+    key.variant += fmt::format("sparse={}", join_strings(row.sparse_paths, ","));
+  }
+  if (std::string remote = git_remote_name(row); remote != "origin") {
+    if (!key.variant.empty()) { key.variant += ";"; }
+    key.variant += fmt::format("remote={}", remote);
+  }
+  return key;
+}
+
+/// Lowercase digest of a `SHA256=<hex>` hash, the only algorithm depmgr
+/// verifies itself.
+static std::optional<std::string> sha256_hash(const url_package &row)
+{
+  if (!row.hash.has_value() || row.hash->size() < 7) return std::nullopt;
+  std::string algorithm(row.hash->substr(0, 7));
+  std::transform(algorithm.begin(), algorithm.end(), algorithm.begin(), ::toupper);
+  if (algorithm != "SHA256=") return std::nullopt;
+
+  std::string digest(row.hash->substr(7));
+  std::transform(digest.begin(), digest.end(), digest.begin(), ::tolower);
+  return digest;
+}
+
+/// Hashes identifying the contents of `patches`, for cache keys and stamps.
+static std::vector<std::string> patch_hashes(const std::vector<fs::path> &patches)
+{
+  std::vector<std::string> hashes;
+  for (const auto &patch : patches) {
+    std::optional<std::string> contents = read_file(patch);
+    if (!contents.has_value()) { critical_error("can't read patch {}", patch.string()); }
+    hashes.push_back(sha256_hex(*contents));
+  }
+  return hashes;
+}
+
+/// Cache entry with the patches of package `id` applied to the sources in
+/// `base`, the entry of `key`. Patched trees are cached like fetched ones, so
+/// a patch set is applied once per source revision.
+static fs::path patched_entry(const package_table &table,
+  package_id id,
+  dependency_cache &cache,
+  cache_key key,
+  const fs::path &base)
+{
+  std::vector<fs::path> patches = table.patch_files(id);
+  if (patches.empty()) return base;
+
+  key.patches = patch_hashes(patches);
+  return cache.ensure(key, [&](const fs::path &staging) {
+    trace_span span("patch", table.names[id]);
+    status("Patching {}", table.names[id]);
+    dependency_cache::materialize(base, staging);
+    git_apply_patches(staging, patches);
+  });
+}
+
+static void fetch(const package_table &table, const git_package &row, const fs::path &dest)
+{
+  std::string_view name = table.names[row.id];
+  trace_span span("fetch", name);
+  std::optional<std::string> tag = owned(row.tag);
+  std::string repo(row.repo);
+  dependency_cache cache(execution_context::get().dependency_cache_dir);
+
+  // Every mirror fetches into the local mirror of the primary URL, they
+  // serve the same commits.
+  auto cache_revision = [&](const git_revision &revision, const std::string &url) {
+    cache_key key = git_cache_identity(row, revision);
+    if (cache.contains(key)) { status("Using cached {} ({})", name, revision.commit); }
+    fs::path entry = cache.ensure(key, [&](const fs::path &staging) {
+      if (url == repo) {
+        status("Fetching {} ({})", name, tag.value_or("HEAD"));
+      } else {
+        status("Fetching {} ({}) from {}", name, tag.value_or("HEAD"), url);
+      }
+      fs::path mirror = cache.mirror_path(repo);
+      git_mirror_fetch(mirror, url, revision, row.locked.has_value());
+      git_checkout(mirror,
+        url,
+        git_remote_name(row),
+        revision,
+        staging,
+        string_list(row.submodules),
+        string_list(row.sparse_paths).value_or(std::vector<std::string>()));
+    });
+    return patched_entry(table, row.id, cache, key, entry);
+  };
+
+  fs::path entry;
+  if (row.locked.has_value() && cache.contains(git_cache_identity(row, *row.locked))) {
+    entry = cache_revision(*row.locked, repo);
+  } else {
+    // Mirrors race on listing their references, a locked commit is only
+    // looked up to find the fastest one.
+    race_mirrors(
+      repo,
+      git_urls(row),
+      [&](const std::string &url, const std::atomic<bool> &cancelled) {
+        git_revision resolved = git_resolve(url, row.locked.has_value() ? row.locked->commit : tag, cancelled);
+        return row.locked.value_or(resolved);
+      },
+      [&](const std::string &url, const git_revision &revision) { entry = cache_revision(revision, url); });
+  }
+
+  trace_span copy_span("copy", name);
+  fs::remove_all(dest);
+  dependency_cache::materialize(entry, dest);
+}
+
+/// URLs of `row` depmgr can download and extract itself, primary first.
+static std::vector<std::string> fetchable_urls(const url_package &row)
+{
+  std::vector<std::string> urls = mirror_urls(row.remote, row.mirrors);
+  urls.erase(std::remove_if(urls.begin(),
+               urls.end(),
+               [](const std::string &url) { return !is_streamable_url(url) || !is_extractable_archive(url); }),
+    urls.end());
+  return urls;
+}
+
+static void fetch(const package_table &table, const url_package &row, const fs::path &dest)
+{
+  std::string_view name = table.names[row.id];
+  trace_span span("fetch", name);
+  // Mirrors race on connecting and sending the response headers, the body
+  // is only read from the fastest.
+  auto open = [&row](const std::string &url, const std::atomic<bool> &cancelled) {
+    download_request request{url,
+      string_list(row.headers).value_or(std::vector<std::string>()),
+      owned(row.username),
+      owned(row.password)};
+    return open_url(request, cancelled);
+  };
+  auto download = [&](const fs::path &into, const std::optional<std::string> &expected) {
+    race_mirrors(std::string(row.remote),
+      fetchable_urls(row),
+      open,
+      [&](const std::string &url, std::unique_ptr<byte_source> source) {
+        download_and_extract(*source, url, expected, into);
+      });
+  };
+
+  auto expected = sha256_hash(row);
+  if (!expected.has_value()) {
+    // Without a hash the contents aren't known up front and can't be shared.
+    status("Downloading {}", name);
+    fs::remove_all(dest);
+    download(dest, std::nullopt);
+    if (auto patches = table.patch_files(row.id); !patches.empty()) { git_apply_patches(dest, patches); }
+    return;
+  }
+
+  cache_key key{"url", std::string(row.remote), "sha256:" + *expected};
+  dependency_cache cache(execution_context::get().dependency_cache_dir);
+  if (cache.contains(key)) { status("Using cached {} ({})", name, *expected); }
+  fs::path entry = cache.ensure(key, [&](const fs::path &staging) {
+    status("Downloading {}", name);
+    download(staging, expected);
+  });
+  entry = patched_entry(table, row.id, cache, key, entry);
+
+  trace_span copy_span("copy", name);
+  fs::remove_all(dest);
+  dependency_cache::materialize(entry, dest);
+}
+
+// Download arguments, shared by fetchcontent_declare and ExternalProject_Add.
+
+static std::string source_arguments(const package_table &table, const local_package &row)
+{
+  return fmt::format("  SOURCE_DIR \"{}\"\n", table.manifest_relative(row.id, row.path));
+}
+
+static std::string source_arguments(const package_table &, const svn_package &row)
+{
+  std::string options;
+
+  if (row.revision.has_value()) { options += fmt::format("  SVN_REVISION -r{}\n", *row.revision); }
+
+  return fmt::format("  SVN_REPOSITORY {}\n{}  SVN_TRUST_CERT TRUE\n", row.repo, options);
+}
+
+static std::string source_arguments(const package_table &, const git_package &row)
+{
+  std::string options;
+
+  // GIT_SHALLOW clones with --branch, which doesn't accept commit ids.
+  if (row.locked.has_value()) {
+    options += fmt::format("  GIT_TAG {} # {}\n", row.locked->commit, row.tag.value_or("HEAD"));
+  } else {
+    if (row.tag.has_value()) { options += fmt::format("  GIT_TAG {}\n", *row.tag); }
+    options += "  GIT_SHALLOW TRUE\n";
+  }
+  if (std::string remote = git_remote_name(row); remote != "origin") {
+    options += fmt::format("  GIT_REMOTE_NAME {}\n", remote);
+  }
+  if (row.submodules != nullptr) {
+    options += fmt::format("  GIT_SUBMODULES {}\n", join_strings(row.submodules, " "));
+  }
+
+  return fmt::format("  GIT_REPOSITORY {}\n{}", row.repo, options);
+}
+
+static std::string source_arguments(const package_table &, const hg_package &row)
+{
+  std::string options;
+
+  if (row.tag.has_value()) { options += fmt::format("  HG_TAG {}\n", *row.tag); }
+
+  return fmt::format("  HG_REPOSITORY {}\n{}  HG_SHALLOW TRUE\n", row.repo, options);
+}
+
+static std::string source_arguments(const package_table &, const cvs_package &row)
+{
+  std::string options;
+
+  if (row.mod.has_value()) { options += fmt::format("  CVS_MODULE {}\n", *row.mod); }
+  if (row.tag.has_value()) { options += fmt::format("  CVS_TAG {}\n", *row.tag); }
+
+  return fmt::format("  CVS_REPOSITORY {}\n{}", row.repo, options);
+}
+
+static std::string source_arguments(const package_table &, const url_package &row)
+{
+  std::string options;
+
+  if (row.hash.has_value()) { options += fmt::format("  URL_HASH {}\n", *row.hash); }
+  if (row.download_name.has_value()) { options += fmt::format("  DOWNLOAD_NAME {}\n", *row.download_name); }
+
+  if (row.username.has_value()) { options += fmt::format("  URL_USERNAME {}\n", *row.username); }
+  if (row.password.has_value()) { options += fmt::format("  URL_PASSWORD {}\n", *row.password); }
+  if (row.headers != nullptr) { options += fmt::format("  URL_HEADER {}\n", join_strings(row.headers, " ")); }
+
+  if (row.ca_file.has_value()) { options += fmt::format("  URL_CAINFO {}\n", *row.ca_file); }
+
+  // CMake tries the URLs in order.
+  std::string urls(row.remote);
+  if (row.mirrors != nullptr) { urls += fmt::format(" {}", join_strings(row.mirrors, " ")); }
+  return fmt::format("  URL {}\n{}", urls, options);
+}
+
+/// Command applying the patches of package `id` when CMake downloads its
+/// sources, through `depmgr patch`. Empty without patches.
+static std::string patch_command(const package_table &table, package_id id)
+{
+  if (table.patches[id] == nullptr) return "";
+  std::string command = fmt::format("\"{}\" patch <SOURCE_DIR> {}",
+    execution_context::get().self_path.generic_string(),
+    table.patch_set_hash(id));
+  for (const auto &patch : string_list(table.patches[id]).value_or(std::vector<std::string>())) {
+    command += fmt::format(" \"{}\"", table.manifest_relative(id, patch));
+  }
+  return command;
+}
+
+template<typename Row>
+static void write_fetch_rules(const package_table &table, const Row &row, fmt::memory_buffer &out)
+{
+  std::string arguments = source_arguments(table, row);
+  if (std::string patch = patch_command(table, row.id); !patch.empty()) {
+    arguments += fmt::format("  PATCH_COMMAND {}\n", patch);
+  }
+
+  fmt::format_to(std::back_inserter(out),
+    "fetchcontent_declare(\n"
+    "  {package}\n"
+    "{arguments}"
+    ")\n",
+    fmt::arg("package", table.names[row.id]),
+    fmt::arg("arguments", arguments));
+}
+
+/// Calls `f` with the kind specific row of package `id`.
+template<typename Table, typename F> static void visit_row(Table &table, package_id id, F &&f)
+{
+  uint32_t row = table.rows[id];
+  switch (table.kinds[id]) {
+  case remote_kind::LOCAL:
+    return f(table.local[row]);
+  case remote_kind::SVN:
+    return f(table.svn[row]);
+  case remote_kind::GIT:
+    return f(table.git[row]);
+  case remote_kind::HG:
+    return f(table.hg[row]);
+  case remote_kind::CVS:
+    return f(table.cvs[row]);
+  case remote_kind::URL:
+    return f(table.url[row]);
+  }
+}
+
+template<typename Row> static std::vector<Row> &column(package_table &table)
+{
+  if constexpr (std::is_same_v<Row, local_package>) return table.local;
+  if constexpr (std::is_same_v<Row, svn_package>) return table.svn;
+  if constexpr (std::is_same_v<Row, git_package>) return table.git;
+  if constexpr (std::is_same_v<Row, hg_package>) return table.hg;
+  if constexpr (std::is_same_v<Row, cvs_package>) return table.cvs;
+  if constexpr (std::is_same_v<Row, url_package>) return table.url;
+}
+
+void package_table::reserve(size_t count)
+{
+  names.reserve(count);
+  kinds.reserve(count);
+  rows.reserve(count);
+  origins.reserve(count);
+  configs.reserve(count);
+  configure.reserve(count);
+  cmake_lists.reserve(count);
+  options.reserve(count);
+  advanced_variables.reserve(count);
+  vendor.reserve(count);
+  prebuilt.reserve(count);
+  depends.reserve(count);
+  patches.reserve(count);
+}
+
+uint32_t package_table::add_origin(package_origin origin)
+{
+  manifests.emplace_back(std::move(origin));
+  return uint32_t(manifests.size() - 1);
+}
+
+package_id package_table::add(std::string_view name, const toml_node &config, uint32_t origin)
+{
+  trace_span span("parse package", name);
+  package_fields fields = package_schema.decode(config);
+  if (auto error = package_error(name, fields)) { critical_error("{}", *error); }
+  remote_kind kind = *infer_kind(fields);
+
+  using namespace package_key;
+  package_id id = package_id(names.size());
+  // The source key was checked to be a string.
+  std::string_view source = *fields.get<std::string_view>(size_t(kind));
+  auto optional = [&](size_t key) { return fields.get<std::string_view>(key); };
+  auto push = [&](auto row) {
+    auto &rows_of_kind = column<decltype(row)>(*this);
+    rows.push_back(uint32_t(rows_of_kind.size()));
+    rows_of_kind.push_back(std::move(row));
+  };
+
+  switch (kind) {
+  case remote_kind::LOCAL:
+    push(local_package{id, source});
+    break;
+  case remote_kind::SVN:
+    push(svn_package{id, source, optional(REV)});
+    break;
+  case remote_kind::GIT:
+    push(git_package{id,
+      source,
+      optional(TAG),
+      optional(REMOTE),
+      fields.array(MIRRORS),
+      fields.array(SUBMODULES),
+      fields.array(SPARSE_PATHS)});
+    break;
+  case remote_kind::HG:
+    push(hg_package{id, source, optional(TAG)});
+    break;
+  case remote_kind::CVS:
+    push(cvs_package{id, source, optional(MODULE), optional(TAG)});
+    break;
+  case remote_kind::URL:
+    push(url_package{id,
+      source,
+      fields.array(MIRRORS),
+      optional(HASH),
+      optional(DOWNLOAD_NAME),
+      optional(USERNAME),
+      optional(PASSWORD),
+      fields.array(HEADERS),
+      optional(CA_FILE)});
+    break;
+  }
+
+  names.push_back(name);
+  kinds.push_back(kind);
+  origins.push_back(origin);
+  configs.push_back(&config);
+  configure.push_back(optional(CONFIGURE));
+  cmake_lists.push_back(optional(CMAKE_LISTS));
+  options.push_back(fields.table(OPTIONS));
+  advanced_variables.push_back(fields.array(ADVANCED_VARIABLES));
+  vendor.push_back(fields.get<bool>(VENDOR).value_or(false));
+  // `prebuilt = true` imports the package under its own name.
+  auto prebuilt_name = optional(PREBUILT);
+  if (!prebuilt_name.has_value() && fields.get<bool>(PREBUILT).value_or(false)) { prebuilt_name = name; }
+  prebuilt.push_back(prebuilt_name);
+  depends.emplace_back();
+  patches.push_back(fields.array(PATCHES));
+  return id;
+}
+
+package_id package_table::append(const package_table &other, package_id source, uint32_t origin)
+{
+  package_id id = package_id(names.size());
+  visit_row(other, source, [&](const auto &row) {
+    auto &rows_of_kind = column<std::decay_t<decltype(row)>>(*this);
+    rows.push_back(uint32_t(rows_of_kind.size()));
+    rows_of_kind.push_back(row);
+    rows_of_kind.back().id = id;
+  });
+
+  names.push_back(other.names[source]);
+  kinds.push_back(other.kinds[source]);
+  origins.push_back(origin);
+  configs.push_back(other.configs[source]);
+  configure.push_back(other.configure[source]);
+  cmake_lists.push_back(other.cmake_lists[source]);
+  options.push_back(other.options[source]);
+  advanced_variables.push_back(other.advanced_variables[source]);
+  vendor.push_back(other.vendor[source]);
+  prebuilt.push_back(other.prebuilt[source]);
+  depends.emplace_back();
+  patches.push_back(other.patches[source]);
+  return id;
+}
+
+std::string package_table::upper_name(package_id id) const
+{
+  std::string result(names[id]);
+  std::transform(result.begin(), result.end(), result.begin(), ::toupper);
+  return result;
+}
+
+std::string package_table::manifest_relative(package_id id, std::string_view path) const
+{
+  fs::path value(path);
+  const package_origin &origin = manifests[origins[id]];
+  if (value.is_absolute()) return value.generic_string();
+  if (origin.nested) return (origin.manifest_dir / value).generic_string();
+  return fmt::format("${{CMAKE_CURRENT_SOURCE_DIR}}/{}", value.generic_string());
+}
+
+std::vector<fs::path> package_table::patch_files(package_id id) const
+{
+  std::vector<fs::path> files;
+  for (const auto &path : string_list(patches[id]).value_or(std::vector<std::string>())) {
+    fs::path value(path);
+    files.push_back(value.is_absolute() ? value : manifests[origins[id]].manifest_dir / value);
+  }
+  return files;
+}
+
+std::string patch_set_hash(const std::vector<fs::path> &patches)
+{
+  return sha256_hex(fmt::format("{}", fmt::join(patch_hashes(patches), ",")));
+}
+
+std::string package_table::patch_set_hash(package_id id) const
+{
+  if (id < patch_set_hashes.size()) return patch_set_hashes[id];
+  if (patches[id] == nullptr) return "";
+  return ::patch_set_hash(patch_files(id));
+}
+
+fs::path package_table::stamp_path(package_id id) const
+{
+  return work_dir / "src" / fmt::format("{}.stamp", names[id]);
+}
+
+fs::path package_table::source_dir(package_id id) const
+{
+  return work_dir / "src" / fs::path(names[id]);
+}
+
+std::optional<fs::path> package_table::nested_manifest_root(package_id id) const
+{
+  if (kinds[id] == remote_kind::LOCAL) return resolved_path(*this, local[rows[id]]);
+  if (!is_prepared(id)) return std::nullopt;
+  return source_dir(id);
+}
+
+static std::optional<std::string> source_stamp(const package_table &table, package_id id)
+{
+  switch (table.kinds[id]) {
+  case remote_kind::GIT: {
+    const git_package &row = table.git[table.rows[id]];
+    std::string stamp =
+      fmt::format("{}\n{}\n{}", row.repo, row.tag.value_or("HEAD"), row.locked ? row.locked->commit : "");
+    if (row.sparse_paths != nullptr) { stamp += fmt::format("\n{}", join_strings(row.sparse_paths, ",")); }
+    return stamp;
+  }
+  case remote_kind::URL: {
+    const url_package &row = table.url[table.rows[id]];
+    if (fetchable_urls(row).empty()) return std::nullopt;
+    if (row.hash.has_value() && !sha256_hash(row).has_value()) return std::nullopt;
+    return fmt::format("{}\n{}", row.remote, row.hash.value_or(""));
+  }
+  default:
+    return std::nullopt;
+  }
+}
+
+std::optional<std::string> package_table::fetch_stamp(package_id id) const
+{
+  std::optional<std::string> stamp = source_stamp(*this, id);
+  if (!stamp.has_value() || patches[id] == nullptr) return stamp;
+  // Edited patches prepare the sources again.
+  return fmt::format("{}\npatches={}", *stamp, fmt::join(patch_hashes(patch_files(id)), ","));
+}
+
+bool package_table::is_prepared(package_id id) const
+{
+  if (id < prepared.size()) return prepared[id];
+  auto stamp = fetch_stamp(id);
+  if (!stamp.has_value()) return false;
+
+  return read_file(stamp_path(id)) == stamp && fs::exists(source_dir(id));
+}
+
+void package_table::settle_sources()
+{
+  trace_span span("settle sources");
+  std::vector<uint8_t> settled_prepared(size());
+  std::vector<std::string> settled_hashes(size());
+  for (package_id id = 0; id < size(); id++) {
+    settled_prepared[id] = is_prepared(id);
+    settled_hashes[id] = patch_set_hash(id);
+  }
+  prepared = std::move(settled_prepared);
+  patch_set_hashes = std::move(settled_hashes);
+}
+
+void package_table::prepare(package_id id) const
+{
+  fs::remove(stamp_path(id));
+  if (kinds[id] == remote_kind::GIT) {
+    fetch(*this, git[rows[id]], source_dir(id));
+  } else if (kinds[id] == remote_kind::URL) {
+    fetch(*this, url[rows[id]], source_dir(id));
+  }
+  std::ofstream(stamp_path(id)) << fetch_stamp(id).value();
+}
+
+bool package_table::prepare_from_cache(package_id id) const
+{
+  auto key = cache_identity(id);
+  if (!key.has_value()) return false;
+  dependency_cache cache(execution_context::get().dependency_cache_dir);
+  // Patching doesn't need the network, the unpatched sources are enough.
+  cache_key base = *key;
+  base.patches.clear();
+  if (!cache.contains(*key) && !cache.contains(base)) return false;
+
+  status("Using cached {} ({})", names[id], key->revision);
+  fs::path entry = patched_entry(*this, id, cache, base, cache.entry_path(base));
+  trace_span span("copy", names[id]);
+  fs::remove(stamp_path(id));
+  fs::remove_all(source_dir(id));
+  dependency_cache::materialize(entry, source_dir(id));
+  std::ofstream(stamp_path(id)) << fetch_stamp(id).value();
+  return true;
+}
+
+bool package_table::prepare_from_pack(package_id id, const vendor_pack &pack) const
+{
+  auto stamp = fetch_stamp(id);
+  if (!vendor[id] || !stamp.has_value()) return false;
+  const vendor_package *packed = pack.find(names[id], *stamp);
+  if (packed == nullptr) return false;
+
+  status("Using vendored {}", names[id]);
+  fs::remove(stamp_path(id));
+  pack.extract(*packed, source_dir(id));
+  std::ofstream(stamp_path(id)) << *stamp;
+  return true;
+}
+
+std::optional<std::string> package_table::offline_problem(package_id id) const
+{
+  switch (kinds[id]) {
+  case remote_kind::LOCAL: {
+    fs::path path = resolved_path(*this, local[rows[id]]);
+    if (!fs::exists(path)) return fmt::format("{} doesn't exist", path.generic_string());
+    return std::nullopt;
+  }
+  case remote_kind::GIT:
+    if (is_prepared(id)) return std::nullopt;
+    if (!git[rows[id]].locked.has_value()) return std::string("not locked, run depmgr lock and fetch");
+    return std::string("not in the cache, run depmgr fetch");
+  case remote_kind::URL:
+    if (is_prepared(id)) return std::nullopt;
+    if (!fetch_stamp(id).has_value()) return std::string("not an archive depmgr can fetch");
+    if (!cache_identity(id).has_value()) return std::string("no SHA256 hash to find it in the cache by");
+    return std::string("not in the cache, run depmgr fetch");
+  default:
+    return fmt::format("{} sources can only be fetched by CMake", kind_name(kinds[id]));
+  }
+}
+
+std::optional<lock_entry> package_table::resolve(package_id id) const
+{
+  if (kinds[id] != remote_kind::GIT) return std::nullopt;
+
+  trace_span span("resolve revision", names[id]);
+  const git_package &row = git[rows[id]];
+  std::string repo(row.repo);
+  git_revision revision;
+  race_mirrors(
+    repo,
+    git_urls(row),
+    [&row](const std::string &url, const std::atomic<bool> &cancelled) {
+      return git_resolve(url, owned(row.tag), cancelled);
+    },
+    [&revision](const std::string &, git_revision resolved) { revision = std::move(resolved); });
+  return lock_entry{"git", repo, std::string(row.tag.value_or("HEAD")), revision.ref, revision.commit};
+}
+
+void package_table::apply_lock(const lockfile &lock)
+{
+  for (auto &row : git) {
+    auto entry =
+      lock.find(std::string(names[row.id]), "git", std::string(row.repo), std::string(row.tag.value_or("HEAD")));
+    if (entry != nullptr) { row.locked = git_revision{entry->ref, entry->commit}; }
+  }
+}
+
+static std::optional<cache_key> source_identity(const package_table &table, package_id id)
+{
+  switch (table.kinds[id]) {
+  case remote_kind::GIT: {
+    const git_package &row = table.git[table.rows[id]];
+    if (!row.locked.has_value()) return std::nullopt;
+    return git_cache_identity(row, *row.locked);
+  }
+  case remote_kind::URL: {
+    const url_package &row = table.url[table.rows[id]];
+    auto expected = sha256_hash(row);
+    if (!expected.has_value()) return std::nullopt;
+    return cache_key{"url", std::string(row.remote), "sha256:" + *expected};
+  }
+  default:
+    return std::nullopt;
+  }
+}
+
+std::optional<cache_key> package_table::cache_identity(package_id id) const
+{
+  std::optional<cache_key> key = source_identity(*this, id);
+  if (key.has_value()) { key->patches = patch_hashes(patch_files(id)); }
+  return key;
+}
+
+resolved_package package_table::resolve_manifest(package_id id) const
+{
+  resolved_package result;
+  result.name = names[id];
+  result.kind = kind_name(kinds[id]);
+  if (is_prepared(id)) { result.source_dir = source_dir(id).generic_string(); }
+  if (auto key = cache_identity(id)) { result.cache_key = key->digest(); }
+  if (options[id] != nullptr) {
+    for (const auto &option : cmake_option_list(*options[id]).options) {
+      result.options.emplace_back(option.name, option.value());
+    }
+  }
+  visit_row(*this, id, [&](const auto &row) { describe(*this, row, result); });
+  return result;
+}
+
+std::string package_table::identity(package_id id) const
+{
+  resolved_package resolved = resolve_manifest(id);
+  return fmt::format("{}\n{}\n{}", resolved.kind, resolved.remote, resolved.revision);
+}
+
+/// Sources and options of package `id` and, recursively, of the packages it
+/// depends on. None when any of them isn't pinned.
+static std::optional<std::string> build_identity(const package_table &packages, package_id id)
+{
+  auto source = packages.cache_identity(id);
+  if (!source.has_value()) return std::nullopt;
+
+  std::string identity = fmt::format("{}\n{}\n", source->digest(), source_subdir(packages, id));
+  if (packages.options[id] != nullptr) {
+    for (const auto &option : cmake_option_list(*packages.options[id]).options) {
+      identity += fmt::format("{}={}\n", option.name, option.value());
+    }
+  }
+  for (package_id dependency : packages.depends[id]) {
+    auto nested = build_identity(packages, dependency);
+    if (!nested.has_value()) return std::nullopt;
+    identity += fmt::format("depends {}\n", sha256_hex(*nested));
+  }
+  return identity;
+}
+
+std::optional<std::string> package_table::artifact_identity(package_id id) const
+{
+  if (!prebuilt[id].has_value()) return std::nullopt;
+  auto identity = build_identity(*this, id);
+  if (!identity.has_value()) return std::nullopt;
+  return sha256_hex(fmt::format("{}{}-{}-{}\n", *identity, TARGET_ARCH, TARGET_PLATFORM, TARGET_OS));
+}
+
+std::optional<std::string> find_package_error(const toml_node &config)
+{
+  for (const auto &data : config) {
+    if (!data.is_table()) return fmt::format("'{}' isn't a dependency table", data.key);
+    if (auto error = package_error(data.key, package_schema.decode(data))) return error;
+  }
+  return std::nullopt;
+}
+
+package_table parse_packages(const toml_node &config, const fs::path &manifest_dir, bool nested)
+{
+  package_table packages;
+  packages.reserve(config.count);
+  uint32_t origin = packages.add_origin(package_origin{manifest_dir, nested});
+
+  for (const auto &data : config) {
+    if (!data.is_table()) { critical_error("'{}' isn't a dependency table", data.key); }
+    packages.add(data.key, data, origin);
+  }
+  return packages;
+}
+
+static void write_source_override(const package_table &packages, package_id id, fmt::memory_buffer &out)
+{
+  if (!packages.is_prepared(id)) return;
+  fmt::format_to(std::back_inserter(out),
+    "set(FETCHCONTENT_SOURCE_DIR_{} \"{}\")\n",
+    packages.upper_name(id),
+    packages.source_dir(id).generic_string());
+}
+
+/// Wraps `rules` in calls recording how long `phase` of `package` takes, when
+/// --timing is given.
+static std::string timed(std::string_view package, const char *phase, std::string_view indent, std::string rules)
+{
+  if (!execution_context::get().emit_timing || rules.empty()) return rules;
+  return fmt::format(
+    "{0}depmgr_timing_begin({1} {2})\n{3}{0}depmgr_timing_end({1} {2})\n", indent, package, phase, rules);
+}
+
+/// Prefixes every line of `rules` with `indent`.
+static std::string indented(std::string_view rules, std::string_view indent)
+{
+  std::string result;
+  while (!rules.empty()) {
+    size_t end = std::min(rules.find('\n'), rules.size() - 1) + 1;
+    result += indent;
+    result += rules.substr(0, end);
+    rules.remove_prefix(end);
+  }
+  return result;
+}
+
+static void write_configure_rules(const package_table &packages, package_id id, fmt::memory_buffer &out)
+{
+  std::string_view name = packages.names[id];
+  std::string subdir = source_subdir(packages, id);
+
+  std::string special_configure;
+  if (auto configure = packages.configure[id]) {
+    special_configure = fmt::format(
+      "  file(READ \"{0}\" DEPMGR_{1}_USER_CONFIGURATION)\n"
+      "  cmake_language(EVAL CODE \"${{DEPMGR_{1}_USER_CONFIGURATION}}\")\n"
+      "  unset(DEPMGR_{1}_USER_CONFIGURATION)\n",
+      packages.manifest_relative(id, *configure),
+      name);
+  }
+
+  std::string copy_makelists;
+  if (auto cmake_lists = packages.cmake_lists[id]) {
+    // TODO: Not source_dir -> move to work dir
+    copy_makelists = fmt::format("  configure_file(\"{}\" \"${{{}_SOURCE_DIR}}{}/CMakeLists.txt\" @ONLY)\n",
+      packages.manifest_relative(id, *cmake_lists),
+      name,
+      subdir);
+  }
+
+  std::string actual_source_dir = fmt::format("\"${{{}_SOURCE_DIR}}{}\"", name, subdir);// TODO: work dir.
+
+  std::string set_options;
+  if (packages.options[id] != nullptr) { set_options = cmake_option_list(*packages.options[id]).to_commands(2); }
+
+  std::string mark_advanced;
+  if (packages.advanced_variables[id] != nullptr) {
+    mark_advanced = fmt::format("  mark_as_advanced({})\n", join_strings(packages.advanced_variables[id], " "));
+  }
+
+  std::string fetch_advanced_vars = fmt::format(
+    "mark_as_advanced(FETCHCONTENT_SOURCE_DIR_{0} FETCHCONTENT_UPDATES_DISCONNECTED_{0})\n", packages.upper_name(id));
+
+  // TODO: populate_work_dir
+  std::string populate = timed(name,
+    "populate",
+    "",
+    fmt::format("fetchcontent_getproperties({0})\n"
+                "if(NOT {0}_POPULATED)\n"
+                "  fetchcontent_populate({0})\n"
+                "endif()\n",
+      name));
+  std::string configure = timed(name, "configure", "  ", copy_makelists + special_configure);
+  std::string add_subdirectory = timed(name,
+    "add_subdirectory",
+    "  ",
+    fmt::format("  add_subdirectory({} \"${{{}_BINARY_DIR}}\")\n", actual_source_dir, name));
+
+  // Files read while configuring the sources are hashed at configure time,
+  // so editing one reruns the step and, for prebuilt packages, doesn't reuse
+  // a stale artifact.
+  std::string input_files;
+  for (const auto &file : {packages.configure[id], packages.cmake_lists[id]}) {
+    if (file.has_value()) { input_files += fmt::format(" \"{}\"", packages.manifest_relative(id, *file)); }
+  }
+
+  // Patched sources are configured again when the patches change; the hash
+  // is empty without patches.
+  std::string sources = sha256_hex(packages.identity(id) + subdir + packages.patch_set_hash(id));
+  std::string prepare = fmt::format("{populate}"
+                                    "message(STATUS \"Dependency ready: {package}\")\n"
+                                    "depmgr_check_stamp({package} \"{sources}\"{input_files})\n"
+
+                                    "if(NOT {package}_CONFIGURED)\n"
+                                    "  message(STATUS \"Configuring dependency: {package}\")\n"
+                                    "{configure}"
+                                    "  depmgr_write_stamp({package})\n"
+                                    "  message(STATUS \"Configuring dependency: {package} - Done\")\n"
+                                    "endif()\n",
+    fmt::arg("package", name),
+    fmt::arg("populate", populate),
+    fmt::arg("sources", sources),
+    fmt::arg("input_files", input_files),
+    fmt::arg("configure", configure));
+
+  auto artifact = packages.artifact_identity(id);
+  if (!artifact.has_value()) {
+    std::string unpinned;
+    if (packages.prebuilt[id].has_value()) {
+      unpinned = fmt::format("message(STATUS \"Dependency {} isn't pinned, building it from source\")\n", name);
+    }
+
+    fmt::format_to(std::back_inserter(out),
+      "\n"
+      "{unpinned}"
+      "set({package}_WORK_DIR TRUE)\n"
+
+      "{prepare}"
+
+      "block(SCOPE_FOR VARIABLES)\n"
+      "{set_options}"
+      "{add_subdirectory}"
+      "{mark_advanced}"
+      "endblock()\n"
+      "{fetch_advanced_vars}"
+
+      "unset({package}_CONFIGURED)\n"
+      "unset({package}_WORK_DIR)\n"
+      "unset(DEPMGR_{package}_STAMP)\n"
+      "\n",
+      fmt::arg("package", name),
+      fmt::arg("unpinned", unpinned),
+      fmt::arg("prepare", prepare),
+      fmt::arg("set_options", set_options),
+      fmt::arg("add_subdirectory", add_subdirectory),
+      fmt::arg("mark_advanced", mark_advanced),
+      fmt::arg("fetch_advanced_vars", fetch_advanced_vars));
+    return;
+  }
+
+  std::string defines;
+  if (packages.options[id] != nullptr) {
+    for (const auto &option : cmake_option_list(*packages.options[id]).options) {
+      defines += fmt::format(" \"-D{}={}\"", option.name, option.value());
+    }
+  }
+
+  // The sub-build finds the prebuilt packages this one depends on, directly
+  // or not, in their artifact prefixes.
+  std::vector<std::string> dependency_prefixes;
+  std::vector<package_id> pending(packages.depends[id].begin(), packages.depends[id].end());
+  std::vector<bool> seen(packages.size());
+  while (!pending.empty()) {
+    package_id dependency = pending.back();
+    pending.pop_back();
+    if (seen[dependency]) continue;
+    seen[dependency] = true;
+    if (packages.prebuilt[dependency].has_value()) {
+      dependency_prefixes.emplace_back(fmt::format("${{DEPMGR_{}_PREFIX}}", packages.names[dependency]));
+    }
+    pending.insert(pending.end(), packages.depends[dependency].begin(), packages.depends[dependency].end());
+  }
+
+  std::string build = timed(name,
+    "build",
+    "  ",
+    fmt::format("  depmgr_build_artifact({0} {1} \"${{DEPMGR_{0}_PREFIX}}\" \"{2}\"{3})\n",
+      name,
+      actual_source_dir,
+      fmt::join(dependency_prefixes, ";"),
+      defines));
+  std::string import = timed(name,
+    "import",
+    "",
+    fmt::format("find_package({} REQUIRED CONFIG PATHS \"${{DEPMGR_{}_PREFIX}}\" NO_DEFAULT_PATH)\n",
+      *packages.prebuilt[id],
+      name));
+
+  fmt::format_to(std::back_inserter(out),
+    "\n"
+    "set({package}_WORK_DIR TRUE)\n"
+    "depmgr_artifact_prefix(DEPMGR_{package}_PREFIX \"{artifact}\"{input_files})\n"
+
+    "if(NOT EXISTS \"${{DEPMGR_{package}_PREFIX}}/.depmgr-complete\")\n"
+    "{prepare}"
+    "{build}"
+    "else()\n"
+    "  message(STATUS \"Dependency prebuilt: {package}\")\n"
+    "endif()\n"
+
+    "{import}"
+    "{fetch_advanced_vars}"
+
+    "unset({package}_CONFIGURED)\n"
+    "unset({package}_WORK_DIR)\n"
+    "unset(DEPMGR_{package}_STAMP)\n"
+    "\n",
+    fmt::arg("package", name),
+    fmt::arg("artifact", *artifact),
+    fmt::arg("input_files", input_files),
+    fmt::arg("prepare", indented(prepare, "  ")),
+    fmt::arg("build", build),
+    fmt::arg("import", import),
+    fmt::arg("fetch_advanced_vars", fetch_advanced_vars));
+}
+
+/// ExternalProject rules building package `id` in a sub-build of its own and
+/// installing it into the shared superbuild prefix, after the packages it
+/// depends on.
+static void write_superbuild_rules(const package_table &packages, package_id id, fmt::memory_buffer &out)
+{
+  std::string_view name = packages.names[id];
+
+  // Prepared sources are already patched.
+  std::string source;
+  std::vector<std::string> patch_steps;
+  if (packages.is_prepared(id)) {
+    source = fmt::format("  SOURCE_DIR \"{}\"\n  DOWNLOAD_COMMAND \"\"\n", packages.source_dir(id).generic_string());
+  } else {
+    visit_row(packages, id, [&](const auto &row) { source = source_arguments(packages, row); });
+    if (std::string patch = patch_command(packages, id); !patch.empty()) { patch_steps.push_back(patch); }
+  }
+
+  std::string arguments;
+  std::string subdir = source_subdir(packages, id);
+  if (!subdir.empty()) { arguments += fmt::format("  SOURCE_SUBDIR {}\n", subdir.substr(1)); }
+
+  std::string prepare;
+  if (auto cmake_lists = packages.cmake_lists[id]) {
+    prepare += fmt::format("configure_file(\"{}\" \"${{DEPMGR_SUPERBUILD_DIR}}/{}/CMakeLists.txt\" @ONLY)\n",
+      packages.manifest_relative(id, *cmake_lists),
+      name);
+    patch_steps.push_back(fmt::format("\"${{CMAKE_COMMAND}}\" -E copy \"${{DEPMGR_SUPERBUILD_DIR}}/{}/CMakeLists.txt\" "
+                                      "\"<SOURCE_DIR>{}/CMakeLists.txt\"",
+      name,
+      subdir));
+  }
+  if (!patch_steps.empty()) { arguments += fmt::format("  PATCH_COMMAND {}\n", fmt::join(patch_steps, " COMMAND ")); }
+
+  if (packages.options[id] != nullptr) {
+    std::string defines;
+    for (const auto &option : cmake_option_list(*packages.options[id]).options) {
+      defines += fmt::format(" \"-D{}={}\"", option.name, option.value());
+    }
+    arguments += fmt::format("  CMAKE_ARGS{}\n", defines);
+  }
+
+  std::string depends;
+  for (package_id dependency : packages.depends[id]) { depends += fmt::format(" {}", packages.names[dependency]); }
+  if (!depends.empty()) { arguments += fmt::format("  DEPENDS{}\n", depends); }
+
+  fmt::format_to(std::back_inserter(out),
+    "\n"
+    "{prepare}"
+    "ExternalProject_Add(\n"
+    "  {package}\n"
+    "{source}"
+    "  PREFIX \"${{DEPMGR_SUPERBUILD_DIR}}/{package}\"\n"
+    "  INSTALL_DIR \"${{DEPMGR_SUPERBUILD_PREFIX}}\"\n"
+    "{arguments}"
+    "  CMAKE_CACHE_ARGS\n"
+    "    ${{DEPMGR_SUPERBUILD_CACHE_ARGS}}\n"
+    "    \"-DCMAKE_INSTALL_PREFIX:PATH=${{DEPMGR_SUPERBUILD_PREFIX}}\"\n"
+    ")\n"
+    "list(APPEND DEPMGR_SUPERBUILD_TARGETS {package})\n",
+    fmt::arg("package", name),
+    fmt::arg("prepare", prepare),
+    fmt::arg("source", source),
+    fmt::arg("arguments", arguments));
+}
+
+/// Sets up the superbuild. The install prefix, the cache arguments passing
+/// the toolchain on and the list of dependency targets are left to the
+/// including project, which builds itself as the last ExternalProject.
+static void write_superbuild_header(fmt::memory_buffer &out)
+{
+  fmt::format_to(std::back_inserter(out),
+    "include(ExternalProject)\n"
+    "block(SCOPE_FOR VARIABLES POLICIES"
+    " PROPAGATE DEPMGR_SUPERBUILD_PREFIX DEPMGR_SUPERBUILD_CACHE_ARGS DEPMGR_SUPERBUILD_TARGETS)\n"
+    "set(DEPMGR_SUPERBUILD_DIR \"${{CMAKE_BINARY_DIR}}/_depmgr_superbuild\")\n"
+    "if(NOT DEFINED DEPMGR_SUPERBUILD_PREFIX)\n"
+    "  set(DEPMGR_SUPERBUILD_PREFIX \"${{DEPMGR_SUPERBUILD_DIR}}/install\")\n"
+    "endif()\n"
+    "set(DEPMGR_SUPERBUILD_CACHE_ARGS \"-DCMAKE_PREFIX_PATH:PATH=${{DEPMGR_SUPERBUILD_PREFIX}}\")\n"
+    "foreach(variable IN ITEMS CMAKE_BUILD_TYPE CMAKE_TOOLCHAIN_FILE CMAKE_MAKE_PROGRAM CMAKE_C_COMPILER"
+    " CMAKE_CXX_COMPILER)\n"
+    "  if(${{variable}})\n"
+    "    list(APPEND DEPMGR_SUPERBUILD_CACHE_ARGS \"-D${{variable}}:STRING=${{${{variable}}}}\")\n"
+    "  endif()\n"
+    "endforeach()\n"
+    "set(DEPMGR_SUPERBUILD_TARGETS \"\")\n");
+}
+
+/// Functions deciding whether a package's sources need patching and
+/// configuring again. The stamp holds a hash of the source identity and every
+/// file the step reads, plus the modification time of the source directory
+/// once configured, which changes when it's populated again.
+static void write_stamp_functions(fmt::memory_buffer &out)
+{
+  fmt::format_to(std::back_inserter(out),
+    "function(depmgr_check_stamp package sources)\n"
+    "  set(hash \"${{sources}};${{${{package}}_SOURCE_DIR}}\")\n"
+    "  foreach(file IN LISTS ARGN)\n"
+    "    file(SHA256 \"${{file}}\" file_hash)\n"
+    "    string(APPEND hash \";${{file_hash}}\")\n"
+    "  endforeach()\n"
+    "  string(SHA256 hash \"${{hash}}\")\n"
+    "  set(stamp \"${{CMAKE_BINARY_DIR}}/_depmgr_stamps/${{package}}.stamp\")\n"
+    "  set(configured FALSE)\n"
+    "  if(EXISTS \"${{stamp}}\")\n"
+    "    file(READ \"${{stamp}}\" previous)\n"
+    "    file(TIMESTAMP \"${{${{package}}_SOURCE_DIR}}\" modified \"%s%f\" UTC)\n"
+    "    if(previous STREQUAL \"${{hash}} ${{modified}}\")\n"
+    "      set(configured TRUE)\n"
+    "    endif()\n"
+    "  endif()\n"
+    "  set(${{package}}_CONFIGURED ${{configured}} PARENT_SCOPE)\n"
+    "  set(DEPMGR_${{package}}_STAMP \"${{hash}}\" PARENT_SCOPE)\n"
+    "endfunction()\n"
+    "function(depmgr_write_stamp package)\n"
+    "  file(TIMESTAMP \"${{${{package}}_SOURCE_DIR}}\" modified \"%s%f\" UTC)\n"
+    "  file(WRITE \"${{CMAKE_BINARY_DIR}}/_depmgr_stamps/${{package}}.stamp\"\n"
+    "    \"${{DEPMGR_${{package}}_STAMP}} ${{modified}}\")\n"
+    "endfunction()\n");
+}
+
+/// Functions prebuilt packages are configured with. Artifacts are keyed by
+/// what depmgr knows about the package and by the toolchain, build type and
+/// target of the including project, then built and installed in a separate
+/// CMake run on a miss. Entries are published like source cache entries.
+static void write_artifact_functions(fmt::memory_buffer &out)
+{
+  dependency_cache cache(execution_context::get().dependency_cache_dir);
+  fmt::format_to(std::back_inserter(out),
+    "if(NOT DEFINED DEPMGR_ARTIFACT_DIR)\n"
+    "  set(DEPMGR_ARTIFACT_DIR \"{}\")\n"
+    "endif()\n"
+    "if(CMAKE_BUILD_TYPE)\n"
+    "  set(DEPMGR_BUILD_TYPE \"${{CMAKE_BUILD_TYPE}}\")\n"
+    "else()\n"
+    "  set(DEPMGR_BUILD_TYPE Release)\n"
+    "endif()\n"
+    "set(CMAKE_FIND_PACKAGE_TARGETS_GLOBAL ON)\n"
+    "function(depmgr_artifact_prefix out key)\n"
+    "  string(APPEND key \";${{CMAKE_SYSTEM_NAME}};${{CMAKE_SYSTEM_PROCESSOR}};${{DEPMGR_BUILD_TYPE}}\")\n"
+    "  foreach(language IN ITEMS C CXX)\n"
+    "    string(APPEND key \";${{CMAKE_${{language}}_COMPILER_ID}};${{CMAKE_${{language}}_COMPILER_VERSION}}\"\n"
+    "      \";${{CMAKE_${{language}}_COMPILER_TARGET}}\")\n"
+    "  endforeach()\n"
+    "  foreach(file IN LISTS ARGN)\n"
+    "    file(SHA256 \"${{file}}\" hash)\n"
+    "    string(APPEND key \";${{hash}}\")\n"
+    "  endforeach()\n"
+    "  string(SHA256 key \"${{key}}\")\n"
+    "  set(${{out}} \"${{DEPMGR_ARTIFACT_DIR}}/${{key}}\" PARENT_SCOPE)\n"
+    "endfunction()\n"
+    "function(depmgr_build_artifact package source_dir prefix dependency_prefixes)\n"
+    "  string(RANDOM LENGTH 8 suffix)\n"
+    "  set(staging \"${{prefix}}.${{suffix}}\")\n"
+    "  set(build_dir \"${{CMAKE_BINARY_DIR}}/_depmgr_artifacts/${{package}}\")\n"
+    "  set(arguments -G \"${{CMAKE_GENERATOR}}\" \"-DCMAKE_BUILD_TYPE=${{DEPMGR_BUILD_TYPE}}\""
+    " \"-DCMAKE_INSTALL_PREFIX=${{staging}}\")\n"
+    "  if(CMAKE_GENERATOR_PLATFORM)\n"
+    "    list(APPEND arguments -A \"${{CMAKE_GENERATOR_PLATFORM}}\")\n"
+    "  endif()\n"
+    "  if(CMAKE_GENERATOR_TOOLSET)\n"
+    "    list(APPEND arguments -T \"${{CMAKE_GENERATOR_TOOLSET}}\")\n"
+    "  endif()\n"
+    "  foreach(variable IN ITEMS CMAKE_TOOLCHAIN_FILE CMAKE_MAKE_PROGRAM CMAKE_C_COMPILER CMAKE_CXX_COMPILER)\n"
+    "    if(${{variable}})\n"
+    "      list(APPEND arguments \"-D${{variable}}=${{${{variable}}}}\")\n"
+    "    endif()\n"
+    "  endforeach()\n"
+    "  message(STATUS \"Building dependency artifact: ${{package}}\")\n"
+    "  file(REMOVE_RECURSE \"${{build_dir}}\")\n"
+    "  set(prefix_path ${{dependency_prefixes}} ${{CMAKE_PREFIX_PATH}})\n"
+    "  execute_process(COMMAND \"${{CMAKE_COMMAND}}\" -S \"${{source_dir}}\" -B \"${{build_dir}}\"\n"
+    "    ${{arguments}} \"-DCMAKE_PREFIX_PATH=${{prefix_path}}\" ${{ARGN}} COMMAND_ERROR_IS_FATAL ANY)\n"
+    "  execute_process(COMMAND \"${{CMAKE_COMMAND}}\" --build \"${{build_dir}}\"\n"
+    "    --config \"${{DEPMGR_BUILD_TYPE}}\" --parallel COMMAND_ERROR_IS_FATAL ANY)\n"
+    "  execute_process(COMMAND \"${{CMAKE_COMMAND}}\" --install \"${{build_dir}}\"\n"
+    "    --config \"${{DEPMGR_BUILD_TYPE}}\" COMMAND_ERROR_IS_FATAL ANY)\n"
+    "  file(TOUCH \"${{staging}}/.depmgr-complete\")\n"
+    "  # Fails when an identical build published first, its artifact is kept.\n"
+    "  file(RENAME \"${{staging}}\" \"${{prefix}}\" RESULT result)\n"
+    "  if(NOT result EQUAL 0)\n"
+    "    file(REMOVE_RECURSE \"${{staging}}\")\n"
+    "  endif()\n"
+    "endfunction()\n",
+    cache.artifact_root().generic_string());
+}
+
+static void write_script_header(fmt::memory_buffer &out, const package_table &packages)
+{
+  if (execution_context::get().superbuild) return write_superbuild_header(out);
+
+  fmt::format_to(std::back_inserter(out),
+    "include(FetchContent)\n"
+    "block(SCOPE_FOR VARIABLES POLICIES)\n");
+  // Every source dir is overridden, FetchContent must not try any remote.
+  if (execution_context::get().offline) {
+    fmt::format_to(std::back_inserter(out), "set(FETCHCONTENT_FULLY_DISCONNECTED ON)\n");
+  }
+  write_stamp_functions(out);
+  if (std::any_of(packages.prebuilt.begin(), packages.prebuilt.end(), [](auto &name) { return name.has_value(); })) {
+    write_artifact_functions(out);
+  }
+  if (!execution_context::get().emit_timing) return;
+
+  // Timestamps are microseconds since the epoch, phases are keyed by package
+  // so the start survives the scopes add_subdirectory opens.
+  fmt::format_to(std::back_inserter(out),
+    "function(depmgr_timing_begin package phase)\n"
+    "  string(TIMESTAMP now \"%s%f\" UTC)\n"
+    "  set_property(GLOBAL PROPERTY DEPMGR_TIMING_${{package}}_${{phase}} ${{now}})\n"
+    "endfunction()\n"
+    "function(depmgr_timing_end package phase)\n"
+    "  string(TIMESTAMP now \"%s%f\" UTC)\n"
+    "  get_property(start GLOBAL PROPERTY DEPMGR_TIMING_${{package}}_${{phase}})\n"
+    "  math(EXPR elapsed \"${{now}} - ${{start}}\")\n"
+    "  set_property(GLOBAL APPEND PROPERTY DEPMGR_TIMINGS \"${{elapsed}} ${{package}} ${{phase}}\")\n"
+    "endfunction()\n"
+    "function(depmgr_timing_report file)\n"
+    "  get_property(timings GLOBAL PROPERTY DEPMGR_TIMINGS)\n"
+    "  list(SORT timings COMPARE NATURAL ORDER DESCENDING)\n"
+    "  set(total 0)\n"
+    "  set(json \"\")\n"
+    "  message(STATUS \"Dependency configure times:\")\n"
+    "  foreach(entry IN LISTS timings)\n"
+    "    string(REPLACE \" \" \";\" fields \"${{entry}}\")\n"
+    "    list(GET fields 0 elapsed)\n"
+    "    list(GET fields 1 package)\n"
+    "    list(GET fields 2 phase)\n"
+    "    math(EXPR total \"${{total}} + ${{elapsed}}\")\n"
+    "    math(EXPR ms \"${{elapsed}} / 1000\")\n"
+    "    math(EXPR fraction \"${{elapsed}} % 1000 + 1000\")\n"
+    "    string(SUBSTRING \"${{fraction}}\" 1 3 fraction)\n"
+    "    message(STATUS \"  ${{ms}}.${{fraction}} ms  ${{package}} ${{phase}}\")\n"
+    "    if(json)\n"
+    "      string(APPEND json \",\\n\")\n"
+    "    endif()\n"
+    "    string(APPEND json\n"
+    "      \"  {{\\\"package\\\": \\\"${{package}}\\\", \\\"phase\\\": \\\"${{phase}}\\\", "
+    "\\\"microseconds\\\": ${{elapsed}}}}\")\n"
+    "  endforeach()\n"
+    "  math(EXPR ms \"${{total}} / 1000\")\n"
+    "  message(STATUS \"  ${{ms}} ms in total, written to ${{file}}\")\n"
+    "  file(WRITE \"${{file}}\" \"[\\n${{json}}\\n]\\n\")\n"
+    "endfunction()\n");
+}
+
+static void write_script_footer(fmt::memory_buffer &out)
+{
+  if (execution_context::get().emit_timing) {
+    fmt::format_to(std::back_inserter(out),
+      "cmake_path(REPLACE_EXTENSION CMAKE_CURRENT_LIST_FILE LAST_ONLY \".timing.json\""
+      " OUTPUT_VARIABLE DEPMGR_TIMING_FILE)\n"
+      "depmgr_timing_report(\"${{DEPMGR_TIMING_FILE}}\")\n");
+  }
+  fmt::format_to(std::back_inserter(out), "endblock()\n");
+}
+
+void write_cmake_script(fmt::memory_buffer &out, const package_table &packages)
+{
+  trace_span span("emit script");
+  write_script_header(out, packages);
+
+  if (execution_context::get().superbuild) {
+    for (package_id id = 0; id < packages.size(); id++) { write_superbuild_rules(packages, id, out); }
+    write_script_footer(out);
+    return;
+  }
+
+  for (package_id id = 0; id < packages.size(); id++) { write_source_override(packages, id, out); }
+
+  // Declarations don't depend on each other, so they're written kind by kind.
+  for (const auto &row : packages.local) { write_fetch_rules(packages, row, out); }
+  for (const auto &row : packages.svn) { write_fetch_rules(packages, row, out); }
+  for (const auto &row : packages.git) { write_fetch_rules(packages, row, out); }
+  for (const auto &row : packages.hg) { write_fetch_rules(packages, row, out); }
+  for (const auto &row : packages.cvs) { write_fetch_rules(packages, row, out); }
+  for (const auto &row : packages.url) { write_fetch_rules(packages, row, out); }
+
+  for (package_id id = 0; id < packages.size(); id++) { write_configure_rules(packages, id, out); }
+
+  write_script_footer(out);
+}
+
+package_script render_package(const package_table &packages, package_id id)
+{
+  trace_span span("render package", packages.names[id]);
+  fmt::memory_buffer out;
+  package_script result;
+
+  // Superbuild rules don't declare or override anything, they're all in the
+  // last part.
+  if (execution_context::get().superbuild) {
+    write_superbuild_rules(packages, id, out);
+    result.configure_rules = fmt::to_string(out);
+    return result;
+  }
+
+  write_source_override(packages, id, out);
+  result.source_override = fmt::to_string(out);
+
+  out.clear();
+  visit_row(packages, id, [&](const auto &row) { write_fetch_rules(packages, row, out); });
+  result.fetch_rules = fmt::to_string(out);
+
+  out.clear();
+  write_configure_rules(packages, id, out);
+  result.configure_rules = fmt::to_string(out);
+  return result;
+}
+
+void write_cmake_script(fmt::memory_buffer &out,
+  const package_table &packages,
+  const std::vector<const package_script *> &scripts)
+{
+  trace_span span("emit script");
+  auto append = [&out](const std::string &text) { out.append(text.data(), text.data() + text.size()); };
+
+  write_script_header(out, packages);
+
+  for (package_id id = 0; id < packages.size(); id++) { append(scripts[id]->source_override); }
+
+  for (const auto &row : packages.local) { append(scripts[row.id]->fetch_rules); }
+  for (const auto &row : packages.svn) { append(scripts[row.id]->fetch_rules); }
+  for (const auto &row : packages.git) { append(scripts[row.id]->fetch_rules); }
+  for (const auto &row : packages.hg) { append(scripts[row.id]->fetch_rules); }
+  for (const auto &row : packages.cvs) { append(scripts[row.id]->fetch_rules); }
+  for (const auto &row : packages.url) { append(scripts[row.id]->fetch_rules); }
+
+  for (package_id id = 0; id < packages.size(); id++) { append(scripts[id]->configure_rules); }
+
+  write_script_footer(out);
+}
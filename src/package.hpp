@@ -0,0 +1,238 @@
+#ifndef _DEPMGR_PACKAGE_HPP_
+#define _DEPMGR_PACKAGE_HPP_
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "cache.hpp"
+#include "git.hpp"
+#include "lockfile.hpp"
+#include "manifest.hpp"
+#include "toml.hpp"
+#include "vendor.hpp"
+
+enum class remote_kind : uint8_t { LOCAL, SVN, GIT, HG, CVS, URL };
+
+const char *kind_name(remote_kind kind);
+std::optional<remote_kind> infer_kind(const toml_node *config);
+
+/// Index of a package in its package_table.
+using package_id = uint32_t;
+
+/// Manifest a package was declared in. Paths in nested manifests are resolved
+/// against its directory, paths in the root manifest are left relative to the
+/// including CMakeLists.txt.
+struct package_origin
+{
+  std::filesystem::path manifest_dir;
+  bool nested = false;
+};
+
+// Kind specific columns. Strings and arrays borrow from the manifest document.
+
+struct local_package
+{
+  package_id id;
+  std::string_view path;
+};
+
+struct svn_package
+{
+  package_id id;
+  std::string_view repo;
+  std::optional<std::string_view> revision;
+};
+
+struct git_package
+{
+  package_id id;
+  std::string_view repo;
+  std::optional<std::string_view> tag;
+  /// Name of the remote in checkouts, `origin` by default. A URL is taken
+  /// as another mirror of `repo`, as older manifests meant it.
+  std::optional<std::string_view> remote;
+  /// Other URLs of `repo`, raced against it when depmgr fetches.
+  const toml_node *mirrors = nullptr;
+  const toml_node *submodules = nullptr;
+  /// Paths checked out when depmgr fetches the package, the first one is
+  /// the subtree that's added to the build.
+  const toml_node *sparse_paths = nullptr;
+  std::optional<git_revision> locked;
+};
+
+struct hg_package
+{
+  package_id id;
+  std::string_view repo;
+  std::optional<std::string_view> tag;
+};
+
+struct cvs_package
+{
+  package_id id;
+  std::string_view repo;
+  std::optional<std::string_view> mod;
+  std::optional<std::string_view> tag;
+};
+
+struct url_package
+{
+  package_id id;
+  std::string_view remote;
+  /// Other URLs of the same archive, raced against `remote` when depmgr
+  /// fetches and passed on to CMake as fallbacks.
+  const toml_node *mirrors = nullptr;
+  std::optional<std::string_view> hash;
+  std::optional<std::string_view> download_name;
+  std::optional<std::string_view> username;
+  std::optional<std::string_view> password;
+  const toml_node *headers = nullptr;
+  std::optional<std::string_view> ca_file;
+};
+
+/// Every package of one or more manifests. Fields shared by all kinds are
+/// stored column-wise and indexed by package_id, kind specific ones live in
+/// per-kind columns that `rows` points into, so passes over the table are
+/// plain loops without per-package allocations or virtual dispatch.
+///
+/// The table borrows from the documents it was parsed from, they have to
+/// outlive it.
+class package_table
+{
+public:
+  std::vector<std::string_view> names;
+  std::vector<remote_kind> kinds;
+  std::vector<uint32_t> rows;
+  std::vector<uint32_t> origins;
+  /// Table each package was declared with.
+  std::vector<const toml_node *> configs;
+  std::vector<std::optional<std::string_view>> configure;
+  std::vector<std::optional<std::string_view>> cmake_lists;
+  std::vector<const toml_node *> options;
+  std::vector<const toml_node *> advanced_variables;
+  /// Sources are taken from the manifest's vendor pack when it has them.
+  std::vector<uint8_t> vendor;
+  /// CMake package imported from the artifact cache instead of building the
+  /// dependency in the tree.
+  std::vector<std::optional<std::string_view>> prebuilt;
+  /// Packages declared in each package's nested manifest, which it needs
+  /// built first. Filled in when a dependency graph is merged into one table.
+  std::vector<std::vector<package_id>> depends;
+  /// Patch files applied to the fetched sources, in order.
+  std::vector<const toml_node *> patches;
+  /// is_prepared and patch_set_hash of every package, filled in by
+  /// settle_sources. Empty while sources are still being prepared.
+  std::vector<uint8_t> prepared;
+  std::vector<std::string> patch_set_hashes;
+
+  std::vector<package_origin> manifests;
+  /// Where sources are prepared, `_depmgr` next to the output. Tables of
+  /// nested manifests share the one of the table they were found through.
+  std::filesystem::path work_dir;
+
+  std::vector<local_package> local;
+  std::vector<svn_package> svn;
+  std::vector<git_package> git;
+  std::vector<hg_package> hg;
+  std::vector<cvs_package> cvs;
+  std::vector<url_package> url;
+
+  size_t size() const { return names.size(); }
+  void reserve(size_t count);
+
+  uint32_t add_origin(package_origin origin);
+  package_id add(std::string_view name, const toml_node &config, uint32_t origin);
+  /// Copies package `id` of `other` to the end of this table, declared in
+  /// `origin` of this table.
+  package_id append(const package_table &other, package_id id, uint32_t origin);
+
+  std::string upper_name(package_id id) const;
+  std::string manifest_relative(package_id id, std::string_view path) const;
+  /// Patch files of package `id`, resolved against its manifest.
+  std::vector<std::filesystem::path> patch_files(package_id id) const;
+  /// Hash of the contents of every patch of package `id`, in order. Empty
+  /// when it has none.
+  std::string patch_set_hash(package_id id) const;
+  std::filesystem::path stamp_path(package_id id) const;
+
+  /// Directory sources are prepared in by `depmgr fetch`.
+  std::filesystem::path source_dir(package_id id) const;
+
+  /// Source tree to look for a nested dependencies.toml in, if it's on disk.
+  std::optional<std::filesystem::path> nested_manifest_root(package_id id) const;
+
+  /// Identifies the fetched revision. Packages without a stamp can't be
+  /// fetched by depmgr and are left to FetchContent.
+  std::optional<std::string> fetch_stamp(package_id id) const;
+  bool is_prepared(package_id id) const;
+  /// Reads the stamp and hashes the patches of every package once, for the
+  /// passes over a table whose sources won't be prepared again. Rendering
+  /// and fingerprinting each ask for both per package.
+  void settle_sources();
+  void prepare(package_id id) const;
+  /// Prepares the sources from the dependency cache if they're already in it,
+  /// without touching the network.
+  bool prepare_from_cache(package_id id) const;
+  /// Prepares the sources of a vendored package from `pack` if it has them
+  /// at the requested revision.
+  bool prepare_from_pack(package_id id, const vendor_pack &pack) const;
+  /// Why the sources of package `id` aren't on disk, for --offline.
+  std::optional<std::string> offline_problem(package_id id) const;
+
+  /// Resolves the requested revision to an immutable one for `depmgr lock`.
+  std::optional<lock_entry> resolve(package_id id) const;
+  void apply_lock(const lockfile &lock);
+
+  /// Cache entry the sources come from, if it can be known without network.
+  std::optional<cache_key> cache_identity(package_id id) const;
+
+  resolved_package resolve_manifest(package_id id) const;
+
+  /// Packages with equal identities fetch the same sources.
+  std::string identity(package_id id) const;
+
+  /// Everything about a prebuilt package's build that depmgr knows: sources,
+  /// options and the host, and the same of every package it depends on. The
+  /// configure-time half (compiler, build type, target) is added by the
+  /// generated script. None for packages that aren't prebuilt or when any of
+  /// those sources aren't pinned.
+  std::optional<std::string> artifact_identity(package_id id) const;
+};
+
+/// Hash of the contents of `patches`, in order.
+std::string patch_set_hash(const std::vector<std::filesystem::path> &patches);
+
+/// The first error parse_packages would fail on, for callers that can't
+/// afford to terminate on a broken manifest.
+std::optional<std::string> find_package_error(const toml_node &config);
+
+/// Parses every dependency table in `config`.
+package_table parse_packages(const toml_node &config, const std::filesystem::path &manifest_dir, bool nested);
+
+/// Writes the FetchContent script for `packages`. Packages are configured in
+/// table order.
+void write_cmake_script(fmt::memory_buffer &out, const package_table &packages);
+
+/// Rules of a single package, in the three places they go in the script.
+struct package_script
+{
+  std::string source_override;
+  std::string fetch_rules;
+  std::string configure_rules;
+};
+
+package_script render_package(const package_table &packages, package_id id);
+
+/// Writes the same script as above from rules rendered ahead of time,
+/// `scripts[id]` for every package.
+void write_cmake_script(fmt::memory_buffer &out,
+  const package_table &packages,
+  const std::vector<const package_script *> &scripts);
+
+#endif /* _DEPMGR_PACKAGE_HPP_ */
@@ -1,2 +1,7 @@
 #include "state.hpp"
 
+execution_context &execution_context::get()
+{
+  static execution_context context;
+  return context;
+}
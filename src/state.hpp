@@ -2,14 +2,32 @@
 #define _DEPMGR_STATE_HPP_
 
 #include <filesystem>
+#include <thread>
 
 struct execution_context
 {
   std::filesystem::path self_path;
-  std::filesystem::path work_dir;
   std::filesystem::path dependency_cache_dir;
+  /// Where `depmgr daemon` listens for queries, next to the output if empty.
+  std::filesystem::path socket_path;
+  /// Chrome trace-event file to record spans in, none if empty.
+  std::filesystem::path trace_path;
 
-  execution_context &get();
+  size_t jobs = std::thread::hardware_concurrency();
+  /// Mirrors of one remote contacted at once, the rest are fallbacks.
+  size_t mirror_race = 2;
+
+  bool emit_json = false;
+  bool emit_binary = false;
+  /// Only uses sources that are already prepared or cached.
+  bool offline = false;
+  /// Makes the generated script time each package's configure phases.
+  bool emit_timing = false;
+  /// Builds every package as its own ExternalProject instead of adding it to
+  /// the including project.
+  bool superbuild = false;
+
+  static execution_context &get();
 };
 
 #endif /* _DEPMGR_STATE_HPP_ */
@@ -0,0 +1,40 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+static thread_local bool is_worker = false;
+
+thread_pool::thread_pool(size_t worker_count)
+{
+  worker_count = std::max<size_t>(worker_count, 1);
+  workers.reserve(worker_count);
+  for (size_t i = 0; i < worker_count; i++) { workers.emplace_back([this]() { run(); }); }
+}
+
+thread_pool::~thread_pool()
+{
+  {
+    std::lock_guard guard(lock);
+    stopping = true;
+  }
+  task_ready.notify_all();
+  for (auto &worker : workers) { worker.join(); }
+}
+
+bool thread_pool::on_worker() { return is_worker; }
+
+void thread_pool::run()
+{
+  is_worker = true;
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock guard(lock);
+      task_ready.wait(guard, [this]() { return stopping || !tasks.empty(); });
+      if (tasks.empty()) { return; }
+      task = std::move(tasks.front());
+      tasks.pop();
+    }
+    task();
+  }
+}
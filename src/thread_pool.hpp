@@ -0,0 +1,55 @@
+#ifndef _DEPMGR_THREAD_POOL_HPP_
+#define _DEPMGR_THREAD_POOL_HPP_
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/// Fixed size worker pool. Tasks are run in submission order by the first
+/// idle worker; the destructor drains the queue before joining.
+class thread_pool
+{
+  std::vector<std::thread> workers;
+  std::queue<std::function<void()>> tasks;
+
+  std::mutex lock;
+  std::condition_variable task_ready;
+  bool stopping = false;
+
+  void run();
+
+public:
+  explicit thread_pool(size_t worker_count);
+  ~thread_pool();
+
+  thread_pool(const thread_pool &) = delete;
+  thread_pool &operator=(const thread_pool &) = delete;
+
+  template<typename F> std::future<std::invoke_result_t<F>> submit(F &&task)
+  {
+    using result_t = std::invoke_result_t<F>;
+    auto packaged = std::make_shared<std::packaged_task<result_t()>>(std::forward<F>(task));
+    auto result = packaged->get_future();
+    {
+      std::lock_guard guard(lock);
+      tasks.emplace([packaged]() { (*packaged)(); });
+    }
+    task_ready.notify_one();
+    return result;
+  }
+
+  size_t size() const { return workers.size(); }
+
+  /// Whether the calling thread is a worker of any pool. Work that would fan
+  /// out onto a pool of its own runs inline there instead, otherwise nested
+  /// pools multiply the threads --jobs asked for.
+  static bool on_worker();
+};
+
+#endif /* _DEPMGR_THREAD_POOL_HPP_ */
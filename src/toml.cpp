@@ -0,0 +1,227 @@
+#include "toml.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "trace.hpp"
+
+namespace fs = std::filesystem;
+
+static size_t count_array_nodes(const toml_array_t *array);
+
+static size_t count_table_nodes(const toml_table_t *table)
+{
+  size_t result = 0;
+  for (int i = 0; const char *key = toml_key_in(table, i); i++) {
+    result++;
+    if (const toml_array_t *array = toml_array_in(table, key)) {
+      result += count_array_nodes(array);
+    } else if (const toml_table_t *child = toml_table_in(table, key)) {
+      result += count_table_nodes(child);
+    }
+  }
+  return result;
+}
+
+static size_t count_array_nodes(const toml_array_t *array)
+{
+  size_t result = 0;
+  for (int i = 0; i < toml_array_nelem(array); i++) {
+    result++;
+    if (const toml_array_t *child = toml_array_at(array, i)) {
+      result += count_array_nodes(child);
+    } else if (const toml_table_t *child = toml_table_at(array, i)) {
+      result += count_table_nodes(child);
+    }
+  }
+  return result;
+}
+
+std::optional<toml_document> toml_document::build(std::string source, std::string &error)
+{
+  trace_span span("parse toml");
+  toml_document document(std::move(source));
+  char err[256];
+  toml_table_t *root = toml_parse(document.source_text.data(), err, sizeof(err));
+  if (root == nullptr) {
+    error = err;
+    return std::nullopt;
+  }
+
+  // Nodes hold pointers to their children, so the vector must never grow
+  // past what's reserved here.
+  document.nodes.reserve(1 + count_table_nodes(root));
+  document.build_table(document.nodes.emplace_back(), root);
+
+  toml_free(root);
+  return document;
+}
+
+std::optional<toml_document> toml_document::load(const fs::path &path)
+{
+  auto source = read_file(path);
+  if (!source.has_value()) { return std::nullopt; }
+
+  std::string error;
+  auto document = build(std::move(*source), error);
+  if (!document.has_value()) { critical_error("can't parse {}: {}", path.string(), error); }
+  return document;
+}
+
+std::optional<toml_document> toml_document::try_load(const fs::path &path, std::string &error)
+{
+  auto source = read_file(path);
+  if (!source.has_value()) {
+    error = "can't read file";
+    return std::nullopt;
+  }
+  return build(std::move(*source), error);
+}
+
+toml_document toml_document::parse(std::string contents, std::string_view origin)
+{
+  std::string error;
+  auto document = build(std::move(contents), error);
+  if (!document.has_value()) { critical_error("can't parse {}: {}", origin, error); }
+  return std::move(*document);
+}
+
+std::string_view toml_document::store(std::string_view value)
+{
+  size_t needed = value.size() + 1;
+  if (arena_capacity - arena_used < needed) {
+    // Keys and decoded strings rarely add up to more than the source text, so
+    // the first chunk usually holds the whole document.
+    size_t capacity = std::max(needed, arena.empty() ? source().size() + 1 : size_t(64 * 1024));
+    arena.emplace_back(new char[capacity]);
+    arena_used = 0;
+    arena_capacity = capacity;
+  }
+
+  char *dest = arena.back().get() + arena_used;
+  std::memcpy(dest, value.data(), value.size());
+  dest[value.size()] = '\0';
+  arena_used += needed;
+  return std::string_view(dest, value.size());
+}
+
+void toml_document::build_table(toml_node &node, const toml_table_t *table)
+{
+  node.type = toml_type::TABLE;
+
+  size_t first = nodes.size();
+  for (int i = 0; const char *key = toml_key_in(table, i); i++) { nodes.emplace_back().key = store(key); }
+  node.children = nodes.data() + first;
+  node.count = nodes.size() - first;
+
+  for (size_t i = first; i < first + node.count; i++) {
+    toml_node &child = nodes[i];
+    const char *key = child.key.data();
+    if (toml_raw_t raw = toml_raw_in(table, key)) {
+      build_scalar(child, raw);
+    } else if (const toml_array_t *array = toml_array_in(table, key)) {
+      build_array(child, array);
+    } else if (const toml_table_t *nested = toml_table_in(table, key)) {
+      build_table(child, nested);
+    }
+  }
+}
+
+void toml_document::build_array(toml_node &node, const toml_array_t *array)
+{
+  node.type = toml_type::ARRAY;
+
+  size_t first = nodes.size();
+  int len = toml_array_nelem(array);
+  for (int i = 0; i < len; i++) { nodes.emplace_back(); }
+  node.children = nodes.data() + first;
+  node.count = size_t(len);
+
+  for (int i = 0; i < len; i++) {
+    toml_node &element = nodes[first + i];
+    if (toml_raw_t raw = toml_raw_at(array, i)) {
+      build_scalar(element, raw);
+    } else if (const toml_array_t *nested = toml_array_at(array, i)) {
+      build_array(element, nested);
+    } else if (const toml_table_t *table = toml_table_at(array, i)) {
+      build_table(element, table);
+    }
+  }
+}
+
+void toml_document::build_scalar(toml_node &node, toml_raw_t raw)
+{
+  std::string_view token(raw);
+
+  if (raw[0] == '"' || raw[0] == '\'') {
+    node.type = toml_type::STRING;
+
+    // Single line strings without escapes are their own value, everything
+    // else goes through tomlc99 to be decoded.
+    bool multiline = token.size() >= 6 && token[1] == raw[0] && token[2] == raw[0];
+    bool escaped = raw[0] == '"' && token.find('\\') != std::string_view::npos;
+    if (!multiline && !escaped) {
+      node.text = store(token.substr(1, token.size() - 2));
+      return;
+    }
+
+    char *decoded;
+    if (toml_rtos(raw, &decoded) != 0) { critical_error("invalid string value: {}", token); }
+    node.text = store(decoded);
+    std::free(decoded);
+    return;
+  }
+
+  node.text = store(token);
+
+  int boolean;
+  toml_timestamp_t ts;
+  if (toml_rtob(raw, &boolean) == 0) {
+    node.type = toml_type::BOOLEAN;
+    node.boolean = boolean != 0;
+  } else if (toml_rtoi(raw, &node.integer) == 0) {
+    node.type = toml_type::INTEGER;
+    node.number = double(node.integer);
+  } else if (toml_rtod(raw, &node.number) == 0) {
+    node.type = toml_type::FLOAT;
+  } else if (toml_rtots(raw, &ts) == 0) {
+    node.type = toml_type::TIMESTAMP;
+  } else {
+    critical_error("unsupported value: {}", token);
+  }
+}
+
+std::optional<std::string_view> toml_closest_key(std::string_view key, const std::string_view *keys, size_t count)
+{
+  // Edit distance, with a transposition counting as one edit since swapped
+  // letters are the most common typo.
+  auto distance = [](std::string_view a, std::string_view b) {
+    std::vector<size_t> previous(b.size() + 1), current(b.size() + 1), before(b.size() + 1);
+    for (size_t j = 0; j <= b.size(); j++) { current[j] = j; }
+    for (size_t i = 1; i <= a.size(); i++) {
+      before.swap(previous);
+      previous.swap(current);
+      current[0] = i;
+      for (size_t j = 1; j <= b.size(); j++) {
+        size_t cost = a[i - 1] == b[j - 1] ? 0 : 1;
+        current[j] = std::min({previous[j] + 1, current[j - 1] + 1, previous[j - 1] + cost});
+        if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1]) {
+          current[j] = std::min(current[j], before[j - 2] + 1);
+        }
+      }
+    }
+    return current[b.size()];
+  };
+
+  std::optional<std::string_view> closest;
+  size_t best = std::max<size_t>(1, key.size() / 3) + 1;
+  for (size_t i = 0; i < count; i++) {
+    size_t d = distance(key, keys[i]);
+    if (d < best) {
+      best = d;
+      closest = keys[i];
+    }
+  }
+  return closest;
+}
@@ -1,14 +1,22 @@
 #ifndef _DEPMGR_TOML_HPP_
 #define _DEPMGR_TOML_HPP_
 
+#include <array>
 #include <chrono>
+#include <cstdint>
 #include <ctime>
 #include <filesystem>
+#include <memory>
+#include <initializer_list>
 #include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
 #include <type_traits>
 #include <vector>
 
 #include "toml.h"
+#include "util.hpp"
 
 template<class T, typename Alloc = std::allocator<T>> struct is_vector
 {
@@ -36,99 +44,271 @@ template<class Clock> struct is_time_point<std::chrono::time_point<Clock>>
   static bool const value = true;
 };
 
-inline bool toml_has_key(const toml_table_t *table, const char *key)
-{
-  if (toml_raw_in(table, key) != nullptr) {
-    return true;
-  } else if (toml_array_in(table, key) != nullptr) {
-    return true;
-  } else if (toml_table_in(table, key) != nullptr) {
-    return true;
-  }
-  return false;
-}
+template<class T> inline constexpr bool dependent_false = false;
 
 template<typename Clock> inline std::chrono::time_point<Clock> toml_timestamp_to_chrono(const toml_timestamp_t *ts)
 {
   std::tm tm = {
-    /* .tm_sec  = */ *ts->second,
-    /* .tm_min  = */ *ts->minute,
-    /* .tm_hour = */ *ts->hour,
-    /* .tm_mday = */ *ts->day,
-    /* .tm_mon  = */ *ts->month - 1,
-    /* .tm_year = */ *ts->year - 1900,
+    /* .tm_sec  = */ ts->second ? *ts->second : 0,
+    /* .tm_min  = */ ts->minute ? *ts->minute : 0,
+    /* .tm_hour = */ ts->hour ? *ts->hour : 0,
+    /* .tm_mday = */ ts->day ? *ts->day : 1,
+    /* .tm_mon  = */ ts->month ? *ts->month - 1 : 0,
+    /* .tm_year = */ ts->year ? *ts->year - 1900 : 70,
   };
   tm.tm_isdst = -1;// Use DST value from local time zone
   auto result = Clock::from_time_t(std::mktime(&tm));
-  return result + std::chrono::milliseconds(*ts->millisec);
+  return result + std::chrono::milliseconds(ts->millisec ? *ts->millisec : 0);
 }
 
-template<typename Item> inline std::optional<std::vector<Item>> toml_array_to_vec(const toml_array_t *array)
+enum class toml_type : uint8_t { STRING, BOOLEAN, INTEGER, FLOAT, TIMESTAMP, ARRAY, TABLE };
+
+/// A value in a toml_document. Strings are decoded once into the document
+/// arena and NUL-terminated there; other scalars keep their source token in
+/// `text` next to the converted value. Tables and arrays own a contiguous run
+/// of child nodes, array elements have an empty key.
+struct toml_node
 {
-  if (array == nullptr) return std::nullopt;
-  std::vector<Item> result;
-  size_t len = toml_array_nelem(array);
-  result.reserve(len);
-  for (size_t i = 0; i < len; i++) {
-    auto raw = toml_raw_at(array, i);
-    Item it;
-    if constexpr (std::is_same_v<Item, std::string> || std::is_same_v<Item, std::filesystem::path>) {
-      char *value;
-      if (toml_rtos(raw, &value) == 0) { it = Item(std::string(value)); }
-      delete value;
-    } else if constexpr (std::is_same_v<Item, char *>) {
-      char *value;
-      if (toml_rtos(raw, &value) == 0) { it = value; }
-      delete value;
-    } else if constexpr (std::is_same_v<Item, bool>) {
-      int value;
-      if (toml_rtob(raw, &value) == 0) { it = bool(value); }
-    } else if constexpr (std::is_integral_v<Item>) {
-      int64_t value;
-      if (toml_rtoi(raw, &value) == 0) { it = Item(value); }
-    } else if constexpr (std::is_floating_point_v<Item>) {
-      double value;
-      if (toml_rtod(raw, &value) == 0) { it = Item(value); }
-    } else if constexpr (std::is_same_v<Item, std::chrono::time_point<typename Item::clock>>) {
-      toml_timestamp_t value;
-      if (toml_rtots(raw, &value) == 0) { it = toml_timestamp_to_chrono<typename Item::clock>(&value); };
-    } else {
-      static_assert(false, "unsupported type");
+  std::string_view key;
+  std::string_view text;
+  toml_type type = toml_type::TABLE;
+
+  bool boolean = false;
+  int64_t integer = 0;
+  double number = 0.0;
+
+  const toml_node *children = nullptr;
+  size_t count = 0;
+
+  const toml_node *begin() const { return children; }
+  const toml_node *end() const { return children + count; }
+
+  bool is_table() const { return type == toml_type::TABLE; }
+  bool is_array() const { return type == toml_type::ARRAY; }
+  bool is_scalar() const { return type != toml_type::TABLE && type != toml_type::ARRAY; }
+
+  const toml_node *find(std::string_view name) const
+  {
+    for (const auto &child : *this) {
+      if (child.key == name) { return &child; }
     }
-    result.emplace_back(it);
+    return nullptr;
+  }
+
+  const toml_node *table(std::string_view name) const
+  {
+    const toml_node *child = find(name);
+    return child != nullptr && child->is_table() ? child : nullptr;
   }
 
-  return result;
+  /// Only valid for TIMESTAMP nodes.
+  toml_timestamp_t timestamp() const
+  {
+    toml_timestamp_t result;
+    toml_rtots(text.data(), &result);
+    return result;
+  }
+};
+
+/// A parsed TOML file that owns everything it hands out. The source is read
+/// into memory once, so source() is exactly what was parsed however the file
+/// changes afterwards, and every key and string lives in one arena, so nodes
+/// and the views into them stay valid for as long as the document does, even
+/// if it's moved.
+class toml_document
+{
+  std::string source_text;
+  std::vector<toml_node> nodes;
+  std::vector<std::unique_ptr<char[]>> arena;
+  size_t arena_used = 0;
+  size_t arena_capacity = 0;
+
+  std::string_view store(std::string_view value);
+  void build_table(toml_node &node, const toml_table_t *table);
+  void build_array(toml_node &node, const toml_array_t *array);
+  void build_scalar(toml_node &node, toml_raw_t raw);
+
+  explicit toml_document(std::string source) : source_text(std::move(source)) {}
+  static std::optional<toml_document> build(std::string source, std::string &error);
+
+public:
+  toml_document(toml_document &&) = default;
+  toml_document &operator=(toml_document &&) = default;
+
+  /// Empty if `path` can't be read. Parse errors are fatal.
+  static std::optional<toml_document> load(const std::filesystem::path &path);
+  /// Like load(), but a missing file or a parse error is reported in `error`
+  /// instead, for callers that have to outlive a broken manifest.
+  static std::optional<toml_document> try_load(const std::filesystem::path &path, std::string &error);
+  static toml_document parse(std::string contents, std::string_view origin);
+
+  const toml_node &root() const { return nodes.front(); }
+  std::string_view source() const { return source_text; }
+};
+
+inline bool toml_has_key(const toml_node *table, std::string_view key)
+{
+  return table != nullptr && table->find(key) != nullptr;
 }
 
-template<typename T> std::optional<T> toml_table_get(const toml_table_t *table, const char *key)
+template<typename T> std::optional<T> toml_node_as(const toml_node &node)
 {
-  if (table == nullptr) return std::nullopt;
-  if constexpr (std::is_same_v<T, std::string> || std::is_same_v<T, std::filesystem::path>) {
-    auto value = toml_string_in(table, key);
-    if (value.ok) return T(std::string(value.u.s));
-  } else if constexpr (std::is_same_v<T, char *>) {
-    auto value = toml_string_in(table, key);
-    if (value.ok) return value.u.s;
+  if constexpr (std::is_same_v<T, std::string_view>) {
+    if (node.type == toml_type::STRING) return node.text;
+  } else if constexpr (std::is_same_v<T, std::string> || std::is_same_v<T, std::filesystem::path>) {
+    if (node.type == toml_type::STRING) return T(node.text);
   } else if constexpr (std::is_same_v<T, bool>) {
-    auto value = toml_bool_in(table, key);
-    if (value.ok) return value.u.b;
+    if (node.type == toml_type::BOOLEAN) return node.boolean;
   } else if constexpr (std::is_integral_v<T>) {
-    auto value = toml_int_in(table, key);
-    if (value.ok) return T(value.u.i);
+    if (node.type == toml_type::INTEGER) return T(node.integer);
   } else if constexpr (std::is_floating_point_v<T>) {
-    auto value = toml_double_in(table, key);
-    if (value.ok) return T(value.u.d);
+    if (node.type == toml_type::FLOAT || node.type == toml_type::INTEGER) return T(node.number);
   } else if constexpr (is_vector<T>::value) {
-    auto array = toml_array_in(table, key);
-    if (array != nullptr) return toml_array_to_vec<typename is_vector<T>::element>(array);
+    if (node.type == toml_type::ARRAY) {
+      T result;
+      result.reserve(node.count);
+      for (const auto &element : node) {
+        auto item = toml_node_as<typename is_vector<T>::element>(element);
+        if (item.has_value()) { result.emplace_back(std::move(*item)); }
+      }
+      return result;
+    }
   } else if constexpr (is_time_point<T>::value) {
-    auto value = toml_timestamp_in(table, key);
-    if (value.ok) return toml_timestamp_to_chrono<typename is_time_point<T>::clock>(value.u.ts);
+    if (node.type == toml_type::TIMESTAMP) {
+      toml_timestamp_t ts = node.timestamp();
+      return toml_timestamp_to_chrono<typename is_time_point<T>::clock>(&ts);
+    }
   } else {
-    static_assert(false, "unsupported type");
+    static_assert(dependent_false<T>, "unsupported type");
   }
   return std::nullopt;
 }
 
+template<typename T> std::optional<T> toml_table_get(const toml_node *table, std::string_view key)
+{
+  if (table == nullptr) return std::nullopt;
+  const toml_node *node = table->find(key);
+  if (node == nullptr) return std::nullopt;
+  return toml_node_as<T>(*node);
+}
+
+/// Entries of a table decoded with a toml_schema, indexed like its keys.
+template<size_t N> struct toml_fields
+{
+  std::array<const toml_node *, N> nodes{};
+  /// Entries whose key isn't in the schema, in table order.
+  std::vector<const toml_node *> unknown;
+
+  template<typename T> std::optional<T> get(size_t index) const
+  {
+    if (nodes[index] == nullptr) return std::nullopt;
+    return toml_node_as<T>(*nodes[index]);
+  }
+  const toml_node *array(size_t index) const
+  {
+    return nodes[index] != nullptr && nodes[index]->is_array() ? nodes[index] : nullptr;
+  }
+  const toml_node *table(size_t index) const
+  {
+    return nodes[index] != nullptr && nodes[index]->is_table() ? nodes[index] : nullptr;
+  }
+};
+
+/// FNV-1a of `key` with a final mix, so the low bits used for buckets depend
+/// on every byte. `seed` picks one of a family of such hashes.
+constexpr uint32_t toml_key_hash(std::string_view key, uint32_t seed)
+{
+  uint32_t hash = 2166136261u ^ seed;
+  for (char c : key) { hash = (hash ^ uint8_t(c)) * 16777619u; }
+  hash ^= hash >> 16;
+  hash *= 0x7feb352du;
+  return hash ^ (hash >> 15);
+}
+
+/// The key of `keys` closest to a misspelled `key`, if any is close enough to
+/// suggest.
+std::optional<std::string_view> toml_closest_key(std::string_view key, const std::string_view *keys, size_t count);
+
+/// The keys a table may have, fixed at compile time. The constructor searches
+/// for a seed that hashes every key to its own bucket, so finding a key is a
+/// single probe, and decoding a table is one pass over its entries.
+template<size_t N> class toml_schema
+{
+  static_assert(N > 0 && N < 64, "keys are indexed with a byte and masked with 64 bits");
+  static constexpr size_t BUCKETS = [] {
+    size_t buckets = 1;
+    while (buckets < N * 4) { buckets *= 2; }
+    return buckets;
+  }();
+
+  std::array<std::string_view, N> keys{};
+  /// Index of the key in each bucket plus one, zero for empty buckets.
+  std::array<uint8_t, BUCKETS> buckets{};
+  uint32_t seed = 0;
+
+public:
+  constexpr explicit toml_schema(const std::string_view (&names)[N])
+  {
+    for (size_t i = 0; i < N; i++) {
+      for (size_t j = 0; j < i; j++) {
+        if (names[j] == names[i]) { throw std::invalid_argument("duplicate key in schema"); }
+      }
+      keys[i] = names[i];
+    }
+    for (bool collided = true; collided; seed += collided ? 1 : 0) {
+      collided = false;
+      for (auto &bucket : buckets) { bucket = 0; }
+      for (size_t i = 0; i < N && !collided; i++) {
+        uint8_t &bucket = buckets[toml_key_hash(keys[i], seed) % BUCKETS];
+        collided = bucket != 0;
+        bucket = uint8_t(i + 1);
+      }
+    }
+  }
+
+  static constexpr size_t size() { return N; }
+  constexpr std::string_view key(size_t index) const { return keys[index]; }
+
+  /// Index of `key`, or size() when the schema doesn't have it.
+  constexpr size_t find(std::string_view key) const
+  {
+    uint8_t bucket = buckets[toml_key_hash(key, seed) % BUCKETS];
+    return bucket != 0 && keys[bucket - 1] == key ? bucket - 1 : N;
+  }
+  /// Index of `key`, which has to be in the schema. Meant for constants, where
+  /// a missing key fails to compile.
+  constexpr size_t index(std::string_view key) const
+  {
+    size_t index = find(key);
+    if (index == N) { throw std::invalid_argument("key isn't in the schema"); }
+    return index;
+  }
+  /// Bit set with the bit of each key in `names`.
+  constexpr uint64_t mask(std::initializer_list<std::string_view> names) const
+  {
+    uint64_t result = 0;
+    for (auto name : names) { result |= uint64_t(1) << index(name); }
+    return result;
+  }
+
+  std::optional<std::string_view> closest(std::string_view key) const
+  {
+    return toml_closest_key(key, keys.data(), N);
+  }
+
+  toml_fields<N> decode(const toml_node &table) const
+  {
+    toml_fields<N> fields;
+    for (const auto &entry : table) {
+      size_t index = find(entry.key);
+      if (index == N) {
+        fields.unknown.push_back(&entry);
+      } else {
+        fields.nodes[index] = &entry;
+      }
+    }
+    return fields;
+  }
+};
+
 #endif /* _DEPMGR_TOML_HPP_ */
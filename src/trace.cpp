@@ -0,0 +1,179 @@
+#include "trace.hpp"
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+#include "manifest.hpp"
+#include "util.hpp"
+
+namespace fs = std::filesystem;
+
+std::atomic<uint64_t> process_allocations{0};
+thread_local uint64_t thread_allocations = 0;
+
+namespace {
+
+using trace_clock = std::chrono::steady_clock;
+
+struct trace_event
+{
+  const char *name;
+  std::string detail;
+  int64_t start_us;
+  int64_t duration_us;
+  uint32_t thread;
+  uint64_t allocations;
+  /// Peak RSS in KiB when the span ended, 0 if it wasn't sampled.
+  long peak_rss_kib;
+};
+
+struct trace_state
+{
+  std::atomic<bool> enabled{false};
+  std::mutex lock;
+  fs::path path;
+  trace_clock::time_point origin;
+  uint32_t main_thread = 0;
+  std::vector<trace_event> events;
+};
+
+trace_state &state()
+{
+  static trace_state instance;
+  return instance;
+}
+
+std::atomic<uint32_t> next_thread_id{1};
+thread_local uint32_t span_depth = 0;
+
+uint32_t thread_id()
+{
+  thread_local uint32_t id = next_thread_id.fetch_add(1, std::memory_order_relaxed);
+  return id;
+}
+
+long peak_rss_kib()
+{
+#if defined(_WIN32)
+  return 0;
+#else
+  rusage usage{};
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#if defined(__APPLE__)
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+#endif
+}
+
+int64_t microseconds_since(trace_clock::time_point origin, trace_clock::time_point time)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(time - origin).count();
+}
+
+} // namespace
+
+trace_span::trace_span(const char *name, std::string_view detail)
+    : name(name), detail(detail), active(state().enabled.load(std::memory_order_relaxed))
+{
+  if (!active) return;
+  span_depth++;
+  start_allocations = thread_allocations;
+  start = trace_clock::now();
+}
+
+trace_span::~trace_span()
+{
+  if (!active) return;
+  auto end = trace_clock::now();
+  uint64_t allocations = thread_allocations - start_allocations;
+  bool top_level = --span_depth == 0;
+
+  auto &trace = state();
+  trace_event event{name,
+    std::string(detail),
+    microseconds_since(trace.origin, start),
+    microseconds_since(start, end),
+    thread_id(),
+    allocations,
+    top_level ? peak_rss_kib() : 0};
+
+  std::lock_guard guard(trace.lock);
+  trace.events.emplace_back(std::move(event));
+}
+
+trace_session::trace_session(const fs::path &path)
+{
+  auto &trace = state();
+  trace.path = path;
+  trace.origin = trace_clock::now();
+  trace.main_thread = thread_id();
+  trace.enabled.store(true);
+}
+
+trace_session::~trace_session()
+{
+  auto &trace = state();
+  trace.enabled.store(false);
+
+  std::lock_guard guard(trace.lock);
+  unsigned long pid = current_process_id();
+  fmt::memory_buffer out;
+  auto it = std::back_inserter(out);
+  fmt::format_to(it, "{{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+  uint32_t threads = next_thread_id.load();
+  for (uint32_t thread = 1; thread < threads; thread++) {
+    std::string name = thread == trace.main_thread ? "main" : fmt::format("worker {}", thread);
+    fmt::format_to(it,
+      "{{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":{},\"tid\":{},\"args\":{{\"name\":{}}}}},\n",
+      pid,
+      thread,
+      json_string(name));
+  }
+
+  for (const auto &event : trace.events) {
+    fmt::format_to(it,
+      "{{\"ph\":\"X\",\"cat\":\"depmgr\",\"name\":{},\"ts\":{},\"dur\":{},\"pid\":{},\"tid\":{},"
+      "\"args\":{{\"allocations\":{}",
+      json_string(event.name),
+      event.start_us,
+      event.duration_us,
+      pid,
+      event.thread,
+      event.allocations);
+    if (!event.detail.empty()) { fmt::format_to(it, ",\"package\":{}", json_string(event.detail)); }
+    fmt::format_to(it, "}}}},\n");
+
+    if (event.peak_rss_kib != 0) {
+      fmt::format_to(it,
+        "{{\"ph\":\"C\",\"name\":\"peak RSS\",\"ts\":{},\"pid\":{},\"tid\":{},\"args\":{{\"KiB\":{}}}}},\n",
+        event.start_us + event.duration_us,
+        pid,
+        event.thread,
+        event.peak_rss_kib);
+    }
+  }
+
+  fmt::format_to(it,
+    "{{\"ph\":\"C\",\"name\":\"peak RSS\",\"ts\":{},\"pid\":{},\"tid\":{},\"args\":{{\"KiB\":{}}}}}\n"
+    "],\"otherData\":{{\"peak_rss_kib\":{},\"allocations\":{}}}}}\n",
+    microseconds_since(trace.origin, trace_clock::now()),
+    pid,
+    trace.main_thread,
+    peak_rss_kib(),
+    peak_rss_kib(),
+    process_allocations.load());
+
+  write_file_atomic(trace.path, std::string_view(out.data(), out.size()));
+  status("Trace of {} spans written to {}", trace.events.size(), trace.path.string());
+  trace.events.clear();
+}
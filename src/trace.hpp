@@ -0,0 +1,50 @@
+#ifndef _DEPMGR_TRACE_HPP_
+#define _DEPMGR_TRACE_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string_view>
+
+/// Allocations made by the whole process and by the current thread, counted
+/// by the operator new replacement in the depmgr executable. They stay zero
+/// in binaries that don't replace it.
+extern std::atomic<uint64_t> process_allocations;
+extern thread_local uint64_t thread_allocations;
+
+/// Times the enclosing scope as a span of the trace written with `--trace`.
+/// While no trace_session is active a span only checks a flag.
+class trace_span
+{
+  const char *name;
+  std::string_view detail;
+  std::chrono::steady_clock::time_point start;
+  uint64_t start_allocations = 0;
+  bool active;
+
+public:
+  /// `name` has to be a literal. `detail`, usually the package the work is
+  /// done for, has to outlive the span.
+  explicit trace_span(const char *name, std::string_view detail = {});
+  ~trace_span();
+
+  trace_span(const trace_span &) = delete;
+  trace_span &operator=(const trace_span &) = delete;
+};
+
+/// Records every span closed while it's alive and writes them to `path` as
+/// Chrome trace-event JSON, viewable in Perfetto or chrome://tracing. Spans
+/// carry the allocations made on their thread, top level spans also sample
+/// the peak RSS.
+class trace_session
+{
+public:
+  explicit trace_session(const std::filesystem::path &path);
+  ~trace_session();
+
+  trace_session(const trace_session &) = delete;
+  trace_session &operator=(const trace_session &) = delete;
+};
+
+#endif /* _DEPMGR_TRACE_HPP_ */
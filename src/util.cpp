@@ -1,42 +1,326 @@
 #include "util.hpp"
 
+#include <algorithm>
+#include <condition_variable>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
-#include "glob/glob.h"
+#if defined(__linux__)
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#elif defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/clonefile.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "state.hpp"
+#include "thread_pool.hpp"
 
 namespace fs = std::filesystem;
 
-void glob_copy(const std::string &source, const fs::path &target, const fs::path &base_path)
+unsigned long current_process_id()
+{
+#if defined(_WIN32)
+  return _getpid();
+#else
+  return getpid();
+#endif
+}
+
+fs::path executable_path(const char *argv0)
+{
+#if defined(__linux__)
+  std::error_code error;
+  fs::path path = fs::read_symlink("/proc/self/exe", error);
+  if (!error) { return path; }
+#endif
+  return fs::absolute(argv0);
+}
+
+/// Paths locked by this process. flock doesn't exclude other descriptors of
+/// the same process reliably everywhere, so threads wait here first.
+static std::mutex locked_paths_lock;
+static std::condition_variable locked_paths_changed;
+static std::unordered_set<std::string> locked_paths;
+
+file_lock::file_lock(fs::path path) : path(std::move(path))
+{
+  {
+    std::unique_lock guard(locked_paths_lock);
+    locked_paths_changed.wait(guard, [this]() { return locked_paths.count(this->path.string()) == 0; });
+    locked_paths.insert(this->path.string());
+  }
+
+#if !defined(_WIN32)
+  fs::create_directories(this->path.parent_path());
+  fd = open(this->path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0 || flock(fd, LOCK_EX) != 0) { critical_error("can't lock {}", this->path.string()); }
+#endif
+}
+
+file_lock::~file_lock()
+{
+#if !defined(_WIN32)
+  if (fd >= 0) { close(fd); }
+#endif
+  {
+    std::lock_guard guard(locked_paths_lock);
+    locked_paths.erase(path.string());
+  }
+  locked_paths_changed.notify_all();
+}
+
+std::optional<std::string> read_file(const fs::path &path)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file) { return std::nullopt; }
+  return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+mapped_file::~mapped_file()
+{
+#if !defined(_WIN32)
+  if (mapping != nullptr) { munmap(mapping, length); }
+#endif
+}
+
+mapped_file::mapped_file(mapped_file &&other) noexcept
+    : mapping(std::exchange(other.mapping, nullptr)), length(std::exchange(other.length, 0)),
+      buffer(std::move(other.buffer))
+{}
+
+mapped_file &mapped_file::operator=(mapped_file &&other) noexcept
+{
+  if (this != &other) {
+#if !defined(_WIN32)
+    if (mapping != nullptr) { munmap(mapping, length); }
+#endif
+    mapping = std::exchange(other.mapping, nullptr);
+    length = std::exchange(other.length, 0);
+    buffer = std::move(other.buffer);
+  }
+  return *this;
+}
+
+std::optional<mapped_file> mapped_file::open(const fs::path &path)
+{
+#if !defined(_WIN32)
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) { return std::nullopt; }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    return std::nullopt;
+  }
+
+  // Bytes past the end of the file are zero up to the page boundary, which
+  // provides the terminator. Files ending exactly on one are read instead.
+  size_t size = size_t(info.st_size);
+  long page = sysconf(_SC_PAGESIZE);
+  if (S_ISREG(info.st_mode) && size > 0 && page > 0 && size % size_t(page) != 0) {
+    // Private and writable so parsers taking `char *` can't touch the file.
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr != MAP_FAILED) {
+      mapped_file result;
+      result.mapping = static_cast<char *>(addr);
+      result.length = size;
+      return result;
+    }
+  } else {
+    close(fd);
+  }
+#endif
+
+  auto contents = read_file(path);
+  if (!contents.has_value()) { return std::nullopt; }
+  return mapped_file(std::move(*contents));
+}
+
+std::string read_file_prefix(const fs::path &path, size_t len)
+{
+  std::ifstream file(path, std::ios::binary);
+  std::string result(len, '\0');
+  file.read(result.data(), len);
+  result.resize(file.gcount());
+  return result;
+}
+
+void write_file_atomic(const fs::path &path, std::string_view contents)
+{
+  fs::create_directories(path.parent_path());
+  fs::path temporary = path;
+  temporary += fmt::format(".{}.tmp", current_process_id());
+  {
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    file.write(contents.data(), contents.size());
+    if (!file.flush()) { critical_error("can't write {}", temporary.string()); }
+  }
+  fs::rename(temporary, path);
+}
+
+static bool reflink_file(const fs::path &source, const fs::path &target)
 {
-  std::string source_path = base_path / source;
+#if defined(__linux__) && defined(FICLONE)
+  int source_fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+  if (source_fd < 0) { return false; }
+  int target_fd = open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (target_fd < 0) {
+    close(source_fd);
+    return false;
+  }
 
-  auto remaining_files = glob::rglob(source_path);
-  std::vector<fs::path> visited;
+  bool cloned = ioctl(target_fd, FICLONE, source_fd) == 0;
+  close(source_fd);
+  close(target_fd);
+  if (!cloned) {
+    fs::remove(target);
+    return false;
+  }
+  fs::permissions(target, fs::status(source).permissions());
+  return true;
+#elif defined(__APPLE__)
+  return clonefile(source.c_str(), target.c_str(), 0) == 0;
+#else
+  return false;
+#endif
+}
 
-  while (!remaining_files.empty()) {
-    fs::path source_file = remaining_files.back();
-    remaining_files.pop_back();
+static bool copy_file_range_all(const fs::path &source, const fs::path &target)
+{
+#if defined(__linux__)
+  int source_fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+  if (source_fd < 0) { return false; }
+  struct stat source_stat;
+  if (fstat(source_fd, &source_stat) != 0) {
+    close(source_fd);
+    return false;
+  }
+  int target_fd = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, source_stat.st_mode & 07777);
+  if (target_fd < 0) {
+    close(source_fd);
+    return false;
+  }
 
-    fs::path parent = source_file;
-    while (!parent.empty()) {
-      for (auto &it : visited) {
-        if (it == parent) { continue; }
-      }
-      parent = parent.parent_path();
+  bool copied = true;
+  for (off_t remaining = source_stat.st_size; remaining > 0;) {
+    ssize_t written = copy_file_range(source_fd, nullptr, target_fd, nullptr, remaining, 0);
+    if (written <= 0) {
+      // EXDEV/ENOSYS/EINVAL on older kernels and some filesystems, or the
+      // source shrunk under us: let the portable fallback handle it.
+      copied = false;
+      break;
     }
+    remaining -= written;
+  }
+  close(source_fd);
+  close(target_fd);
+  return copied;
+#else
+  return false;
+#endif
+}
+
+clone_method copy_file_contents(const fs::path &source, const fs::path &target)
+{
+  if (reflink_file(source, target)) { return clone_method::REFLINK; }
+  if (!copy_file_range_all(source, target)) {
+    fs::copy_file(source, target, fs::copy_options::overwrite_existing);
+  }
+  return clone_method::COPY;
+}
+
+copy_plan::copy_plan(fs::path target_root) : target_root(std::move(target_root)) {}
 
-    // FIXME: LIKELY BROKEN
-    if (fs::is_directory(source_file)) {
-      fs::create_directories(target);
-      for (const auto &entry : fs::recursive_directory_iterator(source_file)) {
-        fs::path relative_path = fs::relative(entry.path(), source_file);
-        fs::copy(entry.path(), target / relative_path);
-      }
-      visited.push_back(source_file);
+void copy_plan::add_directory(const fs::path &target)
+{
+  // Stop at the first known ancestor, it already has its parents queued.
+  for (fs::path it = target; it != target_root && !it.empty(); it = it.parent_path()) {
+    if (!directory_set.insert(it.generic_string()).second) { break; }
+    directories.push_back(it);
+  }
+}
+
+void copy_plan::add_file(const fs::path &source, const fs::path &target)
+{
+  if (!file_set.insert(target.generic_string()).second) { return; }
+  add_directory(target.parent_path());
+  files.emplace_back(source, target);
+}
+
+void copy_plan::add_tree(const fs::path &source, const fs::path &target, const std::vector<std::string> &skip)
+{
+  add_directory(target);
+  for (auto it = fs::recursive_directory_iterator(source); it != fs::recursive_directory_iterator(); ++it) {
+    if (it.depth() == 0 && std::find(skip.begin(), skip.end(), it->path().filename().string()) != skip.end()) {
+      if (it->is_directory()) { it.disable_recursion_pending(); }
+      continue;
+    }
+    fs::path destination = target / it->path().lexically_relative(source);
+    if (it->is_symlink()) {
+      if (file_set.insert(destination.generic_string()).second) { symlinks.emplace_back(it->path(), destination); }
+    } else if (it->is_directory()) {
+      add_directory(destination);
     } else {
-      fs::path target_dir = target.parent_path();
-      if (!fs::exists(target_dir)) { fs::create_directories(target_dir); }
-      fs::copy(source_file, target);
+      add_file(it->path(), destination);
     }
   }
 }
+
+void copy_plan::execute(clone_method (*copy)(const fs::path &, const fs::path &))
+{
+  static constexpr size_t BATCH_SIZE = 64;
+
+  // Parents sort before their children.
+  std::sort(directories.begin(), directories.end());
+  fs::create_directories(target_root);
+  for (const auto &it : directories) { fs::create_directory(it); }
+
+  for (const auto &[source, target] : symlinks) { fs::copy_symlink(source, target); }
+
+  // Trees are usually copied for one package of a walk already running on
+  // the walker's pool.
+  if (files.size() <= BATCH_SIZE || thread_pool::on_worker()) {
+    for (const auto &[source, target] : files) { copy(source, target); }
+    return;
+  }
+
+  thread_pool pool(execution_context::get().jobs);
+  std::vector<std::future<void>> pending;
+  for (size_t begin = 0; begin < files.size(); begin += BATCH_SIZE) {
+    size_t end = std::min(begin + BATCH_SIZE, files.size());
+    pending.emplace_back(pool.submit([this, begin, end, copy]() {
+      for (size_t i = begin; i < end; i++) { copy(files[i].first, files[i].second); }
+    }));
+  }
+  for (auto &it : pending) { it.get(); }
+}
+
+void copy_tree(const fs::path &source, const fs::path &target, const std::vector<std::string> &skip)
+{
+  copy_plan plan(target);
+  plan.add_tree(source, target, skip);
+  plan.execute(copy_file_contents);
+}
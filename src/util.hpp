@@ -2,6 +2,13 @@
 #define _DEPMGR_UTIL_HPP_
 
 #include <filesystem>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 #include <fmt/format.h>
 
@@ -11,13 +18,124 @@ template<typename... T> FMT_NORETURN inline void critical_error(fmt::format_stri
   std::terminate();
 }
 
+/// A remote failed in a way another mirror of it might not: it's unreachable,
+/// refused the request or served something else than asked for. Unlike
+/// critical errors these are recovered from, by trying the next mirror.
+class remote_error : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
+
+template<typename... T> [[noreturn]] inline void remote_failure(fmt::format_string<T...> fmt, T &&...args)
+{
+  throw remote_error(fmt::format(fmt, std::forward<T>(args)...));
+}
+
 template<typename... T> inline void status(fmt::format_string<T...> fmt, T &&...args)
 {
   fmt::println(stdout, "-- {}", fmt::format(fmt, std::forward<T>(args)...));
 }
 
-void glob_copy(const std::string &source,
+unsigned long current_process_id();
+
+/// Path of the running executable, `argv0` made absolute where the platform
+/// can't tell.
+std::filesystem::path executable_path(const char *argv0);
+
+std::optional<std::string> read_file(const std::filesystem::path &path);
+
+/// Read-only view of a whole file, memory-mapped where the platform allows it
+/// and read into memory otherwise. The contents are always followed by a NUL
+/// byte so they can be handed to C parsers directly.
+class mapped_file
+{
+  char *mapping = nullptr;
+  size_t length = 0;
+  std::string buffer;
+
+public:
+  mapped_file() = default;
+  /// Wraps contents that are already in memory.
+  explicit mapped_file(std::string contents) : length(contents.size()), buffer(std::move(contents)) {}
+  ~mapped_file();
+
+  mapped_file(mapped_file &&other) noexcept;
+  mapped_file &operator=(mapped_file &&other) noexcept;
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  static std::optional<mapped_file> open(const std::filesystem::path &path);
+
+  char *data() { return mapping != nullptr ? mapping : buffer.data(); }
+  std::string_view contents() const { return {mapping != nullptr ? mapping : buffer.data(), length}; }
+};
+
+/// Reads at most `len` bytes from the start of `path`, empty if it can't be read.
+std::string read_file_prefix(const std::filesystem::path &path, size_t len);
+
+/// Replaces `path` with `contents` through a rename, so readers either see the
+/// old file or the complete new one.
+void write_file_atomic(const std::filesystem::path &path, std::string_view contents);
+
+/// Exclusive lock on `path`, created if missing, held until destruction. Locks
+/// both against other processes (where the platform has flock) and against
+/// other threads of this one.
+class file_lock
+{
+  std::filesystem::path path;
+  int fd = -1;
+
+public:
+  explicit file_lock(std::filesystem::path path);
+  ~file_lock();
+
+  file_lock(const file_lock &) = delete;
+  file_lock &operator=(const file_lock &) = delete;
+};
+
+enum class clone_method { REFLINK, COPY };
+
+/// Copies `source` to a new independent file `target`: a reflink where
+/// supported, then an in-kernel copy_file_range, then a plain copy.
+clone_method copy_file_contents(const std::filesystem::path &source, const std::filesystem::path &target);
+
+/// Everything a tree copy will touch, collected before any file is written so
+/// directories are created once and files can be copied independently. Each
+/// target is planned once, later sources for it are ignored.
+class copy_plan
+{
+  std::filesystem::path target_root;
+  std::unordered_set<std::string> directory_set;
+  std::unordered_set<std::string> file_set;
+
+public:
+  std::vector<std::filesystem::path> directories;
+  std::vector<std::pair<std::filesystem::path, std::filesystem::path>> files;
+  std::vector<std::pair<std::filesystem::path, std::filesystem::path>> symlinks;
+
+  explicit copy_plan(std::filesystem::path target_root);
+
+  /// Queues `target` and its parents below the target root.
+  void add_directory(const std::filesystem::path &target);
+  void add_file(const std::filesystem::path &source, const std::filesystem::path &target);
+  /// Queues everything under `source` at the same path under `target`.
+  /// Symlinks are copied as links. Entries directly in `source` named in
+  /// `skip` are left out.
+  void add_tree(const std::filesystem::path &source,
+    const std::filesystem::path &target,
+    const std::vector<std::string> &skip = {});
+
+  /// Creates the directories and links, then copies the files with `copy`,
+  /// in parallel for large trees unless already on a pool's worker.
+  void execute(clone_method (*copy)(const std::filesystem::path &, const std::filesystem::path &));
+};
+
+/// Recreates the directory tree at `source` under `target` with independent
+/// copies of every file, which can be modified freely. Entries directly in
+/// `source` named in `skip` are left out.
+void copy_tree(const std::filesystem::path &source,
   const std::filesystem::path &target,
-  const std::filesystem::path &base_path = "");
+  const std::vector<std::string> &skip = {});
 
 #endif /* _DEPMGR_UTIL_HPP_ */
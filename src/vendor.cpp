@@ -0,0 +1,323 @@
+#include "vendor.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <unordered_map>
+
+#include <zlib.h>
+
+#include "archive.hpp"
+#include "hash.hpp"
+#include "state.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+
+namespace fs = std::filesystem;
+
+static constexpr size_t BATCH_SIZE = 64;
+
+fs::path vendor_pack_path(const fs::path &manifest) { return fs::path(manifest).replace_extension(".vendor"); }
+
+namespace {
+struct pack_entry
+{
+  std::string path;
+  vendor_entry_type type;
+  /// File to read the contents from, or the target of a symlink.
+  fs::path source;
+};
+
+struct packed_blob
+{
+  std::string digest;
+  std::string stored;
+  uint64_t size;
+};
+}// namespace
+
+/// Entries of the tree at `source_dir`, sorted so directories come before
+/// their contents. Repositories nested anywhere in the tree are skipped.
+static std::vector<pack_entry> tree_entries(const fs::path &source_dir)
+{
+  std::vector<pack_entry> entries;
+  for (auto it = fs::recursive_directory_iterator(source_dir); it != fs::recursive_directory_iterator(); ++it) {
+    if (it->path().filename() == ".git") {
+      it.disable_recursion_pending();
+      continue;
+    }
+    std::string path = it->path().lexically_relative(source_dir).generic_string();
+    if (it->is_symlink()) {
+      entries.push_back({path, vendor_entry_type::SYMLINK, fs::read_symlink(it->path())});
+    } else if (it->is_directory()) {
+      entries.push_back({path, vendor_entry_type::DIRECTORY, {}});
+    } else {
+      bool executable = (it->status().permissions() & fs::perms::owner_exec) != fs::perms::none;
+      entries.push_back({path, executable ? vendor_entry_type::EXECUTABLE : vendor_entry_type::FILE, it->path()});
+    }
+  }
+  std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b) { return a.path < b.path; });
+  return entries;
+}
+
+/// Compresses `contents`, keeping them as they are when that doesn't help.
+static packed_blob pack_blob(std::string_view contents)
+{
+  packed_blob result{sha256_hex(contents), {}, contents.size()};
+  uLongf length = compressBound(contents.size());
+  result.stored.resize(length);
+  int error = compress2(reinterpret_cast<Bytef *>(result.stored.data()),
+    &length,
+    reinterpret_cast<const Bytef *>(contents.data()),
+    contents.size(),
+    Z_BEST_COMPRESSION);
+  if (error != Z_OK) { critical_error("can't compress vendored sources: zlib error {}", error); }
+
+  if (length >= contents.size()) {
+    result.stored = contents;
+  } else {
+    result.stored.resize(length);
+  }
+  return result;
+}
+
+void write_vendor_pack(const std::vector<vendored_sources> &sources, const fs::path &path)
+{
+  trace_span span("write vendor pack");
+  std::vector<std::vector<pack_entry>> trees;
+  for (const auto &it : sources) { trees.emplace_back(tree_entries(it.source_dir)); }
+
+  // Every file is read and compressed on the pool, duplicates are dropped
+  // when the blobs are laid out.
+  thread_pool pool(execution_context::get().jobs);
+  std::vector<std::future<std::vector<packed_blob>>> pending;
+  for (const auto &entries : trees) {
+    for (size_t begin = 0; begin < entries.size(); begin += BATCH_SIZE) {
+      size_t end = std::min(begin + BATCH_SIZE, entries.size());
+      pending.emplace_back(pool.submit([&entries, begin, end]() {
+        std::vector<packed_blob> blobs;
+        for (size_t i = begin; i < end; i++) {
+          const pack_entry &entry = entries[i];
+          if (entry.type == vendor_entry_type::DIRECTORY) {
+            blobs.push_back({});
+          } else if (entry.type == vendor_entry_type::SYMLINK) {
+            blobs.push_back(pack_blob(entry.source.generic_string()));
+          } else {
+            std::optional<std::string> contents = read_file(entry.source);
+            if (!contents.has_value()) { critical_error("can't read {}", entry.source.string()); }
+            blobs.push_back(pack_blob(*contents));
+          }
+        }
+        return blobs;
+      }));
+    }
+  }
+
+  string_table strings;
+  std::vector<vendor_package> packages;
+  std::vector<vendor_entry> entries;
+  std::vector<vendor_blob> blobs;
+  std::unordered_map<std::string, uint32_t> blob_ids;
+  std::string data;
+
+  auto batch = pending.begin();
+  for (size_t i = 0; i < sources.size(); i++) {
+    vendor_package package;
+    package.name = strings.add(sources[i].name);
+    package.stamp = strings.add(sources[i].stamp);
+    package.first_entry = static_cast<uint32_t>(entries.size());
+    package.entry_count = static_cast<uint32_t>(trees[i].size());
+
+    for (size_t begin = 0; begin < trees[i].size(); begin += BATCH_SIZE, ++batch) {
+      std::vector<packed_blob> packed = batch->get();
+      for (size_t j = 0; j < packed.size(); j++) {
+        const pack_entry &entry = trees[i][begin + j];
+        uint32_t blob = 0;
+        if (entry.type != vendor_entry_type::DIRECTORY) {
+          auto [it, inserted] = blob_ids.try_emplace(packed[j].digest, static_cast<uint32_t>(blobs.size()));
+          if (inserted) {
+            blobs.push_back(vendor_blob{data.size(), packed[j].stored.size(), packed[j].size});
+            data += packed[j].stored;
+          }
+          blob = it->second;
+        }
+        entries.push_back(vendor_entry{strings.add(entry.path), entry.type, blob});
+      }
+    }
+    packages.push_back(package);
+  }
+
+  vendor_header header{};
+  std::memcpy(header.magic, VENDOR_MAGIC, sizeof(header.magic));
+  header.version = VENDOR_VERSION;
+  header.package_count = static_cast<uint32_t>(packages.size());
+  header.entry_count = static_cast<uint32_t>(entries.size());
+  header.blob_count = static_cast<uint32_t>(blobs.size());
+  header.string_bytes = static_cast<uint32_t>(strings.data.size());
+  header.packages_offset = sizeof(vendor_header);
+  header.entries_offset = header.packages_offset + packages.size() * sizeof(vendor_package);
+  header.blobs_offset = header.entries_offset + entries.size() * sizeof(vendor_entry);
+  header.strings_offset = header.blobs_offset + blobs.size() * sizeof(vendor_blob);
+  header.data_offset = header.strings_offset + strings.data.size();
+
+  std::string out;
+  out.reserve(header.data_offset + data.size());
+  append_pod(out, header);
+  for (const auto &package : packages) { append_pod(out, package); }
+  for (const auto &entry : entries) { append_pod(out, entry); }
+  for (const auto &blob : blobs) { append_pod(out, blob); }
+  out += strings.data;
+  out += data;
+
+  write_file_atomic(path, out);
+}
+
+/// The `count` records at `offset`, which have to be inside the file.
+template<typename T> const T *vendor_pack::section(uint64_t offset, uint64_t count) const
+{
+  std::string_view contents = file.contents();
+  if (offset > contents.size() || count > (contents.size() - offset) / sizeof(T)) {
+    throw vendor_error(fmt::format("{} is truncated", path.string()));
+  }
+  return reinterpret_cast<const T *>(contents.data() + offset);
+}
+
+const vendor_header &vendor_pack::header() const
+{
+  return *reinterpret_cast<const vendor_header *>(file.contents().data());
+}
+
+std::optional<vendor_pack> vendor_pack::open(const fs::path &path)
+{
+  std::optional<mapped_file> file = mapped_file::open(path);
+  if (!file.has_value()) return std::nullopt;
+
+  vendor_pack result;
+  result.path = path;
+  result.file = std::move(*file);
+  std::string_view contents = result.file.contents();
+  if (contents.size() < sizeof(vendor_header)
+      || std::memcmp(contents.data(), VENDOR_MAGIC, sizeof(VENDOR_MAGIC)) != 0) {
+    throw vendor_error(fmt::format("{} isn't a vendor pack", path.string()));
+  }
+
+  const vendor_header &header = result.header();
+  if (header.version != VENDOR_VERSION) {
+    throw vendor_error(
+      fmt::format("{} is a version {} vendor pack, run depmgr vendor again", path.string(), header.version));
+  }
+  result.section<vendor_package>(header.packages_offset, header.package_count);
+  result.section<vendor_entry>(header.entries_offset, header.entry_count);
+  result.section<vendor_blob>(header.blobs_offset, header.blob_count);
+  result.section<char>(header.strings_offset, header.string_bytes);
+  result.section<char>(header.data_offset, 0);
+  return result;
+}
+
+std::string_view vendor_pack::string(manifest_string value) const
+{
+  const vendor_header &pack = header();
+  if (value.offset > pack.string_bytes || value.length > pack.string_bytes - value.offset) {
+    throw vendor_error(fmt::format("{} is corrupt", path.string()));
+  }
+  return {file.contents().data() + pack.strings_offset + value.offset, value.length};
+}
+
+/// Contents of blob `index`, inflated into `inflated` if they're compressed.
+std::string_view vendor_pack::blob(uint32_t index, std::string &inflated) const
+{
+  const vendor_header &pack = header();
+  if (index >= pack.blob_count) { throw vendor_error(fmt::format("{} is corrupt", path.string())); }
+  const vendor_blob &blob = section<vendor_blob>(pack.blobs_offset, pack.blob_count)[index];
+  std::string_view stored(section<char>(pack.data_offset + blob.offset, blob.stored_size), blob.stored_size);
+  if (blob.stored_size == blob.size) return stored;
+
+  inflated.resize(blob.size);
+  uLongf length = blob.size;
+  int error = uncompress(reinterpret_cast<Bytef *>(inflated.data()),
+    &length,
+    reinterpret_cast<const Bytef *>(stored.data()),
+    stored.size());
+  if (error != Z_OK || length != blob.size) { throw vendor_error(fmt::format("{} is corrupt", path.string())); }
+  return inflated;
+}
+
+const vendor_package *vendor_pack::find(std::string_view name, std::string_view stamp) const
+{
+  const vendor_header &pack = header();
+  const vendor_package *packages = section<vendor_package>(pack.packages_offset, pack.package_count);
+  for (uint32_t i = 0; i < pack.package_count; i++) {
+    if (string(packages[i].name) == name && string(packages[i].stamp) == stamp) return &packages[i];
+  }
+  return nullptr;
+}
+
+void vendor_pack::extract(const vendor_package &package, const fs::path &dest) const
+{
+  trace_span span("unpack", string(package.name));
+  const vendor_header &pack = header();
+  if (package.first_entry > pack.entry_count || package.entry_count > pack.entry_count - package.first_entry) {
+    throw vendor_error(fmt::format("{} is corrupt", path.string()));
+  }
+  const vendor_entry *entries = section<vendor_entry>(pack.entries_offset, pack.entry_count) + package.first_entry;
+
+  fs::remove_all(dest);
+  fs::create_directories(dest);
+  // Like archives, links are created after everything else, so nothing is
+  // written through one.
+  std::vector<std::pair<const vendor_entry *, fs::path>> files;
+  std::vector<std::pair<fs::path, std::string>> symlinks;
+  std::string inflated;
+  for (uint32_t i = 0; i < package.entry_count; i++) {
+    const vendor_entry &entry = entries[i];
+    auto target = path_within(dest, string(entry.path));
+    if (!target.has_value()) {
+      throw vendor_error(fmt::format("vendored entry escapes destination: {}", string(entry.path)));
+    }
+
+    if (entry.type == vendor_entry_type::DIRECTORY) {
+      fs::create_directories(*target);
+    } else if (entry.type == vendor_entry_type::SYMLINK) {
+      symlinks.emplace_back(std::move(*target), std::string(blob(entry.blob, inflated)));
+    } else {
+      if (auto error = create_parents_within(dest, *target)) { throw vendor_error("vendored " + *error); }
+      files.emplace_back(&entry, std::move(*target));
+    }
+  }
+
+  auto write = [this, &files](size_t begin, size_t end) {
+    std::string inflated;
+    for (size_t i = begin; i < end; i++) {
+      const auto &[entry, target] = files[i];
+      std::string_view contents = blob(entry->blob, inflated);
+      std::ofstream out(target, std::ios::binary);
+      out.write(contents.data(), std::streamsize(contents.size()));
+      if (!out) { critical_error("can't write {}", target.string()); }
+      if (entry->type == vendor_entry_type::EXECUTABLE) {
+        out.close();
+        fs::permissions(
+          target, fs::perms::owner_exec | fs::perms::group_exec | fs::perms::others_exec, fs::perm_options::add);
+      }
+    }
+  };
+
+  // Packages are unpacked by the walker, already on its pool.
+  if (files.size() <= BATCH_SIZE || thread_pool::on_worker()) {
+    write(0, files.size());
+  } else {
+    thread_pool pool(execution_context::get().jobs);
+    std::vector<std::future<void>> pending;
+    for (size_t begin = 0; begin < files.size(); begin += BATCH_SIZE) {
+      size_t end = std::min(begin + BATCH_SIZE, files.size());
+      pending.emplace_back(pool.submit([&write, begin, end]() { write(begin, end); }));
+    }
+    for (auto &it : pending) { it.get(); }
+  }
+
+  if (auto error = create_symlinks_within(dest, symlinks)) {
+    // Don't leave a link that points outside behind.
+    fs::remove_all(dest);
+    throw vendor_error("vendored " + *error);
+  }
+}
@@ -0,0 +1,131 @@
+#ifndef _DEPMGR_VENDOR_HPP_
+#define _DEPMGR_VENDOR_HPP_
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "manifest.hpp"
+#include "util.hpp"
+
+/*
+ * Vendor pack layout. Like the binary manifest, fields are in native byte
+ * order and naturally aligned, so the index is read in place from the mapped
+ * file:
+ *
+ *   vendor_header
+ *   vendor_package[package_count]
+ *   vendor_entry[entry_count]      per package, parents before children
+ *   vendor_blob[blob_count]
+ *   char strings[string_bytes]     NUL terminated, deduplicated
+ *   data                           blob contents, each deflated on its own
+ *
+ * Files with equal contents share one blob, across packages too. Blobs are
+ * compressed independently so any file can be extracted without the others.
+ */
+
+static constexpr char VENDOR_MAGIC[8] = {'D', 'E', 'P', 'M', 'G', 'R', 'V', '\0'};
+static constexpr uint32_t VENDOR_VERSION = 1;
+
+struct vendor_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t package_count;
+  uint32_t entry_count;
+  uint32_t blob_count;
+  uint32_t string_bytes;
+  uint32_t reserved;
+  uint64_t packages_offset;
+  uint64_t entries_offset;
+  uint64_t blobs_offset;
+  uint64_t strings_offset;
+  uint64_t data_offset;
+};
+
+struct vendor_package
+{
+  manifest_string name;
+  /// Fetch stamp the sources were prepared with.
+  manifest_string stamp;
+  uint32_t first_entry;
+  uint32_t entry_count;
+};
+
+enum class vendor_entry_type : uint32_t { FILE, EXECUTABLE, SYMLINK, DIRECTORY };
+
+struct vendor_entry
+{
+  /// Relative to the package's source directory.
+  manifest_string path;
+  vendor_entry_type type;
+  /// Contents, or the link target of a symlink. Unused for directories.
+  uint32_t blob;
+};
+
+struct vendor_blob
+{
+  /// Relative to the data section.
+  uint64_t offset;
+  /// Equal to `size` when the contents are stored uncompressed.
+  uint64_t stored_size;
+  uint64_t size;
+};
+
+static_assert(sizeof(vendor_header) == 72);
+static_assert(sizeof(vendor_package) == 24);
+static_assert(sizeof(vendor_entry) == 16);
+static_assert(sizeof(vendor_blob) == 24);
+
+/// Pack next to `manifest`, committed along with it.
+std::filesystem::path vendor_pack_path(const std::filesystem::path &manifest);
+
+/// Sources to store in a pack: a prepared source tree and the fetch stamp it
+/// was prepared with.
+struct vendored_sources
+{
+  std::string name;
+  std::string stamp;
+  std::filesystem::path source_dir;
+};
+
+/// Writes the pack of `sources`. Version control metadata is left out.
+void write_vendor_pack(const std::vector<vendored_sources> &sources, const std::filesystem::path &path);
+
+/// A pack is truncated, corrupt or from another version of depmgr. Thrown
+/// rather than terminating, so the daemon can report it and keep going.
+class vendor_error : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
+
+/// A pack mapped into memory. Extraction reads blobs straight from the
+/// mapping and writes files in parallel.
+class vendor_pack
+{
+  std::filesystem::path path;
+  mapped_file file;
+
+  template<typename T> const T *section(uint64_t offset, uint64_t count) const;
+  const vendor_header &header() const;
+  std::string_view string(manifest_string value) const;
+  std::string_view blob(uint32_t index, std::string &inflated) const;
+
+public:
+  /// None if there's no pack at `path`, a vendor_error if it can't be read.
+  static std::optional<vendor_pack> open(const std::filesystem::path &path);
+
+  /// The package called `name` if it was packed from sources with `stamp`.
+  const vendor_package *find(std::string_view name, std::string_view stamp) const;
+  /// Recreates the sources of `package` in `dest`, replacing its contents.
+  /// Symlinks are created last and fail with a vendor_error when an entry
+  /// would end up outside of `dest`.
+  void extract(const vendor_package &package, const std::filesystem::path &dest) const;
+};
+
+#endif /* _DEPMGR_VENDOR_HPP_ */
@@ -0,0 +1,88 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "archive.hpp"
+#include "test_support.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+/// One ustar entry: its header block, then `contents` padded to a block.
+std::string tar_entry(std::string_view name, char type, std::string_view link = "", std::string_view contents = "")
+{
+  std::string header(512, '\0');
+  std::memcpy(&header[0], name.data(), name.size());
+  std::snprintf(&header[100], 8, "%07o", 0644);
+  std::snprintf(&header[124], 12, "%011o", unsigned(contents.size()));
+  header[156] = type;
+  std::memcpy(&header[157], link.data(), link.size());
+  std::memcpy(&header[257], "ustar", 6);
+  std::memcpy(&header[263], "00", 2);
+  std::memset(&header[148], ' ', 8);
+  unsigned checksum = 0;
+  for (char c : header) { checksum += uint8_t(c); }
+  std::snprintf(&header[148], 8, "%06o", checksum);
+
+  std::string entry = header + std::string(contents);
+  entry.resize(entry.size() + (512 - contents.size() % 512) % 512, '\0');
+  return entry;
+}
+
+std::string tar_end() { return std::string(1024, '\0'); }
+
+/// Extracts `archive` into `dest`, returning the remote_error it failed with.
+std::optional<std::string> extract(const std::string &archive, const fs::path &dest)
+{
+  try {
+    archive_extractor extractor(dest);
+    extractor.feed(reinterpret_cast<const uint8_t *>(archive.data()), archive.size());
+    extractor.finish();
+  } catch (const remote_error &error) {
+    return error.what();
+  }
+  return std::nullopt;
+}
+
+}// namespace
+
+TEST_CASE(archive_extracts_files)
+{
+  scratch_dir scratch("extract");
+  fs::path dest = scratch.get() / "dest";
+  std::string archive = tar_entry("pkg/", '5') + tar_entry("pkg/file.txt", '0', "", "contents")
+                        + tar_entry("pkg/link", '2', "file.txt") + tar_end();
+  CHECK(!extract(archive, dest).has_value());
+  CHECK(read_file(dest / "pkg" / "file.txt") == "contents");
+  CHECK(fs::read_symlink(dest / "pkg" / "link") == "file.txt");
+}
+
+TEST_CASE(archive_entry_escapes)
+{
+  scratch_dir scratch("escape");
+  fs::path dest = scratch.get() / "dest";
+  for (std::string_view name : {"../outside.txt", "pkg/../../outside.txt", "/tmp/outside.txt"}) {
+    CHECK(extract(tar_entry(name, '0', "", "x") + tar_end(), dest).has_value());
+  }
+  CHECK(extract(tar_entry("hard", '1', "../../outside.txt") + tar_end(), dest).has_value());
+  CHECK(!fs::exists(scratch.get() / "outside.txt"));
+}
+
+TEST_CASE(archive_symlink_escapes)
+{
+  scratch_dir scratch("symlink");
+  fs::path dest = scratch.get() / "dest";
+  CHECK(extract(tar_entry("up", '2', "../..") + tar_end(), dest).has_value());
+  CHECK(extract(tar_entry("root", '2', "/etc") + tar_end(), dest).has_value());
+  // A directory entry and a symlink of the same name: the symlink would
+  // redirect whatever was written into the directory.
+  fs::remove_all(dest);
+  std::string through = tar_entry("dir/file.txt", '0', "", "x") + tar_entry("dir", '2', "..") + tar_end();
+  CHECK(extract(through, dest).has_value());
+  CHECK(!fs::is_symlink(dest / "dir"));
+}
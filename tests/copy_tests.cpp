@@ -0,0 +1,100 @@
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+#include <fmt/format.h>
+
+#include "test_support.hpp"
+#include "thread_pool.hpp"
+#include "util.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+void write(const fs::path &path, std::string_view contents)
+{
+  fs::create_directories(path.parent_path());
+  std::ofstream(path, std::ios::binary) << contents;
+}
+
+/// A tree with enough files to be copied in batches, a symlink and a marker
+/// file at the top and one level down.
+fs::path make_tree(const fs::path &root)
+{
+  fs::path source = root / "source";
+  for (int i = 0; i < 200; i++) { write(source / "many" / fmt::format("{}.txt", i), fmt::format("file {}", i)); }
+  write(source / "a" / "b" / "c.txt", "nested");
+  fs::create_symlink("a/b/c.txt", source / "link");
+  write(source / ".marker", "top");
+  write(source / "a" / ".marker", "nested marker");
+  return source;
+}
+
+void check_tree(const fs::path &target)
+{
+  for (int i = 0; i < 200; i++) {
+    CHECK(read_file(target / "many" / fmt::format("{}.txt", i)) == fmt::format("file {}", i));
+  }
+  CHECK(read_file(target / "a" / "b" / "c.txt") == "nested");
+  CHECK(fs::is_symlink(target / "link"));
+  CHECK(fs::read_symlink(target / "link") == "a/b/c.txt");
+  // Only entries directly in the source are skipped.
+  CHECK(!fs::exists(target / ".marker"));
+  CHECK(read_file(target / "a" / ".marker") == "nested marker");
+}
+
+}// namespace
+
+TEST_CASE(copy_tree_copies_files_and_links)
+{
+  scratch_dir scratch("copy");
+  fs::path source = make_tree(scratch.get());
+  fs::path target = scratch.get() / "target";
+  copy_tree(source, target, {".marker"});
+  check_tree(target);
+
+  // The copies are independent of the sources.
+  write(target / "a" / "b" / "c.txt", "changed");
+  CHECK(read_file(source / "a" / "b" / "c.txt") == "nested");
+}
+
+TEST_CASE(copy_tree_on_worker)
+{
+  scratch_dir scratch("copy_worker");
+  fs::path source = make_tree(scratch.get());
+  fs::path target = scratch.get() / "target";
+  // Copies from a pool's task run inline instead of starting a pool of their own.
+  thread_pool pool(2);
+  auto copied = pool.submit([&]() {
+    copy_tree(source, target, {".marker"});
+    return thread_pool::on_worker();
+  });
+  CHECK(copied.get());
+  CHECK(!thread_pool::on_worker());
+  check_tree(target);
+}
+
+TEST_CASE(copy_plan_dedups_targets)
+{
+  scratch_dir scratch("copy_plan");
+  write(scratch.get() / "one.txt", "one");
+  write(scratch.get() / "two.txt", "two");
+  write(scratch.get() / "tree" / "x.txt", "tree");
+  write(scratch.get() / "tree" / "y.txt", "y");
+  fs::path target = scratch.get() / "target";
+
+  copy_plan plan(target);
+  plan.add_file(scratch.get() / "one.txt", target / "d" / "x.txt");
+  plan.add_file(scratch.get() / "two.txt", target / "d" / "x.txt");
+  plan.add_tree(scratch.get() / "tree", target / "d");
+  plan.add_directory(target / "d" / "e");
+  // Each target once: the first source planned for it wins.
+  CHECK(plan.files.size() == 2);
+  CHECK(plan.directories.size() == 2);
+
+  plan.execute(copy_file_contents);
+  CHECK(read_file(target / "d" / "x.txt") == "one");
+  CHECK(read_file(target / "d" / "y.txt") == "y");
+  CHECK(fs::is_directory(target / "d" / "e"));
+}
@@ -0,0 +1,38 @@
+#include <cstdlib>
+#include <exception>
+#include <string_view>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "test_support.hpp"
+
+/// `depmgr_tests <name>` runs one test, so CTest reports each on its own.
+/// Without a name every test runs.
+int main(int argc, char *argv[])
+{
+  const auto &tests = test_registry();
+  std::vector<std::string_view> selected;
+  if (argc > 1) {
+    selected.assign(argv + 1, argv + argc);
+  } else {
+    for (const auto &[name, test] : tests) { selected.push_back(name); }
+  }
+
+  int failed = 0;
+  for (auto name : selected) {
+    auto it = tests.find(name);
+    if (it == tests.end()) {
+      fmt::println(stderr, "unknown test: {}", name);
+      return EXIT_FAILURE;
+    }
+    try {
+      it->second();
+      fmt::println("PASSED: {}", name);
+    } catch (const std::exception &error) {
+      fmt::println(stderr, "FAILED: {}: {}", name, error.what());
+      failed++;
+    }
+  }
+  return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
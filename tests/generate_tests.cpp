@@ -0,0 +1,62 @@
+#include <filesystem>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "generate.hpp"
+#include "test_support.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+/// Resolves /virtual/dependencies.toml from `manifests` with `arguments`.
+generation resolve(const manifest_set &manifests, const fs::path &work_dir, std::vector<std::string> arguments = {})
+{
+  manifest_loader load = manifests.loader();
+  return resolve_generation(
+    "/virtual/dependencies.toml", load("/virtual/dependencies.toml"), work_dir, false, arguments, load);
+}
+
+}// namespace
+
+TEST_CASE(fingerprint_follows_inputs)
+{
+  scratch_dir scratch("fingerprint");
+  manifest_set manifests;
+  manifests.add("/virtual/dependencies.toml", "[a]\npath = \"/virtual/a\"\n");
+  manifests.add("/virtual/a/dependencies.toml", "[c]\nurl = \"file:///one.tar.gz\"\n");
+
+  std::string first = resolve(manifests, scratch.get()).fingerprint;
+  CHECK(resolve(manifests, scratch.get()).fingerprint == first);
+  CHECK(resolve(manifests, scratch.get(), {"--timing"}).fingerprint != first);
+  // Nested manifests are inputs as much as the root one.
+  manifests.add("/virtual/a/dependencies.toml", "[c]\nurl = \"file:///two.tar.gz\"\n");
+  CHECK(resolve(manifests, scratch.get()).fingerprint != first);
+}
+
+TEST_CASE(unchanged_output_is_up_to_date)
+{
+  scratch_dir scratch("up_to_date");
+  fs::path output = scratch.get() / "dependencies.cmake";
+  manifest_set manifests;
+  manifests.add("/virtual/dependencies.toml", "[a]\npath = \"/virtual/a\"\n");
+
+  generation current = resolve(manifests, scratch.get() / "_depmgr");
+  CHECK(!is_up_to_date(current, output));
+
+  fmt::memory_buffer script;
+  fmt::format_to(std::back_inserter(script), "{}message(STATUS \"generated\")\n", current.fingerprint);
+  write_generation(current, script, output);
+  CHECK(is_up_to_date(current, output));
+  CHECK(read_file(output) == fmt::to_string(script));
+  // Written through a temporary file, which is renamed into place.
+  size_t files = 0;
+  for (const auto &entry : fs::directory_iterator(scratch.get())) { files += entry.is_regular_file() ? 1 : 0; }
+  CHECK(files == 1);
+
+  manifests.add("/virtual/dependencies.toml", "[b]\npath = \"/virtual/b\"\n");
+  CHECK(!is_up_to_date(resolve(manifests, scratch.get() / "_depmgr"), output));
+}
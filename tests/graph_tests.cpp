@@ -0,0 +1,106 @@
+#include <algorithm>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "graph.hpp"
+#include "package.hpp"
+#include "test_support.hpp"
+#include "toml.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+/// Walks the manifest at /virtual/dependencies.toml and merges the graph
+/// into `ordered`, returning the graph_error either step failed with.
+std::optional<std::string> walk_graph(const manifest_loader &load, package_table *ordered = nullptr)
+{
+  scratch_dir scratch("graph");
+  std::shared_ptr<const toml_document> root = load("/virtual/dependencies.toml");
+  package_table roots = parse_packages(root->root(), "/virtual", false);
+  roots.work_dir = scratch.get();
+
+  dependency_graph graph;
+  std::optional<lockfile> lock;
+  std::optional<vendor_pack> pack;
+  try {
+    dependency_walker(graph, lock, pack, false, load).walk(std::move(roots));
+    package_table packages = graph.into_topological_order();
+    if (ordered != nullptr) { *ordered = std::move(packages); }
+  } catch (const graph_error &error) {
+    return error.what();
+  }
+  return std::nullopt;
+}
+
+}// namespace
+
+TEST_CASE(graph_without_conflicts)
+{
+  manifest_set manifests;
+  manifests.add("/virtual/dependencies.toml", "[a]\npath = \"/virtual/a\"\n[b]\npath = \"/virtual/b\"\n");
+  manifests.add("/virtual/a/dependencies.toml", "[c]\nurl = \"file:///one.tar.gz\"\n");
+  manifests.add("/virtual/b/dependencies.toml", "[c]\nurl = \"file:///one.tar.gz\"\n");
+
+  package_table packages;
+  CHECK(!walk_graph(manifests.loader(), &packages).has_value());
+  CHECK(packages.size() == 3);
+  // Both require the same revision of c, which is merged into one package
+  // ordered before its dependents.
+  CHECK(std::count(packages.names.begin(), packages.names.end(), "c") == 1);
+  CHECK(packages.names[0] == "c");
+  for (package_id id = 1; id < packages.size(); id++) {
+    CHECK(packages.names[id] == "a" || packages.names[id] == "b");
+    CHECK((packages.depends[id] == std::vector<package_id>{0}));
+  }
+}
+
+TEST_CASE(walker_task_exception)
+{
+  manifest_set manifests;
+  manifests.add("/virtual/dependencies.toml", "[a]\npath = \"/virtual/a\"\n[b]\npath = \"/virtual/b\"\n");
+  manifest_loader base = manifests.loader();
+  // Visiting either package fails. The walk has to stop and report it
+  // instead of waiting for visits that never finish.
+  manifest_loader failing = [&base](const fs::path &path) {
+    if (path.generic_string() != "/virtual/dependencies.toml") { throw std::runtime_error("can't read manifest"); }
+    return base(path);
+  };
+
+  bool thrown = false;
+  try {
+    walk_graph(failing);
+  } catch (const std::runtime_error &error) {
+    thrown = std::string_view(error.what()) == "can't read manifest";
+  }
+  CHECK(thrown);
+}
+
+TEST_CASE(graph_revision_conflict)
+{
+  manifest_set manifests;
+  manifests.add("/virtual/dependencies.toml", "[a]\npath = \"/virtual/a\"\n[b]\npath = \"/virtual/b\"\n");
+  manifests.add("/virtual/a/dependencies.toml", "[c]\nurl = \"file:///one.tar.gz\"\n");
+  manifests.add("/virtual/b/dependencies.toml", "[c]\nurl = \"file:///two.tar.gz\"\n");
+
+  auto error = walk_graph(manifests.loader());
+  CHECK(error.has_value());
+  CHECK(error->find("conflicting revisions of 'c'") != std::string::npos);
+}
+
+TEST_CASE(graph_cycle)
+{
+  manifest_set manifests;
+  manifests.add("/virtual/dependencies.toml", "[a]\npath = \"/virtual/a\"\n");
+  manifests.add("/virtual/a/dependencies.toml", "[b]\npath = \"/virtual/b\"\n");
+  manifests.add("/virtual/b/dependencies.toml", "[a]\npath = \"/virtual/a\"\n");
+
+  auto error = walk_graph(manifests.loader());
+  CHECK(error.has_value());
+  CHECK(error->find("dependency cycle") != std::string::npos);
+}
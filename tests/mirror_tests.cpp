@@ -0,0 +1,108 @@
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "cache.hpp"
+#include "download.hpp"
+#include "mirror.hpp"
+#include "state.hpp"
+#include "test_support.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+/// Points the mirror statistics at `cache` and races one mirror at a time,
+/// so which mirrors are attempted is deterministic.
+class mirror_context
+{
+  execution_context saved = execution_context::get();
+
+public:
+  explicit mirror_context(const fs::path &cache)
+  {
+    execution_context::get().dependency_cache_dir = cache;
+    execution_context::get().mirror_race = 1;
+  }
+  ~mirror_context() { execution_context::get() = saved; }
+};
+
+/// Races `urls`, returning the URL that served and recording every URL an
+/// attempt was started for in `attempted`.
+std::string race(const std::vector<std::string> &urls, std::vector<std::string> &attempted, std::string &contents)
+{
+  std::mutex lock;
+  std::string served;
+  race_mirrors(
+    "test remote",
+    urls,
+    [&](const std::string &url, const std::atomic<bool> &cancelled) {
+      {
+        std::lock_guard guard(lock);
+        attempted.push_back(url);
+      }
+      return open_url(download_request{url, {}, std::nullopt, std::nullopt}, cancelled);
+    },
+    [&](const std::string &url, std::unique_ptr<byte_source> source) {
+      uint8_t buffer[64];
+      while (size_t len = source->read(buffer, sizeof(buffer))) {
+        contents.append(reinterpret_cast<const char *>(buffer), len);
+      }
+      served = url;
+    });
+  return served;
+}
+
+}// namespace
+
+TEST_CASE(mirror_failover_prefers_good_mirror)
+{
+  scratch_dir scratch("mirror");
+  mirror_context context(scratch.get() / "cache");
+  std::ofstream(scratch.get() / "good.txt") << "contents";
+  std::string missing = "file://" + (scratch.get() / "missing.txt").generic_string();
+  std::string good = "file://" + (scratch.get() / "good.txt").generic_string();
+
+  // Neither was measured, so they're tried in order and the missing one
+  // fails over to the good one.
+  std::vector<std::string> attempted;
+  std::string contents;
+  CHECK(race({missing, good}, attempted, contents) == good);
+  CHECK(contents == "contents");
+  CHECK((attempted == std::vector<std::string>{missing, good}));
+
+  std::optional<std::string> stats = read_file(dependency_cache(scratch.get() / "cache").mirror_stats_path());
+  CHECK(stats.has_value());
+  CHECK(stats->find("0 1 " + missing + "\n") != std::string::npos);
+  CHECK(stats->find(" 0 " + good + "\n") != std::string::npos);
+
+  // The next run starts with the mirror that worked.
+  attempted.clear();
+  contents.clear();
+  CHECK(race({missing, good}, attempted, contents) == good);
+  CHECK((attempted == std::vector<std::string>{good}));
+}
+
+TEST_CASE(mirror_all_failed)
+{
+  scratch_dir scratch("mirror_failed");
+  mirror_context context(scratch.get() / "cache");
+  std::string one = "file://" + (scratch.get() / "one.txt").generic_string();
+  std::string two = "file://" + (scratch.get() / "two.txt").generic_string();
+
+  std::vector<std::string> attempted;
+  std::string contents;
+  std::string error;
+  try {
+    race({one, two}, attempted, contents);
+  } catch (const remote_error &failure) {
+    error = failure.what();
+  }
+  CHECK(error.find("every mirror of test remote failed") != std::string::npos);
+  CHECK(attempted.size() == 2);
+}
@@ -0,0 +1,67 @@
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "git.hpp"
+#include "package.hpp"
+#include "test_support.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+/// A patch replacing the two lines of hello.txt, `before`, with `after`.
+std::string hello_patch(std::string_view before, std::string_view after)
+{
+  auto lines = [](std::string_view text, char prefix) {
+    std::string result;
+    for (size_t begin = 0, end; begin < text.size(); begin = end + 1) {
+      end = text.find('\n', begin);
+      result += prefix;
+      result += text.substr(begin, end - begin + 1);
+    }
+    return result;
+  };
+  return "diff --git a/hello.txt b/hello.txt\n--- a/hello.txt\n+++ b/hello.txt\n@@ -1,2 +1,2 @@\n"
+         + lines(before, '-') + lines(after, '+');
+}
+
+}// namespace
+
+TEST_CASE(patches_apply_in_order)
+{
+  scratch_dir scratch("patch");
+  fs::path tree = scratch.get() / "tree";
+  fs::create_directories(tree);
+  std::ofstream(tree / "hello.txt") << "first\nsecond\n";
+  std::ofstream(scratch.get() / "1.patch") << hello_patch("first\nsecond\n", "first\npatched\n");
+  // Only applies once the first patch has.
+  std::ofstream(scratch.get() / "2.patch") << hello_patch("first\npatched\n", "one\npatched\n");
+
+  {
+    git_library git;
+    git_apply_patches(tree, {scratch.get() / "1.patch", scratch.get() / "2.patch"});
+  }
+  CHECK(read_file(tree / "hello.txt") == "one\npatched\n");
+  // The scratch repository the patches were applied with is gone.
+  CHECK(!fs::exists(fs::path(tree).concat(".patch.git")));
+}
+
+TEST_CASE(patch_set_hash_follows_contents)
+{
+  scratch_dir scratch("patch_hash");
+  fs::path one = scratch.get() / "1.patch";
+  fs::path two = scratch.get() / "2.patch";
+  std::ofstream(one) << hello_patch("first\nsecond\n", "first\npatched\n");
+  std::ofstream(two) << hello_patch("first\npatched\n", "one\npatched\n");
+
+  std::string hash = patch_set_hash({one, two});
+  CHECK(patch_set_hash({one, two}) == hash);
+  CHECK(patch_set_hash({two, one}) != hash);
+  std::ofstream(two) << hello_patch("first\npatched\n", "two\npatched\n");
+  CHECK(patch_set_hash({one, two}) != hash);
+}
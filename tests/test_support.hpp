@@ -0,0 +1,91 @@
+#ifndef _DEPMGR_TEST_SUPPORT_HPP_
+#define _DEPMGR_TEST_SUPPORT_HPP_
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <fmt/format.h>
+
+#include "graph.hpp"
+#include "toml.hpp"
+#include "util.hpp"
+
+/// A failed expectation, reported by main with where it was checked.
+class test_failure : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
+
+inline void check(bool passed, const char *condition, const char *file, int line)
+{
+  if (!passed) { throw test_failure(fmt::format("{}:{}: CHECK({}) failed", file, line, condition)); }
+}
+
+#define CHECK(condition) check(bool(condition), #condition, __FILE__, __LINE__)
+
+using test_function = void (*)();
+
+/// Every test by name, filled in by TEST_CASE before main runs.
+inline std::map<std::string_view, test_function> &test_registry()
+{
+  static std::map<std::string_view, test_function> tests;
+  return tests;
+}
+
+struct test_registration
+{
+  test_registration(std::string_view name, test_function test) { test_registry().emplace(name, test); }
+};
+
+/// Defines a test called `name`, which also has to be listed in
+/// tests/CMakeLists.txt for CTest to run it.
+#define TEST_CASE(name)                                               \
+  static void name();                                                 \
+  static const test_registration name##_registration(#name, name); \
+  static void name()
+
+/// Empty directory for one test, removed with everything in it afterwards.
+class scratch_dir
+{
+  std::filesystem::path path;
+
+public:
+  explicit scratch_dir(std::string_view name)
+      : path(std::filesystem::temp_directory_path() / fmt::format("depmgr_tests-{}-{}", name, current_process_id()))
+  {
+    std::filesystem::remove_all(path);
+    std::filesystem::create_directories(path);
+  }
+  ~scratch_dir() { std::filesystem::remove_all(path); }
+
+  const std::filesystem::path &get() const { return path; }
+};
+
+/// Manifests served from memory by path, as nested manifests of local
+/// packages under /virtual.
+class manifest_set
+{
+  std::map<std::string, std::shared_ptr<const toml_document>> documents;
+
+public:
+  void add(const std::string &path, std::string source)
+  {
+    documents.insert_or_assign(
+      path, std::make_shared<const toml_document>(toml_document::parse(std::move(source), path)));
+  }
+
+  manifest_loader loader() const
+  {
+    return [this](const std::filesystem::path &path) -> std::shared_ptr<const toml_document> {
+      auto it = documents.find(path.generic_string());
+      return it == documents.end() ? nullptr : it->second;
+    };
+  }
+};
+
+#endif /* _DEPMGR_TEST_SUPPORT_HPP_ */
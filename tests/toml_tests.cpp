@@ -0,0 +1,110 @@
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "package.hpp"
+#include "test_support.hpp"
+#include "toml.hpp"
+
+namespace {
+
+constexpr toml_schema<12> schema({"path",
+  "git",
+  "url",
+  "tag",
+  "rev",
+  "remote",
+  "hash",
+  "configure",
+  "cmake-lists",
+  "options",
+  "prebuilt",
+  "patches"});
+
+static_assert(schema.index("tag") == 3, "keys are indexed in declaration order");
+static_assert(schema.find("missing") == schema.size());
+static_assert(schema.mask({"path", "url"}) == 0b101);
+
+/// Table node with a string child for each of `keys`.
+struct table_node
+{
+  std::vector<toml_node> children;
+  toml_node table;
+
+  explicit table_node(std::initializer_list<std::string_view> keys)
+  {
+    for (auto key : keys) {
+      toml_node &child = children.emplace_back();
+      child.key = key;
+      child.type = toml_type::STRING;
+    }
+    table.children = children.data();
+    table.count = children.size();
+  }
+};
+
+/// Why the dependency tables in `source` can't be parsed.
+std::optional<std::string> manifest_error(std::string source)
+{
+  toml_document document = toml_document::parse(std::move(source), "dependencies.toml");
+  return find_package_error(document.root());
+}
+
+}// namespace
+
+TEST_CASE(toml_schema_finds_every_key)
+{
+  for (size_t i = 0; i < schema.size(); i++) { CHECK(schema.find(schema.key(i)) == i); }
+  for (std::string_view key : {"", "pat", "paths", "tags", "Git", "cmake_lists"}) {
+    CHECK(schema.find(key) == schema.size());
+  }
+}
+
+TEST_CASE(toml_schema_decodes_in_one_pass)
+{
+  table_node node({"tag", "git", "tga", "options"});
+  toml_fields<schema.size()> fields = schema.decode(node.table);
+  CHECK(fields.nodes[schema.index("git")] == &node.children[1]);
+  CHECK(fields.nodes[schema.index("tag")] == &node.children[0]);
+  CHECK(fields.nodes[schema.index("options")] == &node.children[3]);
+  CHECK(fields.nodes[schema.index("url")] == nullptr);
+  CHECK(fields.unknown.size() == 1 && fields.unknown[0] == &node.children[2]);
+  CHECK(fields.get<std::string_view>(schema.index("git")).has_value());
+  CHECK(!fields.get<bool>(schema.index("git")).has_value());
+
+  CHECK(schema.closest("tga") == "tag");
+  CHECK(schema.closest("cmake_lists") == "cmake-lists");
+  CHECK(schema.closest("prebuild") == "prebuilt");
+  CHECK(!schema.closest("submodules").has_value());
+}
+
+TEST_CASE(package_key_errors)
+{
+  CHECK(!manifest_error("[a]\ngit = \"https://example.com/a.git\"\ntag = \"v1\"\n").has_value());
+
+  auto unknown = manifest_error("[a]\ngit = \"https://example.com/a.git\"\ntga = \"v1\"\n");
+  CHECK(unknown.has_value());
+  CHECK(unknown->find("unknown keys in 'a': 'tga' (did you mean 'tag'?)") != std::string::npos);
+
+  // Keys of another kind of package don't apply.
+  auto foreign = manifest_error("[a]\ngit = \"https://example.com/a.git\"\nhash = \"SHA256=00\"\n");
+  CHECK(foreign.has_value());
+  CHECK(foreign->find("'a' is a git package, 'hash' doesn't apply to it") != std::string::npos);
+
+  auto kindless = manifest_error("[a]\ntag = \"v1\"\n");
+  CHECK(kindless.has_value());
+  CHECK(kindless->find("unknown remote type for 'a'") != std::string::npos);
+}
+
+TEST_CASE(prebuilt_configure_rejected)
+{
+  std::string_view package = "[a]\nurl = \"https://example.com/a.tar.gz\"\nconfigure = \"configure.cmake\"\n";
+  CHECK(!manifest_error(std::string(package)).has_value());
+  CHECK(!manifest_error(std::string(package) + "prebuilt = false\n").has_value());
+  for (std::string_view prebuilt : {"prebuilt = true\n", "prebuilt = \"A\"\n"}) {
+    auto error = manifest_error(std::string(package) + std::string(prebuilt));
+    CHECK(error.has_value());
+    CHECK(error->find("a is prebuilt") != std::string::npos);
+  }
+}
@@ -0,0 +1,139 @@
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "test_support.hpp"
+#include "vendor.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+void write(const fs::path &path, std::string_view contents)
+{
+  fs::create_directories(path.parent_path());
+  std::ofstream(path, std::ios::binary) << contents;
+}
+
+/// Opens the pack at `path`, returning the vendor_error it failed with.
+std::optional<std::string> open_error(const fs::path &path)
+{
+  try {
+    vendor_pack::open(path);
+  } catch (const vendor_error &error) {
+    return error.what();
+  }
+  return std::nullopt;
+}
+
+}// namespace
+
+TEST_CASE(vendor_pack_round_trip)
+{
+  scratch_dir scratch("vendor");
+  fs::path one = scratch.get() / "one";
+  write(one / "a.txt", "same");
+  write(one / "sub" / "b.txt", "same");
+  write(one / "run.sh", "#!/bin/sh\n");
+  fs::permissions(one / "run.sh", fs::perms::owner_exec, fs::perm_options::add);
+  fs::create_symlink("a.txt", one / "link");
+  fs::create_directories(one / "empty");
+  write(one / ".git" / "HEAD", "ref: refs/heads/main\n");
+  fs::path two = scratch.get() / "two";
+  write(two / "c.txt", "same");
+  write(two / "d.txt", "other");
+
+  fs::path path = scratch.get() / "dependencies.vendor";
+  write_vendor_pack({{"one", "stamp-one", one}, {"two", "stamp-two", two}}, path);
+
+  // Equal contents share a blob, across packages too: "same", the script,
+  // the link target and "other".
+  std::optional<std::string> contents = read_file(path);
+  CHECK(contents.has_value() && contents->size() >= sizeof(vendor_header));
+  vendor_header header;
+  std::memcpy(&header, contents->data(), sizeof(header));
+  CHECK(header.package_count == 2);
+  CHECK(header.blob_count == 4);
+
+  std::optional<vendor_pack> pack = vendor_pack::open(path);
+  CHECK(pack.has_value());
+  CHECK(pack->find("one", "stale") == nullptr);
+  CHECK(pack->find("three", "stamp-one") == nullptr);
+  const vendor_package *packed = pack->find("one", "stamp-one");
+  CHECK(packed != nullptr);
+
+  fs::path dest = scratch.get() / "dest";
+  write(dest / "leftover.txt", "replaced");
+  pack->extract(*packed, dest);
+  CHECK(read_file(dest / "a.txt") == "same");
+  CHECK(read_file(dest / "sub" / "b.txt") == "same");
+  CHECK(read_file(dest / "run.sh") == "#!/bin/sh\n");
+  CHECK((fs::status(dest / "run.sh").permissions() & fs::perms::owner_exec) != fs::perms::none);
+  CHECK(fs::read_symlink(dest / "link") == "a.txt");
+  CHECK(fs::is_directory(dest / "empty"));
+  CHECK(!fs::exists(dest / ".git"));
+  CHECK(!fs::exists(dest / "leftover.txt"));
+
+  pack->extract(*pack->find("two", "stamp-two"), dest);
+  CHECK(read_file(dest / "c.txt") == "same");
+  CHECK(read_file(dest / "d.txt") == "other");
+}
+
+TEST_CASE(vendor_symlink_escapes)
+{
+  scratch_dir scratch("vendor_symlink");
+  fs::path up = scratch.get() / "up";
+  fs::create_directories(up);
+  fs::create_symlink("../..", up / "link");
+  fs::path root = scratch.get() / "root";
+  fs::create_directories(root);
+  fs::create_symlink("/etc", root / "link");
+
+  fs::path path = scratch.get() / "dependencies.vendor";
+  write_vendor_pack({{"up", "stamp", up}, {"root", "stamp", root}}, path);
+  std::optional<vendor_pack> pack = vendor_pack::open(path);
+  CHECK(pack.has_value());
+
+  fs::path dest = scratch.get() / "dest";
+  for (std::string_view name : {"up", "root"}) {
+    bool thrown = false;
+    try {
+      pack->extract(*pack->find(name, "stamp"), dest);
+    } catch (const vendor_error &) {
+      thrown = true;
+    }
+    CHECK(thrown);
+    CHECK(!fs::exists(dest));
+  }
+}
+
+TEST_CASE(vendor_broken_pack)
+{
+  scratch_dir scratch("vendor_broken");
+  fs::path path = scratch.get() / "dependencies.vendor";
+  CHECK(!vendor_pack::open(path).has_value());
+
+  write(path, "not a vendor pack");
+  CHECK(open_error(path).has_value());
+
+  fs::path sources = scratch.get() / "sources";
+  write(sources / "file.txt", "contents");
+  write_vendor_pack({{"sources", "stamp", sources}}, path);
+  CHECK(!open_error(path).has_value());
+  // Blobs are only checked when they're extracted.
+  fs::resize_file(path, fs::file_size(path) - 1);
+  std::optional<vendor_pack> pack = vendor_pack::open(path);
+  bool thrown = false;
+  try {
+    pack->extract(*pack->find("sources", "stamp"), scratch.get() / "dest");
+  } catch (const vendor_error &) {
+    thrown = true;
+  }
+  CHECK(thrown);
+  pack.reset();
+  fs::resize_file(path, sizeof(vendor_header) + 1);
+  CHECK(open_error(path).has_value());
+}